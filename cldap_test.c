@@ -0,0 +1,185 @@
+/*
+ * -----------------------------------------------------------------------------
+ *
+ * Author: Markus Moeller (markus_moeller at compuserve.com)
+ *
+ * Copyright (C) 2007 Markus Moeller. All rights reserved.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * -----------------------------------------------------------------------------
+ */
+
+
+/*
+ * Check of the netlogon ping (support_site.c): the encoding of the
+ * request, the parsing of a canned answer of an AD server and a ping to a
+ * stub responder on the loopback address given with CLDAP_SERVER.
+ *
+ * Run with "make check".
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "support_site.c"
+
+/*
+ * (&(DnsDomain=example.com)(NtVer=\06\00\00\00)) with message id 0x1234
+ */
+static const unsigned char ping_request[] = {
+  0x30, 0x4e, 0x02, 0x02, 0x12, 0x34, 0x63, 0x48, 0x04, 0x00, 0x0a, 0x01,
+  0x00, 0x0a, 0x01, 0x00, 0x02, 0x01, 0x00, 0x02, 0x01, 0x00, 0x01, 0x01,
+  0x00, 0xa0, 0x29, 0xa3, 0x18, 0x04, 0x09, 0x44, 0x6e, 0x73, 0x44, 0x6f,
+  0x6d, 0x61, 0x69, 0x6e, 0x04, 0x0b, 0x65, 0x78, 0x61, 0x6d, 0x70, 0x6c,
+  0x65, 0x2e, 0x63, 0x6f, 0x6d, 0xa3, 0x0d, 0x04, 0x05, 0x4e, 0x74, 0x56,
+  0x65, 0x72, 0x04, 0x04, 0x06, 0x00, 0x00, 0x00, 0x30, 0x0a, 0x04, 0x08,
+  0x4e, 0x65, 0x74, 0x6c, 0x6f, 0x67, 0x6f, 0x6e
+};
+
+/*
+ * searchResEntry with a NETLOGON_SAM_LOGON_RESPONSE_EX (forest and domain
+ * example.com, server dc1.example.com, server site Default-First-Site-Name,
+ * client site Branch) and searchResDone, message id 0x1234
+ */
+
+static const unsigned char ping_response[] = {
+  0x30, 0x7f, 0x02, 0x02, 0x12, 0x34, 0x64, 0x79, 0x04, 0x00, 0x30, 0x75,
+  0x30, 0x73, 0x04, 0x08, 0x6e, 0x65, 0x74, 0x6c, 0x6f, 0x67, 0x6f, 0x6e,
+  0x31, 0x67, 0x04, 0x65, 0x17, 0x00, 0x00, 0x00, 0xfd, 0x03, 0x00, 0x00,
+  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b,
+  0x0c, 0x0d, 0x0e, 0x0f, 0x07, 0x65, 0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65,
+  0x03, 0x63, 0x6f, 0x6d, 0x00, 0xc0, 0x18, 0x03, 0x64, 0x63, 0x31, 0xc0,
+  0x18, 0x07, 0x45, 0x58, 0x41, 0x4d, 0x50, 0x4c, 0x45, 0x00, 0x03, 0x44,
+  0x43, 0x31, 0x00, 0x00, 0x17, 0x44, 0x65, 0x66, 0x61, 0x75, 0x6c, 0x74,
+  0x2d, 0x46, 0x69, 0x72, 0x73, 0x74, 0x2d, 0x53, 0x69, 0x74, 0x65, 0x2d,
+  0x4e, 0x61, 0x6d, 0x65, 0x00, 0x06, 0x42, 0x72, 0x61, 0x6e, 0x63, 0x68,
+  0x00, 0x05, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0x30, 0x0d, 0x02,
+  0x02, 0x12, 0x34, 0x65, 0x07, 0x0a, 0x01, 0x00, 0x04, 0x00, 0x04, 0x00
+};
+
+static int failed=0;
+
+double dc_since(struct timeval *tv) {
+  struct timeval now;
+
+  gettimeofday(&now,NULL);
+  return((now.tv_sec-tv->tv_sec)*1000.0+(now.tv_usec-tv->tv_usec)/1000.0);
+}
+
+int get_srv_hostname_list(struct main_args *margs, struct hstruct **hlist,int nhosts, char *site, char *domain) {
+  margs=margs;
+  site=site;
+  domain=domain;
+  *hlist=NULL;
+  return(nhosts);
+}
+
+int free_hostname_list(struct hstruct **hlist, int nhosts) {
+  int i;
+
+  for (i=0;i<nhosts;i++)
+    free((*hlist)[i].host);
+  if (*hlist)
+    free(*hlist);
+  *hlist=NULL;
+  return(0);
+}
+
+static void check(int ok, const char *what) {
+  fprintf(stdout, "%s: %s\n",ok?"ok":"FAILED",what);
+  if (!ok)
+    failed++;
+}
+
+/*
+ * Answer one netlogon ping on fd with the canned answer
+ */
+static void responder(int fd) {
+  unsigned char buf[1500],resp[sizeof(ping_response)];
+  struct sockaddr_storage from;
+  socklen_t fromlen=sizeof(from);
+  int len;
+
+  len=recvfrom(fd,buf,sizeof(buf),0,(struct sockaddr *)&from,&fromlen);
+  /* same request apart from the message id */
+  if (len != (int)sizeof(ping_request) || memcmp(buf+6,ping_request+6,len-6))
+    _exit(1);
+  memcpy(resp,ping_response,sizeof(resp));
+  resp[4]=buf[4];
+  resp[5]=buf[5];
+  resp[ping_response[1]+2+4]=buf[4];
+  resp[ping_response[1]+2+5]=buf[5];
+  sendto(fd,resp,sizeof(resp),0,(struct sockaddr *)&from,fromlen);
+  _exit(0);
+}
+
+int main(void) {
+  struct main_args margs;
+  struct sockaddr_in addr;
+  socklen_t addrlen=sizeof(addr);
+  unsigned char buf[1500];
+  char env[64];
+  char *site;
+  int len,fd,status,ok;
+  pid_t pid;
+
+  memset(&margs,0,sizeof(margs));
+
+  len=cldap_request(buf,(char *)"example.com",0x1234);
+  check(len == (int)sizeof(ping_request) && !memcmp(buf,ping_request,len),"netlogon ping request encoding");
+
+  site=cldap_response(&margs,ping_response,sizeof(ping_response),0x1234);
+  check(site && !strcmp(site,"Branch"),"client site of netlogon answer");
+  if (site)
+    free(site);
+
+  site=cldap_response(&margs,ping_response,sizeof(ping_response),0x1235);
+  check(site == NULL,"answer with other message id ignored");
+
+  ok=1;
+  for (len=0;len<ping_response[1]+2;len++) {
+    if ((site=cldap_response(&margs,ping_response,len,0x1234))) {
+      free(site);
+      ok=0;
+    }
+  }
+  check(ok,"truncated answers rejected");
+
+  fd=socket(AF_INET,SOCK_DGRAM,0);
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family=AF_INET;
+  addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+  if (fd < 0 || bind(fd,(struct sockaddr *)&addr,sizeof(addr)) || getsockname(fd,(struct sockaddr *)&addr,&addrlen)) {
+    check(0,"stub responder socket");
+    return(1);
+  }
+  fflush(stdout);
+  if ((pid=fork()) == 0)
+    responder(fd);
+  close(fd);
+  snprintf(env,sizeof(env),"CLDAP_SERVER=127.0.0.1:%d",ntohs(addr.sin_port));
+  putenv(env);
+  site=get_site(&margs,(char *)"example.com");
+  check(site && !strcmp(site,"Branch"),"site from stub responder via CLDAP_SERVER");
+  waitpid(pid,&status,0);
+  check(WIFEXITED(status) && WEXITSTATUS(status) == 0,"stub responder got the expected request");
+  site_cleanup();
+
+  return(failed ? 1 : 0);
+}
@@ -85,6 +85,9 @@
 /* Define to 1 if you have LDAP_REBIND_PROC */
 #define HAVE_LDAP_REBIND_PROC 1
 
+/* Define to 1 if you have ldap_sasl_interactive_bind */
+#define HAVE_LDAP_SASL_INTERACTIVE_BIND 1
+
 /* Define to 1 if you have LDAP_SCOPE_DEFAULT */
 #define HAVE_LDAP_SCOPE_DEFAULT 1
 
@@ -103,6 +106,9 @@
 /* Define to 1 if you have the `sasl2' library (-lsasl2). */
 /* #undef HAVE_LIBSASL2 */
 
+/* Define to 1 if you have the `ssl' library (-lssl). */
+/* #undef HAVE_LIBSSL */
+
 /* Define to 1 if you have the <memory.h> header file. */
 #define HAVE_MEMORY_H 1
 
@@ -118,6 +124,9 @@
 /* Define to 1 if you have Openldap */
 #define HAVE_OPENLDAP 1
 
+/* Define to 1 if you have the <openssl/ssl.h> header file. */
+/* #undef HAVE_OPENSSL_SSL_H */
+
 /* Define to 1 if Mac Darwin without sasl.h */
 /* #undef HAVE_SASL_DARWIN */
 
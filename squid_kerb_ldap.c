@@ -31,6 +31,7 @@
  */
 #include <unistd.h>
 #include <ctype.h>
+#include <sys/select.h>
 
 #include "support.h"
 
@@ -38,6 +39,7 @@ void init_args(struct main_args *margs) {
   margs->nlist=NULL;
   margs->glist=NULL;
   margs->llist=NULL;
+  margs->mlist=NULL;
   margs->ulist=NULL;
   margs->tlist=NULL;
   margs->luser=NULL;
@@ -45,20 +47,40 @@ void init_args(struct main_args *margs) {
   margs->lbind=NULL;
   margs->lurl=NULL;
   margs->ssl=NULL;
+  margs->plist=NULL;
+  margs->plisten=NULL;
+  margs->pkey=NULL;
+  margs->hfile=NULL;
+  margs->wlist=NULL;
   margs->rc_allow=0;
   margs->debug=0;
   margs->log=0;
   margs->AD=0;
   margs->mdepth=5;
+  margs->gmethod=GM_TREE;
+  margs->cttl=0;
+  margs->nttl=0;
+  margs->concurrent=0;
+  margs->bwindow=2;
+  margs->bmax=50;
+  margs->itimeout=300;
+  margs->ttimeout=3600;
+  margs->warmup=0;
+  margs->hedge=0;
+  margs->affinity=0;
+  margs->plife=600;
+  margs->preqs=10000;
   margs->ddomain=NULL;
   margs->groups=NULL;
   margs->ndoms=NULL;
   margs->lservs=NULL;
+  margs->usfxs=NULL;
 }
 
 void  clean_gd(struct gdstruct *gdsp);
 void  clean_nd(struct ndstruct *ndsp);
 void  clean_ls(struct lsstruct *lssp);
+void  clean_us(struct usstruct *ussp);
 
 void  clean_gd(struct gdstruct *gdsp) {
   struct gdstruct *p=NULL,*pp=NULL;
@@ -147,6 +169,35 @@ start:
   goto start;
 }
 
+void  clean_us(struct usstruct *ussp) {
+  struct usstruct *p=NULL,*pp=NULL;
+
+start:
+  p=ussp;
+  if (!p) return;
+  while (p->next) {
+    pp=p;
+    p=p->next;
+  }
+  if (p->suffix) {
+      free(p->suffix);
+      p->suffix=NULL;
+  }
+  if (p->domain) {
+      free(p->domain);
+      p->domain=NULL;
+  }
+  if (pp && pp->next) {
+    free(pp->next);
+    pp->next=NULL;
+  }
+  if (p == ussp) {
+     free(ussp);
+     ussp=NULL;
+  }
+  goto start;
+}
+
 void clean_args(struct main_args *margs) {
   if (margs->glist) {
       free(margs->glist);
@@ -168,6 +219,10 @@ void clean_args(struct main_args *margs) {
       free(margs->llist);
       margs->llist=NULL;
   }
+  if (margs->mlist) {
+      free(margs->mlist);
+      margs->mlist=NULL;
+  }
   if (margs->luser) {
       free(margs->luser);
       margs->luser=NULL;
@@ -188,6 +243,28 @@ void clean_args(struct main_args *margs) {
       free(margs->ssl);
       margs->ssl=NULL;
   }
+  if (margs->plist) {
+      free(margs->plist);
+      margs->plist=NULL;
+  }
+  if (margs->plisten) {
+      free(margs->plisten);
+      margs->plisten=NULL;
+  }
+  if (margs->pkey) {
+      free(margs->pkey);
+      margs->pkey=NULL;
+  }
+  if (margs->wlist) {
+      notify_cleanup(margs);
+      free(margs->wlist);
+      margs->wlist=NULL;
+  }
+  if (margs->hfile) {
+      hh_cleanup(margs);
+      free(margs->hfile);
+      margs->hfile=NULL;
+  }
   if (margs->ddomain) {
       free(margs->ddomain);
       margs->ddomain=NULL;
@@ -204,25 +281,35 @@ void clean_args(struct main_args *margs) {
       clean_ls(margs->lservs);
       margs->lservs=NULL;
   }
+  if (margs->usfxs) {
+      clean_us(margs->usfxs);
+      margs->usfxs=NULL;
+  }
+  pool_cleanup(margs);
+  dc_cleanup();
+  site_cleanup();
+#ifdef TLS_RESUME
+  tls_cleanup();
+#endif
+  peer_cleanup();
+  cache_cleanup();
 
 }
 
-void strup(char *s);
-
 int main (int argc, char * const argv[]) {
   char buf[6400];
-  char *user,*domain;
-  char *nuser,*nuser8=NULL,*netbios;
   char *c;
   int opt;
+  int verdict;
   struct main_args margs;
+  struct custruct cu;
 
   setbuf(stdout,NULL);
   setbuf(stdin,NULL);
   
   init_args(&margs);
 
-  while (-1 != (opt = getopt(argc, argv, "diasg:D:N:S:u:U:t:T:p:l:b:m:h"))) {
+  while (-1 != (opt = getopt(argc, argv, "diasCwQAG:g:D:N:S:M:u:U:t:T:p:l:b:m:c:e:B:P:L:K:H:W:I:E:R:h"))) {
     switch (opt) {
     case 'd':
       margs.debug = 1;
@@ -271,12 +358,83 @@ int main (int argc, char * const argv[]) {
     case 'm':
       margs.mdepth = atoi(optarg);
       break;
+    case 'G':
+      if (!strcasecmp(optarg,"tree"))
+        margs.gmethod = GM_TREE;
+      else if (!strcasecmp(optarg,"chain"))
+        margs.gmethod = GM_CHAIN;
+      else if (!strcasecmp(optarg,"token"))
+        margs.gmethod = GM_TOKEN;
+      else
+        fprintf(stderr, "%s| %s: unknown group method %s\n", LogTime(), PROGRAM, optarg);
+      break;
     case 'S':
       margs.llist = strdup(optarg);
       break;
+    case 'M':
+      margs.mlist = strdup(optarg);
+      break;
+    case 'c':
+      margs.cttl = atoi(optarg);
+      break;
+    case 'e':
+      margs.nttl = atoi(optarg);
+      break;
+    case 'C':
+      margs.concurrent = 1;
+      break;
+    case 'B':
+      margs.bwindow = atoi(optarg);
+      if ((c=strchr(optarg,':')))
+        margs.bmax = atoi(c+1);
+      if (margs.bwindow < 0)
+        margs.bwindow = 0;
+      if (margs.bmax < 1)
+        margs.bmax = 1;
+      break;
+    case 'P':
+      margs.plist = strdup(optarg);
+      break;
+    case 'L':
+      margs.plisten = strdup(optarg);
+      break;
+    case 'K':
+      margs.pkey = strdup(optarg);
+      break;
+    case 'H':
+      margs.hfile = strdup(optarg);
+      break;
+    case 'W':
+      margs.wlist = strdup(optarg);
+      break;
+    case 'I':
+      margs.itimeout = atoi(optarg);
+      break;
+    case 'w':
+      margs.warmup = 1;
+      break;
+    case 'Q':
+      margs.hedge = 1;
+      break;
+    case 'A':
+      margs.affinity = 1;
+      break;
+    case 'E':
+      margs.ttimeout = atoi(optarg);
+      break;
+    case 'R':
+      margs.plife = atoi(optarg);
+      margs.preqs = 0;
+      if ((c=strchr(optarg,':')))
+        margs.preqs = atoi(c+1);
+      if (margs.plife < 0)
+        margs.plife = 0;
+      if (margs.preqs < 0)
+        margs.preqs = 0;
+      break;
     case 'h':
       fprintf(stderr, "Usage: \n");
-      fprintf(stderr, "squid_kerb_ldap [-d] [-i] -g group list [-D domain] [-N netbios domain map] [-s] [-u ldap user] [-p ldap user password] [-l ldap url] [-b ldap bind path] [-a] [-m max depth] [-h]\n");
+      fprintf(stderr, "squid_kerb_ldap [-d] [-i] -g group list [-D domain] [-N netbios domain map] [-M upn suffix domain map] [-s] [-u ldap user] [-p ldap user password] [-l ldap url] [-b ldap bind path] [-a] [-m max depth] [-G group method] [-I idle timeout] [-R max lifetime] [-E transport ttl] [-w] [-Q] [-A] [-c cache ttl] [-e negative cache ttl] [-C] [-B batch window] [-P peer list] [-L peer listen address] [-K peer key file] [-H heavy hitter file] [-W watch list] [-h]\n");
       fprintf(stderr, "-d full debug\n");
       fprintf(stderr, "-i informational messages\n");
       fprintf(stderr, "-g group list\n");
@@ -285,6 +443,7 @@ int main (int argc, char * const argv[]) {
       fprintf(stderr, "-D default domain\n");
       fprintf(stderr, "-N netbios to dns domain map\n");
       fprintf(stderr, "-S ldap server to dns domain map\n");
+      fprintf(stderr, "-M upn suffix to dns domain map\n");
       fprintf(stderr, "-u ldap user\n");
       fprintf(stderr, "-p ldap user password\n");
       fprintf(stderr, "-l ldap url\n");
@@ -292,6 +451,22 @@ int main (int argc, char * const argv[]) {
       fprintf(stderr, "-s use SSL encryption with Kerberos authentication\n"); 
       fprintf(stderr, "-a allow SSL without cert verification\n");
       fprintf(stderr, "-m maximal depth for recursive searches\n");
+      fprintf(stderr, "-G method for nested AD groups: tree (default, searched by the helper), chain (by the server) or token (tokenGroups of the user)\n");
+      fprintf(stderr, "-I seconds to keep idle ldap connections open (default 300, 0 = close after each check)\n");
+      fprintf(stderr, "-R seconds:requests after which an ldap connection is replaced (default 600:10000, 0 = no limit)\n");
+      fprintf(stderr, "-w connect to the ldap servers of all configured domains at startup\n");
+      fprintf(stderr, "-Q send slow searches to a second ldap server as well\n");
+      fprintf(stderr, "-A always send the searches for a user to the same ldap server of the domain\n");
+      fprintf(stderr, "-E seconds to remember if an ldap server needs ldaps instead of start_tls (default 3600, 0 = off)\n");
+      fprintf(stderr, "-c seconds to cache positive answers (default 0 = no caching)\n");
+      fprintf(stderr, "-e seconds to cache negative answers (default 0 = no caching)\n");
+      fprintf(stderr, "-C concurrent requests with channel-ID (squid concurrency > 0)\n");
+      fprintf(stderr, "-B msec:max batch window for concurrent requests (default 2:50)\n");
+      fprintf(stderr, "-P list of peers to share cached answers with\n");
+      fprintf(stderr, "-L address to listen on for answers from peers\n");
+      fprintf(stderr, "-K file with shared key (at least 16 bytes) for peers\n");
+      fprintf(stderr, "-H file to keep the most requested users and groups in and refresh them when idle\n");
+      fprintf(stderr, "-W list of subtrees to watch for group changes\n");
       fprintf(stderr, "-h help\n");
       fprintf(stderr, "The ldap url, ldap user and ldap user password details are only used if the kerberised\n");
       fprintf(stderr, "access fails(e.g. unknown domain) or if the username does not contain a domain part\n");
@@ -311,6 +486,16 @@ int main (int argc, char * const argv[]) {
       fprintf(stderr, "server@  - In this case server can be used for all Kerberos domains\n");
       fprintf(stderr, "server@domain  - In this case server can be used for Kerberos domain domain\n");
       fprintf(stderr, "server1a@domain1:server1b@domain1:server2@domain2:server3@:server4 - A list is build with a colon as seperator\n");
+      fprintf(stderr, "The upn suffix list can be:\n");
+      fprintf(stderr, "suffix1@domain1:suffix2@domain1 - A list is build with a colon as seperator\n");
+      fprintf(stderr, "Users are cached under one key whether squid sends NETBIOS\\user, user@upnsuffix, user@DOMAIN\n");
+      fprintf(stderr, "or user with a default domain\n");
+      fprintf(stderr, "With -C users of one domain arriving within the batch window are searched for together\n");
+      fprintf(stderr, "The peer list can be:\n");
+      fprintf(stderr, "host1:port1,[ipv6]:port2,multicast-group:port3 - A list is build with a comma as seperator\n");
+      fprintf(stderr, "The peer listen address can be [host:]port or multicast-group:port\n");
+      fprintf(stderr, "The watch list can be:\n");
+      fprintf(stderr, "base1@domain1:base2@domain2 - A list is build with a colon as seperator\n");
       clean_args(&margs);
       exit(0);
     default:
@@ -342,8 +527,50 @@ int main (int argc, char * const argv[]) {
     clean_args(&margs);
     exit(1);
   }
+
+  if (create_us(&margs)) {
+    if (margs.debug)
+      fprintf(stderr, "%s| %s: Error in upn suffix list: %s\n",LogTime(), PROGRAM,margs.mlist?margs.mlist:"NULL");
+    fprintf(stdout, "ERR\n");
+    clean_args(&margs);
+    exit(1);
+  }
+
+  if (peer_init(&margs)) {
+    if (margs.debug)
+      fprintf(stderr, "%s| %s: Error in peer setup: %s\n",LogTime(), PROGRAM,margs.plist?margs.plist:"NULL");
+    fprintf(stdout, "ERR\n");
+    clean_args(&margs);
+    exit(1);
+  }
+
+  if (notify_init(&margs)) {
+    if (margs.debug)
+      fprintf(stderr, "%s| %s: Error in watch list: %s\n",LogTime(), PROGRAM,margs.wlist?margs.wlist:"NULL");
+    fprintf(stdout, "ERR\n");
+    clean_args(&margs);
+    exit(1);
+  }
+
+  hh_load(&margs);
+
+  if (margs.warmup)
+    pool_warmup(&margs);
+
+  if (margs.concurrent) {
+    int rc;
+
+    rc=batch_loop(&margs);
+    clean_args(&margs);
+    exit(rc);
+  }
   
   while (1) {
+    /*
+     * Wait for squid and take in answers from peers and change
+     * notifications and close idle ldap connections meanwhile
+     */
+    wait_input(&margs,-1);
     if (fgets(buf, sizeof(buf)-1, stdin) == NULL) {
       if (ferror(stdin)) {
         if (margs.debug)
@@ -368,44 +595,32 @@ int main (int argc, char * const argv[]) {
       continue;
     }
 
-    user = buf;
-    nuser = strchr(user, '\\');
-    if (!nuser)
-    	nuser8 = strstr(user, "%5C");
-    if (!nuser && !nuser8) 
-    	nuser8 = strstr(user, "%5c");
-    domain = strrchr(user, '@');
-    if (nuser || nuser8) {
-      if (nuser) {
-        *nuser = '\0';
-        nuser++;
-      } else {
-        *nuser8 = '\0';
-      	nuser=nuser8+3;
-      }
-      netbios=user;
-      if (margs.debug || margs.log)
-        fprintf(stderr, "%s| %s: Got User: %s Netbios Name: %s\n",LogTime(), PROGRAM,nuser,netbios);
-      domain=get_netbios_name(&margs,netbios);
-      user=nuser;
-    } else if (domain) {
-      strup(domain);
-      *domain = '\0';
-      domain++;
-    } 
-    if (!domain && margs.ddomain) {
-      domain=strdup(margs.ddomain);
-      if (margs.debug || margs.log)
-        fprintf(stderr, "%s| %s: Got User: %s set default domain: %s\n",LogTime(), PROGRAM,user,domain);
+    if (canon_user(&margs,buf,&cu)) {
+      fprintf(stdout, "ERR\n");
+      if (margs.debug)
+        fprintf(stderr, "%s| %s: ERR\n",LogTime(), PROGRAM);
+      continue;
     }
     if (margs.debug || margs.log)
-      fprintf(stderr, "%s| %s: Got User: %s Domain: %s\n",LogTime(), PROGRAM,user,domain?domain:"NULL");
+      fprintf(stderr, "%s| %s: Got User: %s Domain: %s\n",LogTime(), PROGRAM,cu.user,cu.domain?cu.domain:"NULL");
 
-    if (!strcmp(user,"QQ") && domain && !strcmp(domain,"QQ")){
+    if (!strcmp(cu.user,"QQ") && cu.domain && !strcmp(cu.domain,"QQ")){
+        clean_cu(&cu);
         clean_args(&margs);
         exit(-1);
     }
-    if (check_memberof(&margs,user,domain)) {
+    hh_user(&margs,cu.key,cu.user);
+    if (!cache_get(&margs,cu.key,&verdict)) {
+      verdict=check_memberof(&margs,cu.user,cu.domain);
+      /* answer ERR for now but do not remember a failed lookup */
+      if (verdict == MEMBER_ERROR)
+        verdict=0;
+      else {
+        cache_put(&margs,cu.key,verdict);
+        peer_send_verdict(&margs,cu.key,verdict);
+      }
+    }
+    if (verdict) {
       fprintf(stdout, "OK\n");
       if (margs.debug)
         fprintf(stderr, "%s| %s: OK\n",LogTime(), PROGRAM);
@@ -414,6 +629,7 @@ int main (int argc, char * const argv[]) {
       if (margs.debug)
         fprintf(stderr, "%s| %s: ERR\n",LogTime(), PROGRAM);
     }
+    clean_cu(&cu);
   } 
 
 
@@ -27,6 +27,8 @@
 #include <stdlib.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/select.h>
+#include <sys/socket.h>
 
 #include "config.h"
 
@@ -56,6 +58,23 @@ struct lsstruct {
   char *domain;
   struct lsstruct *next;
 };
+struct usstruct {
+  char *suffix;
+  char *domain;
+  struct usstruct *next;
+};
+
+/*
+ * How nested AD group membership is determined (-G)
+ */
+#define GM_TREE 0
+#define GM_CHAIN 1
+#define GM_TOKEN 2
+
+/*
+ * Returned by the membership checks if the ldap server could not be asked
+ */
+#define MEMBER_ERROR -2
 
 struct main_args {
   char* glist;
@@ -63,20 +82,40 @@ struct main_args {
   char* tlist;
   char* nlist;
   char* llist;
+  char* mlist;
   char* luser;
   char* lpass;
   char* lbind;
   char* lurl;
   char* ssl;
+  char* plist;
+  char* plisten;
+  char* pkey;
+  char* hfile;
+  char* wlist;
   int   rc_allow;
   int   debug;
   int   log;
   int   AD;
   int   mdepth;
+  int   gmethod;
+  int   cttl;
+  int   nttl;
+  int   concurrent;
+  int   bwindow;
+  int   bmax;
+  int   itimeout;
+  int   ttimeout;
+  int   warmup;
+  int   hedge;
+  int   affinity;
+  int   plife;
+  int   preqs;
   char* ddomain;
   struct gdstruct *groups;
   struct ndstruct *ndoms;
   struct lsstruct *lservs;
+  struct usstruct *usfxs;
 }; 
 
 struct kstruct {
@@ -92,32 +131,239 @@ struct hstruct {
   int  weight;
 };
 
+/*
+ * State of an ldap server (see support_dc.c)
+ */
+#define DC_CLOSED 0
+#define DC_OPEN 1
+#define DC_HALFOPEN 2
+
+#define DC_STARTTLS 1
+#define DC_LDAPS 2
+
+struct dcstruct {
+  char *host;
+  int  port;
+  int  state;
+  int  failures;
+  time_t retry;
+  int  transport;
+  int  tport;
+  time_t texpires;
+  double conn_ms;
+  double search_ms;
+  double search_dev;
+  int  conn_samples;
+  int  search_samples;
+  double window;
+  time_t pooled;			/* last new connection for affinity (see pool_get) */
+  struct dcstruct *next;
+};
+
+/*
+ * Address of an ldap server in a connect race (see support_connect.c).
+ * Racing needs ldap_init_fd to hand the connected socket to the library.
+ */
+#if defined(HAVE_OPENLDAP) && defined(LDAP_PROTO_TCP)
+#define CONNECT_RACE 1
+#endif
+
+/*
+ * TLS session resumption (see support_tls.c) needs the TLS connect
+ * callback of OpenLDAP and OpenSSL as its TLS library
+ */
+#if defined(HAVE_OPENLDAP) && defined(LDAP_OPT_X_TLS_CONNECT_CB) && defined(LDAP_OPT_X_TLS_PACKAGE) && defined(HAVE_OPENSSL_SSL_H) && defined(HAVE_LIBSSL)
+#define TLS_RESUME 1
+#endif
+
+/*
+ * Setting up connections without blocking in Start TLS and the SASL bind
+ * (see support_setup.c) needs the stepwise SASL bind of OpenLDAP
+ */
+#if defined(CONNECT_RACE) && defined(HAVE_LDAP_SASL_INTERACTIVE_BIND) && (defined(HAVE_SASL_H) || defined(HAVE_SASL_SASL_H) || defined(HAVE_SASL_DARWIN))
+#define ASYNC_SETUP 1
+#endif
+#define CA_NEW 0
+#define CA_CONNECTING 1
+#define CA_DONE 2
+#define CA_WON 3
+
+struct castruct {
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  int host;
+  int fd;
+  int state;
+  struct timeval start;
+};
+
+/*
+ * Setup of a connection to an ldap server (see support_setup.c)
+ */
+#define SU_TLS 1
+#define SU_SASL 2
+#define SU_DONE 3
+#define SU_FAILED 4
+
+struct sustruct {
+  LDAP *ld;
+  char *host;
+  int  port;
+  char *ssl;
+  char *bindp;
+  int  state;
+  int  msgid;
+  void *defaults;
+  const char *rmech;
+  struct timeval start;
+};
+
 struct ldap_creds {
     char *dn;
     char *pw;
 };
 
+/*
+ * Canonical form of a user as sent by squid:
+ * user is the sAMAccountName as given, domain the upper case Kerberos realm
+ * (or NULL) and key the case folded "user@DOMAIN" used for caching
+ */
+struct custruct {
+  char *user;
+  char *domain;
+  char *key;
+};
+
 
 void init_args(struct main_args *margs);
 void clean_args(struct main_args *margs);
+void strup(char *s);
 static const char *LogTime(void);
 
 int check_memberof(struct main_args *margs,char *user, char *domain);
 int get_memberof(struct main_args *margs,char *user,char *domain,char *group);
+int get_memberof_any(struct main_args *margs,char *user,char *domain,char **groups,int ngroups);
+void group_warmup(struct main_args *margs,LDAP *ld,char *bindp,char *domain);
+int get_memberof_batch(struct main_args *margs,char *domain,char **users,int nusers);
+LDAP *get_ldap_connection(struct main_args *margs,char *domain,char **bind_path,struct ldap_creds **ldap_creds,struct dcstruct **dc);
+int ldap_search_timed(struct main_args *margs,LDAP *ld,char *base,int scope,char *filter,char **attrs,struct timeval *timeout,LDAPMessage **res);
+void free_ldap_connection(struct main_args *margs,LDAP *ld,char *domain,char *bindp,struct ldap_creds *lcreds);
+
+LDAP *pool_get(struct main_args *margs,char *domain,char **bind_path);
+int pool_release(struct main_args *margs,LDAP *ld,int failed);
+int pool_idle(struct main_args *margs,int probe);
+void pool_warmup(struct main_args *margs);
+LDAP *pool_hedge(struct main_args *margs,LDAP *ld);
+struct dcstruct *pool_dc(LDAP *ld);
+void pool_cleanup(struct main_args *margs);
 
 char *get_netbios_name(struct main_args *margs,char *netbios);
 
 int create_gd(struct main_args *margs);
 int create_nd(struct main_args *margs);
 int create_ls(struct main_args *margs);
+int create_us(struct main_args *margs);
+
+char *get_upn_domain(struct main_args *margs,char *suffix);
+int canon_user(struct main_args *margs,char *input,struct custruct *cu);
+void clean_cu(struct custruct *cu);
+char *cache_key(char *user,char *domain);
+
+int cache_get(struct main_args *margs,char *key,int *verdict);
+void cache_put(struct main_args *margs,char *key,int verdict);
+time_t cache_expires(struct main_args *margs,char *key,int *verdict);
+void cache_store(struct main_args *margs,char *key,int verdict,time_t expires);
+int edge_get(struct main_args *margs,char *dn,char ***parents);
+void edge_put(struct main_args *margs,char *dn,char **parents,int nparents);
+void edge_store(struct main_args *margs,char *dn,char **parents,int nparents,time_t expires);
+int uentry_get(struct main_args *margs,char *key,char ***values);
+void uentry_put(struct main_args *margs,char *key,char **values,int nvalues);
+void uentry_clear(void);
+int gref_get(struct main_args *margs,char *key,char ***values);
+void gref_put(struct main_args *margs,char *key,char **values,int nvalues);
+void dep_add(struct main_args *margs,char *dn);
+int cache_invalidate(struct main_args *margs,char *dn,int group);
+void cache_cleanup(void);
+
+int batch_loop(struct main_args *margs);
+int wait_input(struct main_args *margs,long msec);
+
+void hh_user(struct main_args *margs,char *key,char *user);
+void hh_group(struct main_args *margs,char *dn);
+int hh_load(struct main_args *margs);
+void hh_save(struct main_args *margs);
+int hh_idle(struct main_args *margs);
+void hh_cleanup(struct main_args *margs);
+
+int notify_init(struct main_args *margs);
+int notify_fdset(fd_set *rfds,int maxfd);
+void notify_check(struct main_args *margs,fd_set *rfds);
+void notify_idle(struct main_args *margs);
+void notify_cleanup(struct main_args *margs);
+
+int peer_init(struct main_args *margs);
+int peer_fd(void);
+void peer_receive(struct main_args *margs);
+void peer_send_verdict(struct main_args *margs,char *key,int verdict);
+void peer_send_edge(struct main_args *margs,char *dn,char **parents,int nparents);
+void peer_cleanup(void);
 
 int krb5_create_cache(struct main_args *margs, char *domain);
 void krb5_cleanup(void);
 
 int get_ldap_hostname_list(struct main_args *margs, struct hstruct **hlist,int nhosts, char *domain);
+int get_srv_hostname_list(struct main_args *margs, struct hstruct **hlist,int nhosts, char *site, char *domain);
 int get_hostname_list(struct main_args *margs, struct hstruct **hlist,int nhosts, char *name);
 int free_hostname_list(struct hstruct **hlist, int nhosts);
 
+struct dcstruct *dc_get(char *host,int port,int create);
+void dc_latency(struct main_args *margs,struct dcstruct *dp,int conn,double msec);
+double dc_score(char *host,int port);
+double dc_since(struct timeval *tv);
+int dc_filter(struct main_args *margs,struct hstruct *hlist,int nhosts);
+void dc_failed(struct main_args *margs,struct dcstruct *dp);
+void dc_success(struct main_args *margs,struct dcstruct *dp);
+void dc_set_transport(struct main_args *margs,char *host,int port,int transport,int tport);
+int dc_get_transport(struct main_args *margs,char *host,int port,int *tport);
+double dc_hedge_after(struct dcstruct *dp);
+void dc_hedged(struct main_args *margs,struct dcstruct *dp,struct dcstruct *hp,int won);
+void dc_avoid(struct dcstruct *dp);
+int dc_window(struct dcstruct *dp);
+void dc_affinity(char *key);
+void dc_ring(char *domain,struct hstruct *hlist,int nhosts);
+struct dcstruct *dc_preferred(char *domain);
+void dc_window_sample(struct main_args *margs,struct dcstruct *dp,int nusers,double msec,int rc);
+void dc_cleanup(void);
+
+char *cldap_site(struct main_args *margs, char *domain, struct hstruct *hlist, int nhosts);
+char *get_site(struct main_args *margs, char *domain);
+void site_cleanup(void);
+
+#ifdef TLS_RESUME
+void tls_init(struct main_args *margs);
+void tls_save(struct main_args *margs,LDAP *ld);
+void tls_cleanup(void);
+#endif
+
+int connect_list(struct main_args *margs,struct hstruct *hlist,int nhosts,struct castruct **alist);
+int connect_race(struct main_args *margs,struct castruct *alist,int naddrs,int *host);
+
+int ldap_set_ssl_defaults(struct main_args *margs);
+#ifdef CONNECT_RACE
+LDAP *tool_ldap_open_fd(struct main_args *margs, int fd, char* host, int port, char *ssl);
+LDAP *tool_ldaps_open(struct main_args *margs, char* host, int port);
+#endif
+
+#ifdef ASYNC_SETUP
+int setup_start(struct main_args *margs,struct sustruct *sp,int fd,char *host,int port,char *ssl,char *bindp);
+int setup_step(struct main_args *margs,struct sustruct *sp);
+int setup_desc(struct sustruct *sp);
+void setup_cancel(struct sustruct *sp);
+LDAP *setup_race(struct main_args *margs,struct hstruct *hlist,struct castruct *alist,int naddrs,char *bindp,char *ssl,int *host,struct timeval *start);
+int tool_sasl_bind_step(LDAP *ld, char *binddn, char *ssl, LDAPMessage *res, void **defaults, const char **rmech, int *msgid);
+void tool_sasl_freedefs(void *defaults);
+#endif
+
 #if defined(HAVE_SASL_H) || defined(HAVE_SASL_SASL_H) || defined(HAVE_SASL_DARWIN)
 int tool_sasl_bind( LDAP *ld , char *binddn, char* ssl);
 #endif
@@ -0,0 +1,346 @@
+/*
+ * -----------------------------------------------------------------------------
+ *
+ * Author: Markus Moeller (markus_moeller at compuserve.com)
+ *
+ * Copyright (C) 2007 Markus Moeller. All rights reserved.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * -----------------------------------------------------------------------------
+ */
+
+
+#include <sys/select.h>
+#include <unistd.h>
+
+#include "support.h"
+
+/*
+ * Concurrent helper protocol (-C): every request line starts with a
+ * channel-ID which is echoed in front of the answer. Cache hits and
+ * invalid lines are answered as soon as they are read. Cache misses
+ * arriving within the batch window (-B ms:max, counted from the first
+ * miss) are answered together:
+ *
+ *   1. coalesce requests for the same canonical user
+ *   2. fetch the memberOf values of all missing users of one domain with a
+ *      single OR-filter search (get_memberof_batch)
+ *   3. check each unique user and fan the verdict out to its requests
+ *
+ * Users beyond the window of the ldap server (see support_dc.c) which no
+ * other pooled server took are kept with their requests for the next
+ * batch.
+ */
+
+struct bstruct {
+  char *channel;
+  struct custruct cu;
+  int  verdict;
+  int  dup;
+  int  defer;
+};
+
+static int batch_read(struct main_args *margs,struct bstruct *bl,int *nbl);
+static void batch_answer(struct main_args *margs,struct bstruct *bl,int nbl,int defer);
+static void batch_prefetch(struct main_args *margs,struct bstruct *bl,int nbl,int defer);
+static void batch_reply(struct main_args *margs,char *channel,int verdict);
+
+static void batch_reply(struct main_args *margs,char *channel,int verdict) {
+  fprintf(stdout, "%s %s\n",channel,verdict?"OK":"ERR");
+  if (margs->debug)
+    fprintf(stderr, "%s| %s: %s %s\n",LogTime(), PROGRAM,channel,verdict?"OK":"ERR");
+}
+
+/*
+ * Wait msec milliseconds (forever if < 0) for a request from squid while
+ * taking in answers from peers and change notifications and refreshing
+ * heavy hitters when idle. Returns 1 if stdin is readable.
+ */
+int wait_input(struct main_args *margs,long msec) {
+  fd_set rfds;
+  struct timeval tv,now,end;
+  int maxfd,n,tick;
+
+  tick = margs->hfile || margs->wlist;
+  gettimeofday(&end,NULL);
+  end.tv_sec += msec/1000;
+  end.tv_usec += (msec%1000)*1000;
+  if (end.tv_usec >= 1000000) {
+    end.tv_sec++;
+    end.tv_usec -= 1000000;
+  }
+  while (1) {
+    notify_idle(margs);
+    /* wake up to check and close idle ldap connections */
+    if (pool_idle(margs,msec < 0) > 0)
+      tick=1;
+    FD_ZERO(&rfds);
+    FD_SET(fileno(stdin),&rfds);
+    maxfd=fileno(stdin);
+    if (peer_fd() >= 0) {
+      FD_SET(peer_fd(),&rfds);
+      if (peer_fd() > maxfd)
+        maxfd=peer_fd();
+    }
+    maxfd=notify_fdset(&rfds,maxfd);
+    if (msec >= 0) {
+      gettimeofday(&now,NULL);
+      tv.tv_sec = end.tv_sec - now.tv_sec;
+      tv.tv_usec = end.tv_usec - now.tv_usec;
+      if (tv.tv_usec < 0) {
+        tv.tv_sec--;
+        tv.tv_usec += 1000000;
+      }
+      if (tv.tv_sec < 0)
+        return(0);
+    }
+    if (msec < 0 && tick) {
+      tv.tv_sec=1;
+      tv.tv_usec=0;
+    }
+    n=select(maxfd+1,&rfds,NULL,NULL,(msec >= 0 || tick) ? &tv : NULL);
+    if (n < 0)
+      continue;
+    if (n == 0 && msec < 0) {
+      hh_idle(margs);
+      continue;
+    }
+    if (peer_fd() >= 0 && FD_ISSET(peer_fd(),&rfds))
+      peer_receive(margs);
+    notify_check(margs,&rfds);
+    if (FD_ISSET(fileno(stdin),&rfds))
+      return(1);
+    if (msec >= 0) {
+      gettimeofday(&now,NULL);
+      if (now.tv_sec > end.tv_sec || (now.tv_sec == end.tv_sec && now.tv_usec >= end.tv_usec))
+        return(0);
+    }
+  }
+}
+
+/*
+ * Read one batch of cache misses after the *nbl requests kept from the
+ * last batch, answering cache hits and invalid lines right away. Returns
+ * 1 on end of input, 2 on exit request, -1 on read error and 0 otherwise.
+ */
+static int batch_read(struct main_args *margs,struct bstruct *bl,int *nbl) {
+  char buf[6400];
+  char *c,*user;
+  struct custruct cu;
+  struct timeval first;
+  struct bstruct *bp;
+  long msec;
+  int verdict;
+
+  /* requests kept from the last batch wait for a new window */
+  if (*nbl > 0)
+    gettimeofday(&first,NULL);
+  while (*nbl < margs->bmax) {
+    /* the window is fixed by the first miss */
+    msec=-1;
+    if (*nbl > 0) {
+      msec=margs->bwindow-(long)dc_since(&first);
+      if (msec < 0)
+        msec=0;
+    }
+    if (!wait_input(margs,msec))
+      break;
+    if (fgets(buf, sizeof(buf)-1, stdin) == NULL) {
+      if (ferror(stdin)) {
+        if (margs->debug)
+          fprintf(stderr, "%s| %s: fgets() failed! dying..... errno=%d (%s)\n", LogTime(), PROGRAM, ferror(stdin),
+		  strerror(ferror(stdin)));
+        return(-1);
+      }
+      return(1);
+    }
+    c=memchr(buf,'\n',sizeof(buf)-1);
+    if (c) {
+      *c = '\0';
+    } else {
+      if (margs->debug)
+        fprintf(stderr, "%s| %s: Line too long. Ignored\n",LogTime(), PROGRAM);
+      continue;
+    }
+
+    cu.user=NULL;
+    cu.domain=NULL;
+    cu.key=NULL;
+    user=strchr(buf,' ');
+    if (user) {
+      *user='\0';
+      user++;
+      /* Ignore key-value pairs squid may append */
+      if ((c=strchr(user,' ')))
+        *c='\0';
+    }
+
+    if (!user || canon_user(margs,user,&cu)) {
+      clean_cu(&cu);
+      batch_reply(margs,buf,0);
+      continue;
+    }
+    if (margs->debug || margs->log)
+      fprintf(stderr, "%s| %s: Got User: %s Domain: %s Channel: %s\n",LogTime(), PROGRAM,cu.user,cu.domain?cu.domain:"NULL",buf);
+    if (!strcmp(cu.user,"QQ") && cu.domain && !strcmp(cu.domain,"QQ")) {
+      clean_cu(&cu);
+      batch_reply(margs,buf,0);
+      return(2);
+    }
+    hh_user(margs,cu.key,cu.user);
+    if (cache_get(margs,cu.key,&verdict)) {
+      clean_cu(&cu);
+      batch_reply(margs,buf,verdict);
+      continue;
+    }
+
+    if (*nbl == 0)
+      gettimeofday(&first,NULL);
+    bp=&bl[*nbl];
+    bp->channel=strdup(buf);
+    bp->cu=cu;
+    bp->verdict=0;
+    bp->dup=-1;
+    bp->defer=0;
+    (*nbl)++;
+  }
+  return(0);
+}
+
+/*
+ * Fetch the users of each domain which missed the cache with one search
+ * per domain. Single users are left to get_memberof. With defer set the
+ * users which did not fit into the search are marked for the next batch.
+ */
+static void batch_prefetch(struct main_args *margs,struct bstruct *bl,int nbl,int defer) {
+  char **users;
+  int *done,*idx;
+  int i,j,n,m;
+
+  users=(char **)malloc(nbl*sizeof(char *));
+  idx=(int *)malloc(nbl*sizeof(int));
+  done=(int *)calloc(nbl,sizeof(int));
+  for (i=0;i<nbl;i++) {
+    if (bl[i].dup != i || done[i] || !bl[i].cu.domain)
+      continue;
+    n=0;
+    for (j=i;j<nbl;j++) {
+      if (bl[j].dup != j || done[j] || !bl[j].cu.domain)
+        continue;
+      if (strcmp(bl[i].cu.domain,bl[j].cu.domain))
+        continue;
+      done[j]=1;
+      idx[n]=j;
+      users[n++]=bl[j].cu.user;
+    }
+    if (n < 2)
+      continue;
+    m=get_memberof_batch(margs,bl[i].cu.domain,users,n);
+    /* nothing fetched (error or not AD): check them one by one */
+    if (!defer || m <= 0 || m >= n)
+      continue;
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: %d users of domain %s wait for the next batch\n",LogTime(), PROGRAM,n-m,bl[i].cu.domain);
+    for (j=m;j<n;j++)
+      bl[idx[j]].defer=1;
+  }
+  free(done);
+  free(idx);
+  free(users);
+}
+
+/*
+ * Answer a batch. With defer set requests may be kept for the next batch
+ * (marked with defer).
+ */
+static void batch_answer(struct main_args *margs,struct bstruct *bl,int nbl,int defer) {
+  int i,j,misses=0;
+
+  for (i=0;i<nbl;i++) {
+    /* answers from peers may have come in during the window */
+    if (cache_get(margs,bl[i].cu.key,&bl[i].verdict))
+      continue;
+    for (j=0;j<i;j++) {
+      if (bl[j].dup == j && !strcmp(bl[i].cu.key,bl[j].cu.key))
+        break;
+    }
+    bl[i].dup=j;
+    if (j == i)
+      misses++;
+    else if (margs->debug)
+      fprintf(stderr, "%s| %s: Channel %s waits for answer of channel %s\n",LogTime(), PROGRAM,bl[i].channel,bl[j].channel);
+  }
+
+  if (misses > 1)
+    batch_prefetch(margs,bl,nbl,defer);
+
+  for (i=0;i<nbl;i++) {
+    if (bl[i].dup != i || bl[i].defer)
+      continue;
+    bl[i].verdict=check_memberof(margs,bl[i].cu.user,bl[i].cu.domain);
+    /* answer ERR for now but do not remember a failed lookup */
+    if (bl[i].verdict == MEMBER_ERROR)
+      bl[i].verdict=0;
+    else {
+      cache_put(margs,bl[i].cu.key,bl[i].verdict);
+      peer_send_verdict(margs,bl[i].cu.key,bl[i].verdict);
+    }
+  }
+  uentry_clear();
+
+  for (i=0;i<nbl;i++) {
+    if (bl[i].dup >= 0 && bl[bl[i].dup].defer)
+      bl[i].defer=1;
+    if (bl[i].defer)
+      continue;
+    if (bl[i].dup >= 0)
+      bl[i].verdict=bl[bl[i].dup].verdict;
+    batch_reply(margs,bl[i].channel,bl[i].verdict);
+  }
+}
+
+/*
+ * Answer requests with channel-IDs until squid closes stdin.
+ * Returns the exit code.
+ */
+int batch_loop(struct main_args *margs) {
+  struct bstruct *bl;
+  int i,n,nbl=0,rc;
+
+  bl=(struct bstruct *)malloc(margs->bmax*sizeof(struct bstruct));
+  do {
+    rc=batch_read(margs,bl,&nbl);
+    /* at the end nothing is left for a next batch */
+    if (rc >= 0)
+      batch_answer(margs,bl,nbl,rc == 0);
+    for (i=0,n=0;i<nbl;i++) {
+      if (rc == 0 && bl[i].defer) {
+        bl[n]=bl[i];
+        bl[n].defer=0;
+        bl[n].dup=-1;
+        n++;
+        continue;
+      }
+      free(bl[i].channel);
+      clean_cu(&bl[i].cu);
+    }
+    nbl=n;
+  } while (rc == 0);
+  free(bl);
+  if (rc == 2)
+    return(-1);
+  return(rc < 0 ? 1 : 0);
+}
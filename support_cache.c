@@ -0,0 +1,601 @@
+/*
+ * -----------------------------------------------------------------------------
+ *
+ * Author: Markus Moeller (markus_moeller at compuserve.com)
+ *
+ * Copyright (C) 2007 Markus Moeller. All rights reserved.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * -----------------------------------------------------------------------------
+ */
+
+#include <ctype.h>
+
+#include "support.h"
+
+/*
+ * Verdict cache keyed by the canonical user key (see canon_user).
+ * Positive answers live for -c seconds, negative ones for -e seconds.
+ *
+ * Edge cache keyed by group DN holding the memberOf values of the group,
+ * i.e. the edges of the nested group graph. Edges live for -c seconds.
+ *
+ * User entry table keyed by the canonical user key holding the memberOf
+ * values of users fetched by one batched search. It lives only until the
+ * batch is answered (uentry_clear).
+ *
+ * Group table keyed by group@DOMAIN holding the DNs of the groups with
+ * that name (cn), or keyed by sid:group@DOMAIN holding their objectSid
+ * values in hex. Entries live for GREF_TTL seconds.
+ *
+ * With change notifications (-W) every answer remembers the groups it was
+ * derived from (dep_add), as first RDN (CN=name) of the group DN.
+ */
+
+#define CACHE_BUCKETS 1021
+#define CACHE_MAX_ENTRIES 65536
+#define GREF_TTL 3600
+
+struct cstruct {
+  char *key;
+  int  verdict;
+  time_t expires;
+  char **deps;
+  int  ndeps;
+  struct cstruct *next;
+};
+
+struct estruct {
+  char *dn;
+  char **parents;
+  int  nparents;
+  time_t expires;
+  struct estruct *next;
+};
+
+static struct cstruct *cache_table[CACHE_BUCKETS];
+static int cache_entries=0;
+static struct estruct *edge_table[CACHE_BUCKETS];
+static int edge_entries=0;
+static struct estruct *uentry_table[CACHE_BUCKETS];
+static struct estruct *gref_table[CACHE_BUCKETS];
+static char **dep_list=NULL;
+static int dep_count=0;
+
+static unsigned int cache_hash(const char *key);
+static unsigned int edge_hash(const char *dn);
+static void cache_purge(time_t now);
+static void edge_free(struct estruct *ep);
+static void edge_purge(time_t now);
+static void cache_free(struct cstruct *cp);
+static void dep_clear(void);
+static int rdn_match(const char *rdn,const char *dn);
+
+static unsigned int cache_hash(const char *key) {
+  unsigned int h=5381;
+
+  while (*key)
+    h = h*33 + (unsigned char)*key++;
+  return h % CACHE_BUCKETS;
+}
+
+static unsigned int edge_hash(const char *dn) {
+  unsigned int h=5381;
+
+  while (*dn)
+    h = h*33 + (unsigned char)tolower((unsigned char)*dn++);
+  return h % CACHE_BUCKETS;
+}
+
+static void cache_free(struct cstruct *cp) {
+  int i;
+
+  for (i=0;i<cp->ndeps;i++)
+    free(cp->deps[i]);
+  if (cp->deps)
+    free(cp->deps);
+  free(cp->key);
+  free(cp);
+}
+
+static void dep_clear(void) {
+  int i;
+
+  for (i=0;i<dep_count;i++)
+    free(dep_list[i]);
+  if (dep_list)
+    free(dep_list);
+  dep_list=NULL;
+  dep_count=0;
+}
+
+/*
+ * Compare the first RDN of two DNs case insensitive
+ */
+static int rdn_match(const char *rdn,const char *dn) {
+  while (*rdn && *rdn != ',' && *dn && *dn != ',') {
+    if (tolower((unsigned char)*rdn) != tolower((unsigned char)*dn))
+      return(0);
+    rdn++;
+    dn++;
+  }
+  return((!*rdn || *rdn == ',') && (!*dn || *dn == ','));
+}
+
+/*
+ * Remember that the answer being determined depends on group dn
+ */
+void dep_add(struct main_args *margs,char *dn) {
+  char *c;
+  int i;
+
+  if (!margs->wlist || !dn)
+    return;
+  for (i=0;i<dep_count;i++) {
+    if (rdn_match(dep_list[i],dn))
+      return;
+  }
+  dep_list=(char **)realloc(dep_list,(dep_count+1)*sizeof(char *));
+  dep_list[dep_count]=strdup(dn);
+  if ((c=strchr(dep_list[dep_count],',')))
+    *c='\0';
+  dep_count++;
+}
+
+static void cache_purge(time_t now) {
+  struct cstruct *cp,**cpp;
+  int i;
+
+  for (i=0;i<CACHE_BUCKETS;i++) {
+    cpp=&cache_table[i];
+    while ((cp=*cpp)) {
+      if (cp->expires <= now) {
+        *cpp=cp->next;
+        cache_free(cp);
+        cache_entries--;
+      } else
+        cpp=&cp->next;
+    }
+  }
+}
+
+int cache_get(struct main_args *margs,char *key,int *verdict) {
+  struct cstruct *cp,**cpp;
+  time_t now;
+
+  if ((!margs->cttl && !margs->nttl) || !key)
+    return(0);
+
+  now=time(NULL);
+  cpp=&cache_table[cache_hash(key)];
+  while ((cp=*cpp)) {
+    if (!strcmp(cp->key,key)) {
+      if (cp->expires <= now) {
+        *cpp=cp->next;
+        cache_free(cp);
+        cache_entries--;
+        return(0);
+      }
+      *verdict=cp->verdict;
+      if (margs->debug)
+        fprintf(stderr, "%s| %s: Cache hit for %s: %s\n",LogTime(), PROGRAM,key,cp->verdict?"OK":"ERR");
+      return(1);
+    }
+    cpp=&cp->next;
+  }
+  return(0);
+}
+
+/*
+ * Expiry time of the cached verdict of key or 0 if not cached
+ */
+time_t cache_expires(struct main_args *margs,char *key,int *verdict) {
+  struct cstruct *cp;
+
+  if ((!margs->cttl && !margs->nttl) || !key)
+    return(0);
+
+  for (cp=cache_table[cache_hash(key)]; cp; cp=cp->next) {
+    if (!strcmp(cp->key,key)) {
+      *verdict=cp->verdict;
+      return(cp->expires);
+    }
+  }
+  return(0);
+}
+
+void cache_put(struct main_args *margs,char *key,int verdict) {
+  int ttl;
+
+  ttl = verdict ? margs->cttl : margs->nttl;
+  if (ttl <= 0 || !key) {
+    dep_clear();
+    return;
+  }
+
+  cache_store(margs,key,verdict,time(NULL)+ttl);
+}
+
+void cache_store(struct main_args *margs,char *key,int verdict,time_t expires) {
+  struct cstruct *cp;
+  unsigned int h;
+  time_t now;
+  int i;
+
+  now=time(NULL);
+  if (expires <= now) {
+    dep_clear();
+    return;
+  }
+  h=cache_hash(key);
+  for (cp=cache_table[h]; cp; cp=cp->next) {
+    if (!strcmp(cp->key,key))
+      break;
+  }
+  if (!cp) {
+    if (cache_entries >= CACHE_MAX_ENTRIES) {
+      cache_purge(now);
+      if (cache_entries >= CACHE_MAX_ENTRIES) {
+        if (margs->debug)
+          fprintf(stderr, "%s| %s: Cache full. Do not cache %s\n",LogTime(), PROGRAM,key);
+        dep_clear();
+        return;
+      }
+    }
+    cp=(struct cstruct *)calloc(1,sizeof(struct cstruct));
+    cp->key=strdup(key);
+    cp->next=cache_table[h];
+    cache_table[h]=cp;
+    cache_entries++;
+  }
+  cp->verdict=verdict;
+  cp->expires=expires;
+  /* The answer now depends on the groups collected while determining it */
+  for (i=0;i<cp->ndeps;i++)
+    free(cp->deps[i]);
+  if (cp->deps)
+    free(cp->deps);
+  cp->deps=dep_list;
+  cp->ndeps=dep_count;
+  dep_list=NULL;
+  dep_count=0;
+}
+
+static void edge_free(struct estruct *ep) {
+  int i;
+
+  for (i=0;i<ep->nparents;i++)
+    free(ep->parents[i]);
+  if (ep->parents)
+    free(ep->parents);
+  free(ep->dn);
+  free(ep);
+}
+
+static void edge_purge(time_t now) {
+  struct estruct *ep,**epp;
+  int i;
+
+  for (i=0;i<CACHE_BUCKETS;i++) {
+    epp=&edge_table[i];
+    while ((ep=*epp)) {
+      if (ep->expires <= now) {
+        *epp=ep->next;
+        edge_free(ep);
+        edge_entries--;
+      } else
+        epp=&ep->next;
+    }
+  }
+}
+
+/*
+ * Return a copy of the cached memberOf values of group dn (caller frees)
+ * or -1 if the group is not cached
+ */
+int edge_get(struct main_args *margs,char *dn,char ***parents) {
+  struct estruct *ep,**epp;
+  char **pp=NULL;
+  time_t now;
+  int i;
+
+  if (margs->cttl <= 0 || !dn)
+    return(-1);
+
+  now=time(NULL);
+  epp=&edge_table[edge_hash(dn)];
+  while ((ep=*epp)) {
+    if (!strcasecmp(ep->dn,dn)) {
+      if (ep->expires <= now) {
+        *epp=ep->next;
+        edge_free(ep);
+        edge_entries--;
+        return(-1);
+      }
+      if (ep->nparents > 0)
+        pp=(char **)malloc(ep->nparents*sizeof(char *));
+      for (i=0;i<ep->nparents;i++)
+        pp[i]=strdup(ep->parents[i]);
+      *parents=pp;
+      if (margs->debug)
+        fprintf(stderr, "%s| %s: Cache hit for group %s: %d parent group%s\n",LogTime(), PROGRAM,dn,ep->nparents,ep->nparents==1?"":"s");
+      return(ep->nparents);
+    }
+    epp=&ep->next;
+  }
+  return(-1);
+}
+
+void edge_put(struct main_args *margs,char *dn,char **parents,int nparents) {
+  if (margs->cttl <= 0 || !dn)
+    return;
+
+  edge_store(margs,dn,parents,nparents,time(NULL)+margs->cttl);
+}
+
+void edge_store(struct main_args *margs,char *dn,char **parents,int nparents,time_t expires) {
+  struct estruct *ep,**epp;
+  unsigned int h;
+  time_t now;
+  int i;
+
+  now=time(NULL);
+  if (expires <= now)
+    return;
+  h=edge_hash(dn);
+  epp=&edge_table[h];
+  while ((ep=*epp)) {
+    if (!strcasecmp(ep->dn,dn)) {
+      *epp=ep->next;
+      edge_free(ep);
+      edge_entries--;
+      break;
+    }
+    epp=&ep->next;
+  }
+  if (edge_entries >= CACHE_MAX_ENTRIES) {
+    edge_purge(now);
+    if (edge_entries >= CACHE_MAX_ENTRIES) {
+      if (margs->debug)
+        fprintf(stderr, "%s| %s: Cache full. Do not cache group %s\n",LogTime(), PROGRAM,dn);
+      return;
+    }
+  }
+  ep=(struct estruct *)malloc(sizeof(struct estruct));
+  ep->dn=strdup(dn);
+  ep->nparents=nparents>0?nparents:0;
+  ep->parents=NULL;
+  if (ep->nparents > 0)
+    ep->parents=(char **)malloc(ep->nparents*sizeof(char *));
+  for (i=0;i<ep->nparents;i++)
+    ep->parents[i]=strdup(parents[i]);
+  ep->expires=expires;
+  ep->next=edge_table[h];
+  edge_table[h]=ep;
+  edge_entries++;
+}
+
+/*
+ * Return a copy of the memberOf values of the user with key (caller frees)
+ * or -1 if the user was not fetched by the current batch
+ */
+int uentry_get(struct main_args *margs,char *key,char ***values) {
+  struct estruct *ep;
+  char **vp=NULL;
+  int i;
+
+  if (!key)
+    return(-1);
+
+  for (ep=uentry_table[cache_hash(key)]; ep; ep=ep->next) {
+    if (!strcmp(ep->dn,key)) {
+      if (ep->nparents > 0)
+        vp=(char **)malloc(ep->nparents*sizeof(char *));
+      for (i=0;i<ep->nparents;i++)
+        vp[i]=strdup(ep->parents[i]);
+      *values=vp;
+      if (margs->debug)
+        fprintf(stderr, "%s| %s: Use prefetched entry for %s: %d group%s\n",LogTime(), PROGRAM,key,ep->nparents,ep->nparents==1?"":"s");
+      return(ep->nparents);
+    }
+  }
+  return(-1);
+}
+
+void uentry_put(struct main_args *margs,char *key,char **values,int nvalues) {
+  struct estruct *ep;
+  unsigned int h;
+  int i;
+
+  if (!key)
+    return;
+  h=cache_hash(key);
+  for (ep=uentry_table[h]; ep; ep=ep->next) {
+    if (!strcmp(ep->dn,key))
+      return;
+  }
+  if (margs->debug)
+    fprintf(stderr, "%s| %s: Keep prefetched entry for %s\n",LogTime(), PROGRAM,key);
+  ep=(struct estruct *)malloc(sizeof(struct estruct));
+  ep->dn=strdup(key);
+  ep->nparents=nvalues>0?nvalues:0;
+  ep->parents=NULL;
+  if (ep->nparents > 0)
+    ep->parents=(char **)malloc(ep->nparents*sizeof(char *));
+  for (i=0;i<ep->nparents;i++)
+    ep->parents[i]=strdup(values[i]);
+  ep->expires=0;
+  ep->next=uentry_table[h];
+  uentry_table[h]=ep;
+}
+
+void uentry_clear(void) {
+  struct estruct *ep,*epn;
+  int i;
+
+  for (i=0;i<CACHE_BUCKETS;i++) {
+    for (ep=uentry_table[i]; ep; ep=epn) {
+      epn=ep->next;
+      edge_free(ep);
+    }
+    uentry_table[i]=NULL;
+  }
+}
+
+/*
+ * Return a copy of the DNs of the group with key (caller frees) or -1 if
+ * the group is not known
+ */
+int gref_get(struct main_args *margs,char *key,char ***values) {
+  struct estruct *ep,**epp;
+  char **vp=NULL;
+  int i;
+
+  if (!key)
+    return(-1);
+  epp=&gref_table[cache_hash(key)];
+  while ((ep=*epp)) {
+    if (!strcmp(ep->dn,key)) {
+      if (ep->expires <= time(NULL)) {
+        *epp=ep->next;
+        edge_free(ep);
+        return(-1);
+      }
+      if (ep->nparents > 0)
+        vp=(char **)malloc(ep->nparents*sizeof(char *));
+      for (i=0;i<ep->nparents;i++)
+        vp[i]=strdup(ep->parents[i]);
+      *values=vp;
+      if (margs->debug)
+        fprintf(stderr, "%s| %s: Cache hit for group %s: %d DN%s\n",LogTime(), PROGRAM,key,ep->nparents,ep->nparents==1?"":"s");
+      return(ep->nparents);
+    }
+    epp=&ep->next;
+  }
+  return(-1);
+}
+
+void gref_put(struct main_args *margs,char *key,char **values,int nvalues) {
+  struct estruct *ep,**epp;
+  unsigned int h;
+  int i;
+
+  if (!key)
+    return;
+  h=cache_hash(key);
+  epp=&gref_table[h];
+  while ((ep=*epp)) {
+    if (!strcmp(ep->dn,key)) {
+      *epp=ep->next;
+      edge_free(ep);
+      break;
+    }
+    epp=&ep->next;
+  }
+  if (margs->debug)
+    fprintf(stderr, "%s| %s: Keep %d DN%s of group %s\n",LogTime(), PROGRAM,nvalues,nvalues==1?"":"s",key);
+  ep=(struct estruct *)malloc(sizeof(struct estruct));
+  ep->dn=strdup(key);
+  ep->nparents=nvalues>0?nvalues:0;
+  ep->parents=NULL;
+  if (ep->nparents > 0)
+    ep->parents=(char **)malloc(ep->nparents*sizeof(char *));
+  for (i=0;i<ep->nparents;i++)
+    ep->parents[i]=strdup(values[i]);
+  ep->expires=time(NULL)+GREF_TTL;
+  ep->next=gref_table[h];
+  gref_table[h]=ep;
+}
+
+/*
+ * Drop everything which may be affected by a change of dn. Only a change
+ * of a group (group != 0) can make a user a member, so negative answers
+ * and answers without dependency information are kept for other objects.
+ * Returns the number of dropped entries.
+ */
+int cache_invalidate(struct main_args *margs,char *dn,int group) {
+  struct cstruct *cp,**cpp;
+  struct estruct *ep,**epp;
+  int i,j,n=0;
+
+  for (i=0;i<CACHE_BUCKETS;i++) {
+    cpp=&cache_table[i];
+    while ((cp=*cpp)) {
+      for (j=0;j<cp->ndeps;j++) {
+        if (rdn_match(cp->deps[j],dn))
+          break;
+      }
+      if ((group && (!cp->verdict || !cp->ndeps)) || j < cp->ndeps) {
+        if (margs->debug)
+          fprintf(stderr, "%s| %s: Drop cached answer for %s\n",LogTime(), PROGRAM,cp->key);
+        *cpp=cp->next;
+        cache_free(cp);
+        cache_entries--;
+        n++;
+      } else
+        cpp=&cp->next;
+    }
+    /*
+     * A change of the member attribute of dn also changes the memberOf
+     * of the members, so drop the groups which list dn as parent too
+     */
+    epp=&edge_table[i];
+    while ((ep=*epp)) {
+      for (j=0;j<ep->nparents;j++) {
+        if (!strcasecmp(ep->parents[j],dn) || rdn_match(ep->parents[j],dn))
+          break;
+      }
+      if (!strcasecmp(ep->dn,dn) || rdn_match(ep->dn,dn) || j < ep->nparents) {
+        if (margs->debug)
+          fprintf(stderr, "%s| %s: Drop cached group %s\n",LogTime(), PROGRAM,ep->dn);
+        *epp=ep->next;
+        edge_free(ep);
+        edge_entries--;
+        n++;
+      } else
+        epp=&ep->next;
+    }
+  }
+  return(n);
+}
+
+void cache_cleanup(void) {
+  struct cstruct *cp,*cpn;
+  struct estruct *ep,*epn;
+  int i;
+
+  for (i=0;i<CACHE_BUCKETS;i++) {
+    for (cp=cache_table[i]; cp; cp=cpn) {
+      cpn=cp->next;
+      cache_free(cp);
+    }
+    cache_table[i]=NULL;
+    for (ep=edge_table[i]; ep; ep=epn) {
+      epn=ep->next;
+      edge_free(ep);
+    }
+    edge_table[i]=NULL;
+    for (ep=gref_table[i]; ep; ep=epn) {
+      epn=ep->next;
+      edge_free(ep);
+    }
+    gref_table[i]=NULL;
+  }
+  cache_entries=0;
+  edge_entries=0;
+  uentry_clear();
+  dep_clear();
+}
@@ -0,0 +1,239 @@
+/*
+ * -----------------------------------------------------------------------------
+ *
+ * Author: Markus Moeller (markus_moeller at compuserve.com)
+ *
+ * Copyright (C) 2007 Markus Moeller. All rights reserved.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * -----------------------------------------------------------------------------
+ */
+
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "support.h"
+
+/*
+ * Connect to the ldap servers of a domain in the style of RFC 8305
+ * ("happy eyeballs"): all IPv6 and IPv4 addresses of the servers are
+ * tried in server order with IPv6 and IPv4 interleaved. A new attempt is
+ * started every CONNECT_DELAY milliseconds, or at once if an attempt
+ * fails. The first connected socket wins and the other attempts are
+ * cancelled (they are started again if the winner fails later on, e.g.
+ * in the bind). A dead server therefore only costs CONNECT_DELAY instead
+ * of the full connect timeout.
+ */
+
+#define CONNECT_DELAY 200
+#define CONNECT_TIMEOUT_MS 2000
+
+static long ms_since(struct timeval *tv);
+
+static long ms_since(struct timeval *tv) {
+  struct timeval now;
+
+  gettimeofday(&now,NULL);
+  return (now.tv_sec - tv->tv_sec)*1000 + (now.tv_usec - tv->tv_usec)/1000;
+}
+
+/*
+ * Resolve all servers of hlist. Returns the number of addresses.
+ */
+int connect_list(struct main_args *margs,struct hstruct *hlist,int nhosts,struct castruct **alist) {
+  struct addrinfo hints,*res,*ai;
+  struct addrinfo *v4[64],*v6[64];
+  struct castruct *ap=NULL;
+  char port[8];
+  int i,j,n4,n6,rc,naddrs=0;
+
+  *alist=NULL;
+  for (i=0;i<nhosts;i++) {
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family=AF_UNSPEC;
+    hints.ai_socktype=SOCK_STREAM;
+    snprintf(port,sizeof(port),"%d",hlist[i].port != -1 ? hlist[i].port : 389);
+    rc = getaddrinfo(hlist[i].host,port,&hints,&res);
+    if (rc) {
+      if (margs->debug)
+        fprintf(stderr, "%s| %s: Error while resolving %s: %s\n",LogTime(), PROGRAM,hlist[i].host,gai_strerror(rc));
+      continue;
+    }
+    n4=n6=0;
+    for (ai=res; ai; ai=ai->ai_next) {
+      if (ai->ai_family == AF_INET6 && n6 < 64)
+        v6[n6++]=ai;
+      else if (ai->ai_family == AF_INET && n4 < 64)
+        v4[n4++]=ai;
+    }
+    ap=(struct castruct *)realloc(ap,(naddrs+n4+n6)*sizeof(struct castruct));
+    for (j=0;j<n4 || j<n6;j++) {
+      if (j < n6) {
+        memcpy(&ap[naddrs].addr,v6[j]->ai_addr,v6[j]->ai_addrlen);
+        ap[naddrs].addrlen=v6[j]->ai_addrlen;
+        ap[naddrs].host=i;
+        ap[naddrs].fd=-1;
+        ap[naddrs].state=CA_NEW;
+        naddrs++;
+      }
+      if (j < n4) {
+        memcpy(&ap[naddrs].addr,v4[j]->ai_addr,v4[j]->ai_addrlen);
+        ap[naddrs].addrlen=v4[j]->ai_addrlen;
+        ap[naddrs].host=i;
+        ap[naddrs].fd=-1;
+        ap[naddrs].state=CA_NEW;
+        naddrs++;
+      }
+    }
+    freeaddrinfo(res);
+  }
+  *alist=ap;
+  return(naddrs);
+}
+
+/*
+ * Race connects to the addresses not tried yet. Returns the connected
+ * socket (blocking) and the index of its server in host or -1 if no
+ * address could be connected.
+ */
+int connect_race(struct main_args *margs,struct castruct *alist,int naddrs,int *host) {
+  struct pollfd *pfd;
+  struct timeval last;
+  int *pidx;
+  int i,n,fd,next,npend,timeout,err,winner=-1;
+  socklen_t len;
+
+  pfd=(struct pollfd *)malloc(naddrs*sizeof(struct pollfd));
+  pidx=(int *)malloc(naddrs*sizeof(int));
+  last.tv_sec=0;
+  last.tv_usec=0;
+  for (next=0; next<naddrs && alist[next].state != CA_NEW; next++)
+    ;
+
+  while (winner < 0) {
+    /*
+     * Start the next attempt if the delay passed or nothing is pending
+     */
+    npend=0;
+    for (i=0;i<naddrs;i++)
+      if (alist[i].state == CA_CONNECTING)
+        npend++;
+    if (next < naddrs && (npend == 0 || ms_since(&last) >= CONNECT_DELAY)) {
+      struct castruct *ap=&alist[next];
+
+      ap->state=CA_DONE;
+      fd=socket(ap->addr.ss_family,SOCK_STREAM,0);
+      if (fd >= 0) {
+        fcntl(fd,F_SETFL,fcntl(fd,F_GETFL) | O_NONBLOCK);
+        if (connect(fd,(struct sockaddr *)&ap->addr,ap->addrlen) == 0) {
+          ap->fd=fd;
+          winner=next;
+          break;
+        } else if (errno == EINPROGRESS) {
+          ap->fd=fd;
+          ap->state=CA_CONNECTING;
+          gettimeofday(&ap->start,NULL);
+          gettimeofday(&last,NULL);
+          npend++;
+        } else {
+          close(fd);
+        }
+      }
+      if (ap->state != CA_CONNECTING)
+        last.tv_sec=0;
+      for (next++; next<naddrs && alist[next].state != CA_NEW; next++)
+        ;
+      if (ap->state != CA_CONNECTING)
+        continue;
+    }
+    if (npend == 0) {
+      if (next >= naddrs)
+        break;
+      continue;
+    }
+
+    /*
+     * Wait for a connect to finish or the next attempt to be due
+     */
+    n=0;
+    timeout=CONNECT_TIMEOUT_MS;
+    for (i=0;i<naddrs;i++) {
+      if (alist[i].state != CA_CONNECTING)
+        continue;
+      pfd[n].fd=alist[i].fd;
+      pfd[n].events=POLLOUT;
+      pfd[n].revents=0;
+      pidx[n++]=i;
+      if (CONNECT_TIMEOUT_MS - ms_since(&alist[i].start) < timeout)
+        timeout=CONNECT_TIMEOUT_MS - ms_since(&alist[i].start);
+    }
+    if (next < naddrs && CONNECT_DELAY - ms_since(&last) < timeout)
+      timeout=CONNECT_DELAY - ms_since(&last);
+    if (timeout < 0)
+      timeout=0;
+    if (poll(pfd,n,timeout) < 0 && errno != EINTR)
+      break;
+    for (i=0;i<n && winner < 0;i++) {
+      struct castruct *ap=&alist[pidx[i]];
+
+      if (pfd[i].revents) {
+        err=0;
+        len=sizeof(err);
+        if (getsockopt(ap->fd,SOL_SOCKET,SO_ERROR,&err,&len) == 0 && err == 0) {
+          winner=pidx[i];
+          continue;
+        }
+        if (margs->debug)
+          fprintf(stderr, "%s| %s: Connect to ldap server failed: %s\n",LogTime(), PROGRAM,strerror(err));
+      } else if (ms_since(&ap->start) < CONNECT_TIMEOUT_MS)
+        continue;
+      close(ap->fd);
+      ap->fd=-1;
+      ap->state=CA_DONE;
+      /* start the next attempt at once */
+      last.tv_sec=0;
+    }
+  }
+
+  /*
+   * Cancel the other attempts. They may be tried again later.
+   */
+  for (i=0;i<naddrs;i++) {
+    if (i == winner || alist[i].state != CA_CONNECTING)
+      continue;
+    close(alist[i].fd);
+    alist[i].fd=-1;
+    alist[i].state=CA_NEW;
+  }
+  free(pfd);
+  free(pidx);
+  if (winner < 0)
+    return(-1);
+  alist[winner].state=CA_WON;
+  fd=alist[winner].fd;
+  alist[winner].fd=-1;
+  fcntl(fd,F_SETFL,fcntl(fd,F_GETFL) & ~O_NONBLOCK);
+  *host=alist[winner].host;
+  if (margs->debug)
+    fprintf(stderr, "%s| %s: Connected to ldap server address %d of %d\n",LogTime(), PROGRAM,winner+1,naddrs);
+  return(fd);
+}
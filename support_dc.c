@@ -0,0 +1,523 @@
+/*
+ * -----------------------------------------------------------------------------
+ *
+ * Author: Markus Moeller (markus_moeller at compuserve.com)
+ *
+ * Copyright (C) 2007 Markus Moeller. All rights reserved.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * -----------------------------------------------------------------------------
+ */
+
+
+#include <ctype.h>
+#include <strings.h>
+
+#include "support.h"
+
+/*
+ * State kept per ldap server (domain controller), identified by host name
+ * and port, for as long as the helper runs.
+ *
+ * Latency: exponentially weighted moving averages of the time needed to
+ * set up a connection (TLS and bind) and of search times. Servers of equal
+ * SRV priority are ranked by these (see compare_hosts). Servers without
+ * samples are ranked first so that every server is measured once.
+ *
+ * Circuit breaker: a server which could not be connected to is opened
+ * (DC_OPEN) and skipped for a backoff period which doubles with each
+ * further failure (DC_BACKOFF_MIN up to DC_BACKOFF_MAX seconds). After the
+ * backoff the server is tried once more (DC_HALFOPEN) and closed again if
+ * that succeeds. So a dead server costs one timeout per backoff period
+ * instead of one per request. While all servers of a domain are in backoff
+ * requests fail at once.
+ *
+ * Transport: for ssl connections the way which worked (Start TLS on the
+ * port or ldaps and its port) is kept for -E seconds, so later connections
+ * do not pay for a failing Start TLS first. It is forgotten when the
+ * server fails.
+ *
+ * Hedging (-Q): a search which has not been answered after about the 95th
+ * percentile of the search times of its server (average plus twice the
+ * mean deviation, after DC_HEDGE_SAMPLES searches) is sent to a second
+ * server as well (see ldap_search_timed). At most one in DC_HEDGE_RATIO
+ * searches is hedged, so the extra load stays small.
+ *
+ * Window: the number of user lookups put into one batched search to the
+ * server (-C) is limited by a window which is adapted like a TCP
+ * congestion window, from batched searches only: it grows by one with
+ * each search which filled the window and was answered in normal time
+ * and is halved when a search takes longer than the 95th percentile or
+ * the server reports being busy or over a limit. Lookups beyond the
+ * window go to another pooled server or wait for the next batch.
+ *
+ * Affinity (-A): the searches for a user go to the same server, so that
+ * each server's database cache holds the objects of its share of the
+ * users. The server is chosen by rendezvous hashing: among the available
+ * servers with the best SRV priority of the domain (dc_ring) the one with
+ * the highest hash of user and server wins. If a server fails or a new
+ * one appears only the users of that server move.
+ */
+
+#define DC_EWMA_ALPHA 0.3
+#define DC_BACKOFF_MIN 10
+#define DC_BACKOFF_MAX 600
+#define DC_FAILURES_MAX 16
+#define DC_HEDGE_SAMPLES 10
+#define DC_HEDGE_MIN 20
+#define DC_HEDGE_RATIO 20
+#define DC_WINDOW_INIT 8
+#define DC_WINDOW_MAX 256
+
+static struct dcstruct *dcs=NULL;
+static struct dcstruct *avoid=NULL;
+static long searches=0;
+static long hedges=0;
+static long hedge_wins=0;
+static char *affinity=NULL;
+
+struct rgstruct {
+  char *domain;
+  struct dcstruct **dcs;
+  int  ndcs;
+  struct rgstruct *next;
+};
+
+static struct rgstruct *rings=NULL;
+
+static unsigned int dc_hash(char *key,struct dcstruct *dp);
+static int dc_available(struct dcstruct *dp,time_t now);
+
+static double dc_slow(struct dcstruct *dp);
+static void dc_congested(struct main_args *margs,struct dcstruct *dp);
+
+/*
+ * Find (and create) the state of host:port
+ */
+struct dcstruct *dc_get(char *host,int port,int create) {
+  struct dcstruct *dp;
+
+  if (!host)
+    return(NULL);
+  if (port == -1)
+    port=389;
+  for (dp=dcs; dp; dp=dp->next) {
+    if (dp->port == port && !strcasecmp(dp->host,host))
+      return(dp);
+  }
+  if (!create)
+    return(NULL);
+  dp=(struct dcstruct *)calloc(1,sizeof(struct dcstruct));
+  dp->host=strdup(host);
+  dp->port=port;
+  dp->window=DC_WINDOW_INIT;
+  dp->next=dcs;
+  dcs=dp;
+  return(dp);
+}
+
+/*
+ * Add a sample of msec milliseconds for a connection setup (conn != 0)
+ * or a search
+ */
+void dc_latency(struct main_args *margs,struct dcstruct *dp,int conn,double msec) {
+  if (!dp)
+    return;
+  if (conn) {
+    dp->conn_ms = dp->conn_samples ? DC_EWMA_ALPHA*msec + (1-DC_EWMA_ALPHA)*dp->conn_ms : msec;
+    dp->conn_samples++;
+  } else {
+    if (dp->search_samples) {
+      dp->search_dev = DC_EWMA_ALPHA*(msec > dp->search_ms ? msec-dp->search_ms : dp->search_ms-msec) + (1-DC_EWMA_ALPHA)*dp->search_dev;
+      dp->search_ms = DC_EWMA_ALPHA*msec + (1-DC_EWMA_ALPHA)*dp->search_ms;
+    } else {
+      dp->search_ms = msec;
+      dp->search_dev = msec/2;
+    }
+    dp->search_samples++;
+    searches++;
+  }
+  if (margs->debug)
+    fprintf(stderr, "%s| %s: Latency of %s:%d: %s %.1f ms, average connect %.1f ms search %.1f ms\n",LogTime(), PROGRAM,dp->host,dp->port,conn?"connect":"search",msec,dp->conn_ms,dp->search_ms);
+}
+
+/*
+ * Latency used for ranking: the search average if known, else the
+ * connection setup average. -1 if the server was not measured yet.
+ */
+double dc_score(char *host,int port) {
+  struct dcstruct *dp;
+
+  dp=dc_get(host,port,0);
+  if (!dp)
+    return(-1);
+  if (dp->search_samples)
+    return(dp->search_ms);
+  if (dp->conn_samples)
+    return(dp->conn_ms);
+  return(-1);
+}
+
+/*
+ * Milliseconds passed since tv
+ */
+double dc_since(struct timeval *tv) {
+  struct timeval now;
+
+  gettimeofday(&now,NULL);
+  return (now.tv_sec - tv->tv_sec)*1000.0 + (now.tv_usec - tv->tv_usec)/1000.0;
+}
+
+/*
+ * Remove the servers in backoff from hlist. Returns the new number of
+ * servers. If all servers are in backoff none is left, so requests fail
+ * at once until the first backoff ends and one request tries that server.
+ */
+int dc_filter(struct main_args *margs,struct hstruct *hlist,int nhosts) {
+  struct dcstruct *dp;
+  time_t now,retry=0;
+  int i,j,nopen=0;
+
+  now=time(NULL);
+  for (i=0;i<nhosts;i++) {
+    dp=dc_get(hlist[i].host,hlist[i].port,0);
+    if (dp && (!dc_available(dp,now) || dp == avoid)) {
+      nopen++;
+      if (dp != avoid && (!retry || dp->retry < retry))
+        retry=dp->retry;
+    }
+  }
+  if (nopen > 0 && nopen == nhosts && margs->debug) {
+    if (retry)
+      fprintf(stderr, "%s| %s: All ldap servers are in backoff. Next try in %d seconds\n",LogTime(), PROGRAM,(int)(retry-now));
+    else
+      fprintf(stderr, "%s| %s: No other ldap server available\n",LogTime(), PROGRAM);
+  }
+
+  for (i=0,j=0;i<nhosts;i++) {
+    dp=dc_get(hlist[i].host,hlist[i].port,0);
+    if (nopen == 0) {
+      hlist[j++]=hlist[i];
+      continue;
+    }
+    if (dp && dp == avoid) {
+      free(hlist[i].host);
+      hlist[i].host=NULL;
+      continue;
+    }
+    if (dp && dp->state == DC_OPEN && now < dp->retry) {
+      if (margs->debug)
+        fprintf(stderr, "%s| %s: Skip ldap server %s:%d for %d seconds\n",LogTime(), PROGRAM,dp->host,dp->port,(int)(dp->retry-now));
+      free(hlist[i].host);
+      hlist[i].host=NULL;
+      continue;
+    }
+    if (dp && dp->state == DC_OPEN) {
+      if (margs->debug)
+        fprintf(stderr, "%s| %s: Retry ldap server %s:%d after backoff\n",LogTime(), PROGRAM,dp->host,dp->port);
+      dp->state=DC_HALFOPEN;
+    }
+    hlist[j++]=hlist[i];
+  }
+  nhosts=j;
+
+  /*
+   * Move the user's server of the best priority to the front
+   */
+  if (affinity && nhosts > 1) {
+    struct hstruct h;
+    unsigned int hash,best=0;
+    int k=-1;
+
+    for (i=0;i<nhosts && hlist[i].priority == hlist[0].priority;i++) {
+      hash=dc_hash(affinity,dc_get(hlist[i].host,hlist[i].port,1));
+      if (k < 0 || hash > best) {
+        best=hash;
+        k=i;
+      }
+    }
+    h=hlist[k];
+    for (i=k;i>0;i--)
+      hlist[i]=hlist[i-1];
+    hlist[0]=h;
+  }
+  return(nhosts);
+}
+
+/*
+ * A connection to the server failed
+ */
+void dc_failed(struct main_args *margs,struct dcstruct *dp) {
+  int backoff,i;
+
+  if (!dp)
+    return;
+  /* counted up to DC_FAILURES_MAX only, the backoff is at its maximum long before */
+  if (dp->failures < DC_FAILURES_MAX)
+    dp->failures++;
+  dp->transport=0;
+  backoff=DC_BACKOFF_MIN;
+  for (i=1;i<dp->failures && backoff < DC_BACKOFF_MAX;i++)
+    backoff*=2;
+  if (backoff > DC_BACKOFF_MAX)
+    backoff=DC_BACKOFF_MAX;
+  dp->state=DC_OPEN;
+  dp->retry=time(NULL)+backoff;
+  if (dp->failures == 1 || margs->debug)
+    fprintf(stderr, "%s| %s: Ldap server %s:%d failed %d time(s). Skip it for %d seconds\n",LogTime(), PROGRAM,dp->host,dp->port,dp->failures,backoff);
+}
+
+/*
+ * A connection to the server was set up
+ */
+void dc_success(struct main_args *margs,struct dcstruct *dp) {
+  if (!dp)
+    return;
+  if (dp->state != DC_CLOSED && margs->debug)
+    fprintf(stderr, "%s| %s: Ldap server %s:%d is available again\n",LogTime(), PROGRAM,dp->host,dp->port);
+  dp->state=DC_CLOSED;
+  dp->failures=0;
+}
+
+/*
+ * Remember the transport which worked for host:port
+ */
+void dc_set_transport(struct main_args *margs,char *host,int port,int transport,int tport) {
+  struct dcstruct *dp;
+
+  if (margs->ttimeout <= 0)
+    return;
+  dp=dc_get(host,port,1);
+  if (dp->transport != transport && margs->debug)
+    fprintf(stderr, "%s| %s: Ldap server %s:%d supports %s on port %d\n",LogTime(), PROGRAM,dp->host,dp->port,transport == DC_LDAPS?"ldaps":"Start TLS",tport);
+  dp->transport=transport;
+  dp->tport=tport;
+  dp->texpires=time(NULL)+margs->ttimeout;
+}
+
+/*
+ * Transport known to work for host:port or 0
+ */
+int dc_get_transport(struct main_args *margs,char *host,int port,int *tport) {
+  struct dcstruct *dp;
+
+  if (margs->ttimeout <= 0)
+    return(0);
+  dp=dc_get(host,port,0);
+  if (!dp || !dp->transport || dp->texpires < time(NULL))
+    return(0);
+  *tport=dp->tport;
+  return(dp->transport);
+}
+
+/*
+ * Milliseconds after which a search on the server should be hedged or -1
+ */
+double dc_hedge_after(struct dcstruct *dp) {
+  if (hedges >= searches/DC_HEDGE_RATIO)
+    return(-1);
+  return(dc_slow(dp));
+}
+
+/*
+ * About the 95th percentile of the search times of the server or -1 if
+ * not known yet
+ */
+static double dc_slow(struct dcstruct *dp) {
+  double slow;
+
+  if (!dp || dp->search_samples < DC_HEDGE_SAMPLES)
+    return(-1);
+  slow=dp->search_ms+2*dp->search_dev;
+  if (slow < DC_HEDGE_MIN)
+    slow=DC_HEDGE_MIN;
+  return(slow);
+}
+
+/*
+ * Set (or with NULL clear) the user whose server is preferred by dc_filter
+ * and dc_preferred
+ */
+void dc_affinity(char *key) {
+  if (affinity)
+    free(affinity);
+  affinity=key?strdup(key):NULL;
+}
+
+/*
+ * Remember the servers with the best priority of a (sorted) server list
+ * of domain
+ */
+void dc_ring(char *domain,struct hstruct *hlist,int nhosts) {
+  struct rgstruct *rp;
+  int i,n;
+
+  if (!domain || nhosts < 1)
+    return;
+  for (rp=rings; rp; rp=rp->next) {
+    if (!strcasecmp(rp->domain,domain))
+      break;
+  }
+  if (!rp) {
+    rp=(struct rgstruct *)calloc(1,sizeof(struct rgstruct));
+    rp->domain=strdup(domain);
+    rp->next=rings;
+    rings=rp;
+  }
+  for (n=0;n<nhosts && hlist[n].priority == hlist[0].priority;n++);
+  if (rp->dcs)
+    free(rp->dcs);
+  rp->dcs=(struct dcstruct **)malloc(n*sizeof(struct dcstruct *));
+  for (i=0;i<n;i++)
+    rp->dcs[i]=dc_get(hlist[i].host,hlist[i].port,1);
+  rp->ndcs=n;
+}
+
+/*
+ * The server of domain the current user's searches should go to or NULL
+ * if there is no user or the servers of domain are not known yet
+ */
+struct dcstruct *dc_preferred(char *domain) {
+  struct rgstruct *rp;
+  struct dcstruct *pref=NULL;
+  unsigned int hash,best=0;
+  time_t now;
+  int i;
+
+  if (!affinity || !domain)
+    return(NULL);
+  for (rp=rings; rp; rp=rp->next) {
+    if (!strcasecmp(rp->domain,domain))
+      break;
+  }
+  if (!rp)
+    return(NULL);
+  now=time(NULL);
+  for (i=0;i<rp->ndcs;i++) {
+    if (!dc_available(rp->dcs[i],now))
+      continue;
+    hash=dc_hash(affinity,rp->dcs[i]);
+    if (!pref || hash > best) {
+      best=hash;
+      pref=rp->dcs[i];
+    }
+  }
+  return(pref);
+}
+
+/*
+ * Rendezvous weight of server dp for key (FNV-1a with a final mix)
+ */
+static unsigned int dc_hash(char *key,struct dcstruct *dp) {
+  unsigned int h=2166136261U;
+  char *p;
+
+  for (p=key; *p; p++)
+    h=(h^(unsigned char)*p)*16777619U;
+  h=(h^'@')*16777619U;
+  for (p=dp->host; *p; p++)
+    h=(h^(unsigned char)tolower((unsigned char)*p))*16777619U;
+  h=(h^(unsigned int)dp->port)*16777619U;
+  h^=h>>16;
+  h*=0x85ebca6bU;
+  h^=h>>13;
+  h*=0xc2b2ae35U;
+  h^=h>>16;
+  return(h);
+}
+
+/*
+ * Server is not in backoff
+ */
+static int dc_available(struct dcstruct *dp,time_t now) {
+  return(!(dp->state == DC_OPEN && now < dp->retry));
+}
+
+/*
+ * Number of user lookups to put into one search to the server
+ */
+int dc_window(struct dcstruct *dp) {
+  if (!dp)
+    return(DC_WINDOW_MAX);
+  return((int)dp->window);
+}
+
+/*
+ * A batched search for nusers users took msec milliseconds and returned
+ * rc: halve the window if the server was slow or overloaded, else grow it
+ * if the search filled it
+ */
+void dc_window_sample(struct main_args *margs,struct dcstruct *dp,int nusers,double msec,int rc) {
+  if (!dp)
+    return;
+  if (rc == LDAP_BUSY || rc == LDAP_UNAVAILABLE || rc == LDAP_TIMEOUT ||
+      rc == LDAP_TIMELIMIT_EXCEEDED || rc == LDAP_ADMINLIMIT_EXCEEDED ||
+      (rc == LDAP_SUCCESS && dc_slow(dp) > 0 && msec > dc_slow(dp)))
+    dc_congested(margs,dp);
+  else if (rc == LDAP_SUCCESS && nusers >= (int)dp->window && dp->window < DC_WINDOW_MAX)
+    dp->window+=1;
+}
+
+/*
+ * The server is slow or overloaded: halve its window
+ */
+static void dc_congested(struct main_args *margs,struct dcstruct *dp) {
+  if (!dp)
+    return;
+  dp->window/=2;
+  if (dp->window < 1)
+    dp->window=1;
+  if (margs->debug)
+    fprintf(stderr, "%s| %s: Ldap server %s:%d is slow, window reduced to %d\n",LogTime(), PROGRAM,dp->host,dp->port,(int)dp->window);
+}
+
+/*
+ * A search on dp was hedged to hp, won != 0 if hp answered first
+ */
+void dc_hedged(struct main_args *margs,struct dcstruct *dp,struct dcstruct *hp,int won) {
+  hedges++;
+  if (won)
+    hedge_wins++;
+  if (margs->debug)
+    fprintf(stderr, "%s| %s: Hedged search of %s:%d to %s:%d, %s answered first. Hedged %ld of %ld searches, %ld won\n",LogTime(), PROGRAM,dp?dp->host:"unknown",dp?dp->port:0,hp?hp->host:"unknown",hp?hp->port:0,won?"hedge":"original",hedges,searches,hedge_wins);
+}
+
+/*
+ * Leave dp out of the host lists (as long as there are other servers)
+ * until dc_avoid(NULL)
+ */
+void dc_avoid(struct dcstruct *dp) {
+  avoid=dp;
+}
+
+void dc_cleanup(void) {
+  struct dcstruct *dp;
+  struct rgstruct *rp;
+
+  while ((rp=rings)) {
+    rings=rp->next;
+    free(rp->domain);
+    if (rp->dcs)
+      free(rp->dcs);
+    free(rp);
+  }
+  dc_affinity(NULL);
+  while ((dp=dcs)) {
+    dcs=dp->next;
+    free(dp->host);
+    free(dp);
+  }
+}
@@ -0,0 +1,331 @@
+/*
+ * -----------------------------------------------------------------------------
+ *
+ * Author: Markus Moeller (markus_moeller at compuserve.com)
+ *
+ * Copyright (C) 2007 Markus Moeller. All rights reserved.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * -----------------------------------------------------------------------------
+ */
+
+
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "support.h"
+
+/*
+ * Heavy hitter tracking (-H file).
+ *
+ * Lookups of users and (nested) groups are counted in a count-min sketch
+ * and the most frequent ones are kept in a small top-K list. The list is
+ * written to the -H file every few minutes and at exit and read back at
+ * start. When squid is idle the helper refreshes the cached answers of the
+ * top users which are missing or about to expire, so they are warm at the
+ * next login peak or after a restart.
+ *
+ * The key of a user is case folded, so the user name as requested is
+ * kept with it (ldap servers may compare memberUid case sensitive).
+ */
+
+#define HH_WIDTH 2048
+#define HH_DEPTH 4
+#define HH_TOPK 64
+#define HH_SAVE 300
+#define HH_DECAY 86400
+
+struct hhstruct {
+  char *key;
+  char *user;
+  unsigned int count;
+  time_t refreshed;
+};
+
+struct hhlist {
+  unsigned int cms[HH_DEPTH][HH_WIDTH];
+  struct hhstruct top[HH_TOPK];
+  int ntop;
+};
+
+static struct hhlist hh_users;
+static struct hhlist hh_groups;
+static time_t hh_saved=0;
+static time_t hh_decayed=0;
+static int hh_next=0;
+
+static unsigned int hh_hash(const char *key,int row);
+static void hh_count(struct hhlist *hl,const char *key,const char *user,unsigned int inc);
+static void hh_decay(struct hhlist *hl);
+static void hh_free(struct hhlist *hl);
+static void hh_write(FILE *fp,struct hhlist *hl,char type);
+static int hh_compare(const void *p1,const void *p2);
+
+static unsigned int hh_hash(const char *key,int row) {
+  unsigned int h=2166136261U ^ (unsigned int)(row*0x9e3779b9U);
+
+  while (*key) {
+    h ^= (unsigned char)tolower((unsigned char)*key++);
+    h *= 16777619U;
+  }
+  return h % HH_WIDTH;
+}
+
+/*
+ * Add inc to the sketch and keep key in the top-K list if its
+ * estimated count is high enough
+ */
+static void hh_count(struct hhlist *hl,const char *key,const char *user,unsigned int inc) {
+  unsigned int est=0;
+  int i,min;
+
+  for (i=0;i<HH_DEPTH;i++) {
+    unsigned int *c=&hl->cms[i][hh_hash(key,i)];
+    *c += inc;
+    if (i == 0 || *c < est)
+      est = *c;
+  }
+  min=-1;
+  for (i=0;i<hl->ntop;i++) {
+    if (!strcasecmp(hl->top[i].key,key)) {
+      hl->top[i].count=est;
+      if (user && (!hl->top[i].user || strcmp(hl->top[i].user,user))) {
+        if (hl->top[i].user)
+          free(hl->top[i].user);
+        hl->top[i].user=strdup(user);
+      }
+      return;
+    }
+    if (min < 0 || hl->top[i].count < hl->top[min].count)
+      min=i;
+  }
+  if (hl->ntop < HH_TOPK) {
+    hl->top[hl->ntop].key=strdup(key);
+    hl->top[hl->ntop].user=user?strdup(user):NULL;
+    hl->top[hl->ntop].count=est;
+    hl->top[hl->ntop].refreshed=0;
+    hl->ntop++;
+  } else if (est > hl->top[min].count) {
+    free(hl->top[min].key);
+    if (hl->top[min].user)
+      free(hl->top[min].user);
+    hl->top[min].key=strdup(key);
+    hl->top[min].user=user?strdup(user):NULL;
+    hl->top[min].count=est;
+    hl->top[min].refreshed=0;
+  }
+}
+
+/*
+ * Halve all counts so the list follows changes in usage
+ */
+static void hh_decay(struct hhlist *hl) {
+  int i,j;
+
+  for (i=0;i<HH_DEPTH;i++)
+    for (j=0;j<HH_WIDTH;j++)
+      hl->cms[i][j] >>= 1;
+  for (i=0;i<hl->ntop;i++)
+    hl->top[i].count >>= 1;
+}
+
+static void hh_free(struct hhlist *hl) {
+  int i;
+
+  for (i=0;i<hl->ntop;i++) {
+    free(hl->top[i].key);
+    if (hl->top[i].user)
+      free(hl->top[i].user);
+  }
+  memset(hl,0,sizeof(struct hhlist));
+}
+
+static int hh_compare(const void *p1,const void *p2) {
+  const struct hhstruct *h1=(const struct hhstruct *)p1;
+  const struct hhstruct *h2=(const struct hhstruct *)p2;
+
+  if (h1->count > h2->count)
+    return(-1);
+  if (h1->count < h2->count)
+    return(1);
+  return(0);
+}
+
+static void hh_write(FILE *fp,struct hhlist *hl,char type) {
+  int i;
+
+  qsort(hl->top,hl->ntop,sizeof(struct hhstruct),hh_compare);
+  for (i=0;i<hl->ntop;i++) {
+    if (hl->top[i].user)
+      fprintf(fp,"%c %u %s\t%s\n",type,hl->top[i].count,hl->top[i].key,hl->top[i].user);
+    else
+      fprintf(fp,"%c %u %s\n",type,hl->top[i].count,hl->top[i].key);
+  }
+}
+
+void hh_user(struct main_args *margs,char *key,char *user) {
+  if (!margs->hfile || !key)
+    return;
+  hh_count(&hh_users,key,user,1);
+}
+
+void hh_group(struct main_args *margs,char *dn) {
+  if (!margs->hfile || !dn)
+    return;
+  hh_count(&hh_groups,dn,NULL,1);
+}
+
+/*
+ * Read the top-K lists of a previous run
+ */
+int hh_load(struct main_args *margs) {
+  FILE *fp;
+  char buf[1024];
+  char type,*c,*key,*user;
+  unsigned int count;
+  int n=0;
+
+  if (!margs->hfile)
+    return(0);
+  hh_saved=hh_decayed=time(NULL);
+  if ((fp=fopen(margs->hfile,"r")) == NULL) {
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: No heavy hitter list %s yet\n",LogTime(), PROGRAM,margs->hfile);
+    return(0);
+  }
+  while (fgets(buf,sizeof(buf),fp)) {
+    if ((c=strchr(buf,'\n')))
+      *c='\0';
+    type=buf[0];
+    if ((type != 'u' && type != 'g') || buf[1] != ' ')
+      continue;
+    count=strtoul(buf+2,&c,10);
+    if (*c != ' ' || !count)
+      continue;
+    key=c+1;
+    /* user name as requested after a tab */
+    if ((user=strchr(key,'\t')))
+      *user++='\0';
+    hh_count(type == 'u' ? &hh_users : &hh_groups,key,user,count);
+    n++;
+  }
+  fclose(fp);
+  if (margs->debug)
+    fprintf(stderr, "%s| %s: Read %d heavy hitters from %s\n",LogTime(), PROGRAM,n,margs->hfile);
+  return(0);
+}
+
+/*
+ * Write the top-K lists (also usable as statistics of what drives load)
+ */
+void hh_save(struct main_args *margs) {
+  FILE *fp;
+  char *tmp;
+  size_t len;
+
+  if (!margs->hfile)
+    return;
+  hh_saved=time(NULL);
+  /*
+   * All children of squid write the same file, each through its own
+   * temporary file so only complete lists are renamed into place
+   */
+  len=strlen(margs->hfile)+32;
+  tmp=malloc(len);
+  snprintf(tmp,len,"%s.%d.tmp",margs->hfile,(int)getpid());
+  if ((fp=fopen(tmp,"w")) == NULL) {
+    fprintf(stderr, "%s| %s: Error writing heavy hitter list %s: %s\n",LogTime(), PROGRAM,tmp,strerror(errno));
+    free(tmp);
+    return;
+  }
+  fprintf(fp,"# %s heavy hitters %s\n",PROGRAM,LogTime());
+  hh_write(fp,&hh_users,'u');
+  hh_write(fp,&hh_groups,'g');
+  if (fclose(fp) || rename(tmp,margs->hfile)) {
+    fprintf(stderr, "%s| %s: Error writing heavy hitter list %s: %s\n",LogTime(), PROGRAM,margs->hfile,strerror(errno));
+    unlink(tmp);
+  }
+  free(tmp);
+}
+
+/*
+ * Called when squid is idle. Refresh the cached answer of one top user
+ * which is missing or expires within a quarter of its ttl (but not more
+ * often than every HH_SAVE seconds).
+ * Returns 1 if a user was refreshed.
+ */
+int hh_idle(struct main_args *margs) {
+  struct custruct cu;
+  struct hhstruct *hp;
+  time_t now,expires;
+  char *c;
+  int i,verdict,ttl;
+
+  if (!margs->hfile)
+    return(0);
+  now=time(NULL);
+  if (now - hh_decayed >= HH_DECAY) {
+    hh_decay(&hh_users);
+    hh_decay(&hh_groups);
+    hh_decayed=now;
+  }
+  if (now - hh_saved >= HH_SAVE)
+    hh_save(margs);
+  if (!margs->cttl && !margs->nttl)
+    return(0);
+
+  for (i=0;i<hh_users.ntop;i++) {
+    if (hh_next >= hh_users.ntop)
+      hh_next=0;
+    hp=&hh_users.top[hh_next++];
+    if (now - hp->refreshed < HH_SAVE)
+      continue;
+    expires=cache_expires(margs,hp->key,&verdict);
+    ttl = expires ? (verdict ? margs->cttl : margs->nttl) : 0;
+    if (expires && expires - now > ttl/4)
+      continue;
+    if (!(c=strrchr(hp->key,'@')))
+      continue;
+    hp->refreshed=now;
+    cu.key=strdup(hp->key);
+    if (hp->user)
+      cu.user=strdup(hp->user);
+    else {
+      cu.user=strdup(hp->key);
+      cu.user[c-hp->key]='\0';
+    }
+    cu.domain=*(c+1) ? strdup(c+1) : NULL;
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: Refresh heavy hitter %s\n",LogTime(), PROGRAM,cu.key);
+    verdict=check_memberof(margs,cu.user,cu.domain);
+    /* keep the old answer if the server could not be asked */
+    if (verdict != MEMBER_ERROR) {
+      cache_put(margs,cu.key,verdict);
+      peer_send_verdict(margs,cu.key,verdict);
+    }
+    clean_cu(&cu);
+    return(1);
+  }
+  return(0);
+}
+
+void hh_cleanup(struct main_args *margs) {
+  if (margs->hfile && (hh_users.ntop || hh_groups.ntop))
+    hh_save(margs);
+  hh_free(&hh_users);
+  hh_free(&hh_groups);
+}
@@ -25,6 +25,8 @@
 #include <netdb.h>
 #include <ctype.h>
 #include <errno.h>
+#include <unistd.h>
+#include <poll.h>
 
 #include "support.h"
 
@@ -32,11 +34,20 @@ char *convert_domain_to_bind_path(char *domain);
 char *escape_filter(char *filter);
 int check_AD(struct main_args *margs, LDAP *ld);
 int ldap_set_defaults(struct main_args *margs, LDAP *ld);
-int ldap_set_ssl_defaults(struct main_args *margs);
 LDAP *tool_ldap_open(struct main_args *margs, char* host, int port, char *ssl);
+#ifdef HAVE_OPENLDAP
+LDAP *tool_ldaps_open(struct main_args *margs, char* host, int port);
+#endif
+static void ldap_transport(struct main_args *margs, LDAP *ld, char *host, int port, char *ssl);
+#ifdef HAVE_OPENLDAP
+static int ldap_search_hedged(struct main_args *margs,LDAP *ld,double after,char *base,int scope,char *filter,char **attrs,struct timeval *timeout,LDAPMessage **res);
+#endif
 
 #define CONNECT_TIMEOUT 2
 #define SEARCH_TIMEOUT 30
+#define KEEPALIVE_IDLE 60
+#define KEEPALIVE_PROBES 3
+#define KEEPALIVE_INTERVAL 10
 
 #define FILTER "(memberuid=%s)"
 #define ATTRIBUTE "cn"
@@ -46,9 +57,26 @@ LDAP *tool_ldap_open(struct main_args *margs, char* host, int port, char *ssl);
 
 #define FILTER_AD "(samaccountname=%s)"
 #define ATTRIBUTE_AD "memberof"
+#define ATTRIBUTE_SAM "samaccountname"
+#define FILTER_GROUP_CN "(&(objectclass=group)(cn=%s))"
+#define FILTER_CHAIN "(memberof:1.2.840.113556.1.4.1941:=%s)"
+#define ATTRIBUTE_NONE "1.1"
+#define ATTRIBUTE_SID "objectSid"
+#define ATTRIBUTE_TOKEN "tokenGroups"
+#define FILTER_ANY "(objectclass=*)"
 
 int get_attributes(struct main_args *margs, LDAP *ld, LDAPMessage *res, const char *attribute /* IN */, char ***out_val /* OUT (caller frees) */);
+char *get_attribute(struct main_args *margs, LDAP *ld, LDAPMessage *res, const char *attribute /* IN */);
 int search_group_tree(struct main_args *margs,LDAP *ld, char *bindp, char *ldap_group,char *group, int depth);
+static int get_memberof_try(struct main_args *margs,char* user,char* domain,char *group,int *stale);
+static int get_memberof_chunk(struct main_args *margs,LDAP *ld,char *bindp,char* domain,char **users,int nusers);
+static int get_group_refs(struct main_args *margs,LDAP *ld,char *bindp,char *domain,char *group,int sids,char ***refs);
+static int get_group_list(struct main_args *margs,LDAP *ld,char *bindp,char *domain,char **groups,int ngroups,int sids,char ***refs);
+static int get_memberof_chain(struct main_args *margs,LDAP *ld,char *bindp,char *user,char *domain,char **groups,int ngroups);
+static int get_memberof_token(struct main_args *margs,LDAP *ld,char *bindp,char *user,char *domain,char **groups,int ngroups);
+static int get_memberof_tree(struct main_args *margs,LDAP *ld,char *bindp,char *user,char *domain,char **groups,int ngroups);
+static int get_memberof_any_try(struct main_args *margs,char *user,char *domain,char **groups,int ngroups,int *stale);
+static char *sid_hex(struct berval *bv);
 
 #ifdef HAVE_SUN_LDAP_SDK
 #ifdef HAVE_LDAP_REBINDPROC_CALLBACK
@@ -276,10 +304,10 @@ char *escape_filter(char *filter) {
 
 int check_AD(struct main_args *margs, LDAP *ld) {
   LDAPMessage *res;
-  char **attr_value=NULL;
+  char *schema=NULL;
+  char *attrs[2];
   struct timeval searchtime;
-  int max_attr=0;
-  int j,rc=0;
+  int rc=0;
 
 #define FILTER_SCHEMA "(objectclass=*)"
 #define ATTRIBUTE_SCHEMA "schemaNamingContext"
@@ -290,17 +318,20 @@ int check_AD(struct main_args *margs, LDAP *ld) {
 
   if (margs->debug)
     fprintf(stderr, "%s| %s: Search ldap server with bind path \"\" and filter: %s\n",LogTime(), PROGRAM,FILTER_SCHEMA);
-  rc = ldap_search_ext_s(ld, (char *)"", LDAP_SCOPE_BASE, (char *)FILTER_SCHEMA, NULL, 0, 
+  attrs[0]=(char *)ATTRIBUTE_SCHEMA;
+  attrs[1]=NULL;
+  rc = ldap_search_ext_s(ld, (char *)"", LDAP_SCOPE_BASE, (char *)FILTER_SCHEMA, attrs, 0, 
                          NULL, NULL, &searchtime, 0, &res);
 
   if ( rc == LDAP_SUCCESS )
-    max_attr = get_attributes(margs,ld,res,ATTRIBUTE_SCHEMA,&attr_value);
+    schema = get_attribute(margs,ld,res,ATTRIBUTE_SCHEMA);
   
-  if (max_attr==1) {
+  if (schema) {
     ldap_msgfree(res);
     if (margs->debug)
-      fprintf(stderr, "%s| %s: Search ldap server with bind path %s and filter: %s\n",LogTime(), PROGRAM,attr_value[0],FILTER_SAM);
-    rc = ldap_search_ext_s(ld, attr_value[0], LDAP_SCOPE_SUBTREE, (char *)FILTER_SAM, NULL, 0, 
+      fprintf(stderr, "%s| %s: Search ldap server with bind path %s and filter: %s\n",LogTime(), PROGRAM,schema,FILTER_SAM);
+    attrs[0]=(char *)ATTRIBUTE_NONE;
+    rc = ldap_search_ext_s(ld, schema, LDAP_SCOPE_SUBTREE, (char *)FILTER_SAM, attrs, 0, 
                            NULL, NULL, &searchtime, 0, &res);
     if (margs->debug)
       fprintf(stderr, "%s| %s: Found %d ldap entr%s\n",LogTime(), PROGRAM, ldap_count_entries( ld, res),ldap_count_entries( ld, res)>1||ldap_count_entries( ld, res)==0?"ies":"y");
@@ -315,73 +346,145 @@ int check_AD(struct main_args *margs, LDAP *ld) {
   /*
    * Cleanup
    */
-  if (attr_value){
-    for (j=0;j<max_attr;j++) {
-      free(attr_value[j]);
-    }
-    free(attr_value);
-    attr_value=NULL;
-  }
+  if (schema)
+    free(schema);
   ldap_msgfree(res);
   return rc;
 }
-int search_group_tree(struct main_args *margs,LDAP *ld, char* bindp, char *ldap_group,char *group, int depth) {
+#define FILTER_GROUP_AD "(objectclass=group)"
+#define FILTER_GROUP "(&(memberuid=%s)(objectclass=posixgroup))"
+
+/*
+ * First CN= value of dn (caller frees), assumed to be the group name.
+ * dn itself stays intact for the searches of the group.
+ */
+static char *group_cn(const char *dn) {
+  const char *av=dn;
+  char *cn;
+  size_t len;
+
+  if (!strncasecmp("CN=",av,3))
+    av+=3;
+  len=strcspn(av,",");
+  cn=malloc(len+1);
+  memcpy(cn,av,len);
+  cn[len]='\0';
+  return cn;
+}
+
+/*
+ * Groups ldap_group is a member of (from the edge cache or the server).
+ * Returns the number of groups (caller frees) or -1 on error.
+ */
+static int get_group_parents(struct main_args *margs,LDAP *ld, char* bindp, char *ldap_group, char ***parents) {
   LDAPMessage *res=NULL;
   char **attr_value=NULL;
   int max_attr=0;
   char *filter=NULL;
   char *search_exp=NULL;
-  int j,rc=0,retval=0;
-  char *av=NULL,*avp=NULL;
-  int ldepth;
+  char *attrs[2];
+  int i,rc=0;
   char *ldap_filter_esc=NULL;
   struct timeval searchtime;
- 
-#define FILTER_GROUP_AD "(&(%s)(objectclass=group))"
-#define FILTER_GROUP "(&(memberuid=%s)(objectclass=posixgroup))"
 
   searchtime.tv_sec  = SEARCH_TIMEOUT;
   searchtime.tv_usec = 0;
 
-  if (margs->AD)
-    filter=(char *)FILTER_GROUP_AD;
-  else
+  hh_group(margs,ldap_group);
+  dep_add(margs,ldap_group);
+
+  /*
+   * Use cached (or peer provided) edges of the group graph if available
+   */
+  max_attr = margs->AD ? edge_get(margs,ldap_group,&attr_value) : -1;
+  if (max_attr < 0 && margs->AD) {
+    /*
+     * Read the group entry itself instead of searching the domain for it.
+     * A group outside the naming context of the server has no parents.
+     */
+    attrs[0]=(char *)ATTRIBUTE_AD;
+    attrs[1]=NULL;
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: Read ldap entry %s with filter : %s\n",LogTime(), PROGRAM,ldap_group,FILTER_GROUP_AD);
+    rc = ldap_search_timed(margs, ld, ldap_group, LDAP_SCOPE_BASE,
+                           (char *)FILTER_GROUP_AD, attrs, &searchtime, &res);
+    if (rc == LDAP_NO_SUCH_OBJECT || rc == LDAP_REFERRAL) {
+      if (margs->debug)
+        fprintf(stderr, "%s| %s: Group %s not found: %s\n",LogTime(), PROGRAM,ldap_group,ldap_err2string(rc));
+      rc = LDAP_SUCCESS;
+      max_attr = 0;
+    } else if (rc == LDAP_SUCCESS) {
+      max_attr = get_attributes(margs,ld,res,ATTRIBUTE_AD,&attr_value);
+    } else {
+      fprintf(stderr, "%s| %s: Error searching ldap server: %s\n",LogTime(), PROGRAM,ldap_err2string(rc));
+      if (res)
+        ldap_msgfree(res);
+      return -1;
+    }
+    if (res)
+      ldap_msgfree(res);
+    edge_put(margs,ldap_group,attr_value,max_attr);
+    peer_send_edge(margs,ldap_group,attr_value,max_attr);
+  } else if (max_attr < 0) {
     filter=(char *)FILTER_GROUP;
+    attrs[0]=(char *)ATTRIBUTE;
+    attrs[1]=NULL;
  
-  ldap_filter_esc = escape_filter(ldap_group); 
+    ldap_filter_esc = escape_filter(ldap_group); 
 
-  search_exp=malloc(strlen(filter)+strlen(ldap_filter_esc)+1);
-  snprintf(search_exp,strlen(filter)+strlen(ldap_filter_esc)+1, filter, ldap_filter_esc);
+    search_exp=malloc(strlen(filter)+strlen(ldap_filter_esc)+1);
+    snprintf(search_exp,strlen(filter)+strlen(ldap_filter_esc)+1, filter, ldap_filter_esc);
 
-  if (ldap_filter_esc)
-     free(ldap_filter_esc);
+    if (ldap_filter_esc)
+       free(ldap_filter_esc);
  
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: Search ldap server with bind path %s and filter : %s\n",LogTime(), PROGRAM,bindp,search_exp);
+    rc = ldap_search_timed(margs, ld, bindp, LDAP_SCOPE_SUBTREE,
+                           search_exp, attrs, &searchtime, &res);
+    if (search_exp)
+      free(search_exp);
+
+    if (rc != LDAP_SUCCESS) {
+      fprintf(stderr, "%s| %s: Error searching ldap server: %s\n",LogTime(), PROGRAM,ldap_err2string(rc));
+      if (res)
+        ldap_msgfree(res);
+      return -1;
+    }
+
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: Found %d ldap entr%s\n",LogTime(), PROGRAM, ldap_count_entries( ld, res),ldap_count_entries( ld, res)>1||ldap_count_entries( ld, res)==0?"ies":"y");
+
+    max_attr = get_attributes(margs,ld,res,ATTRIBUTE,&attr_value);
+    ldap_msgfree(res);
+  }
+  /*
+   * A change of the member attribute of a parent invalidates the answer
+   */
+  if (margs->AD) {
+    for (i=0;i<max_attr;i++)
+      dep_add(margs,attr_value[i]);
+  }
+  *parents=attr_value;
+  return max_attr;
+}
+
+int search_group_tree(struct main_args *margs,LDAP *ld, char* bindp, char *ldap_group,char *group, int depth) {
+  char **attr_value=NULL;
+  int max_attr=0;
+  int j,retval=0;
+  char *av=NULL;
+  int ldepth;
+
   if (depth > margs->mdepth) {
     if (margs->debug)
       fprintf(stderr, "%s| %s: Max search depth reached %d>%d\n",LogTime(), PROGRAM,depth,margs->mdepth);
     return 0;
   }
-  if (margs->debug)
-    fprintf(stderr, "%s| %s: Search ldap server with bind path %s and filter : %s\n",LogTime(), PROGRAM,bindp,search_exp);
-  rc = ldap_search_ext_s(ld, bindp, LDAP_SCOPE_SUBTREE,
-                         search_exp, NULL, 0, 
-                         NULL, NULL, &searchtime, 0, &res);
-  if (search_exp)
-    free(search_exp);
 
-  if (rc != LDAP_SUCCESS) {
-    fprintf(stderr, "%s| %s: Error searching ldap server: %s\n",LogTime(), PROGRAM,ldap_err2string(rc));
-    ldap_unbind_s(ld);
+  max_attr = get_group_parents(margs,ld,bindp,ldap_group,&attr_value);
+  if (max_attr < 0)
     return 0;
-  }
-
-  if (margs->debug)
-    fprintf(stderr, "%s| %s: Found %d ldap entr%s\n",LogTime(), PROGRAM, ldap_count_entries( ld, res),ldap_count_entries( ld, res)>1||ldap_count_entries( ld, res)==0?"ies":"y");
-
-  if (margs->AD)
-    max_attr = get_attributes(margs,ld,res,ATTRIBUTE_AD,&attr_value);
-  else 
-    max_attr = get_attributes(margs,ld,res,ATTRIBUTE,&attr_value);
   
   /*
    * Compare group names
@@ -391,13 +494,7 @@ int search_group_tree(struct main_args *margs,LDAP *ld, char* bindp, char *ldap_
   for (j=0;j<max_attr;j++) {
 
     /* Compare first CN= value assuming it is the same as the group name itself */
-    av=attr_value[j];
-    if (!strncasecmp("CN=",av,3)) {
-      av+=3;
-      if ((avp=strchr(av,','))) {
-        *avp='\0';
-      }
-    }
+    av=group_cn(attr_value[j]);
     if (margs->debug) { 
       int n;
       fprintf(stderr, "%s| %s: Entry %d \"%s\" in hex UTF-8 is ",LogTime(), PROGRAM, j+1, av);
@@ -409,31 +506,25 @@ int search_group_tree(struct main_args *margs,LDAP *ld, char* bindp, char *ldap_
       retval=1;
       if (margs->debug)
         fprintf(stderr, "%s| %s: Entry %d \"%s\" matches group name \"%s\"\n",LogTime(), PROGRAM, j+1, av, group);
+      free(av);
       break;
     } else {
       if (margs->debug)
         fprintf(stderr, "%s| %s: Entry %d \"%s\" does not match group name \"%s\"\n",LogTime(), PROGRAM, j+1, av, group);
     }
     /*
-     * Do recursive group search
+     * Do recursive group search with the full DN of the group
      */
     if (margs->debug)
       fprintf(stderr, "%s| %s: Perform recursive group search for group \"%s\"\n",LogTime(), PROGRAM,av);
-    av=attr_value[j];
-    if (search_group_tree(margs,ld,bindp,av,group,ldepth)) {
+    if (search_group_tree(margs,ld,bindp,attr_value[j],group,ldepth)) {
       retval=1;
-      if (!strncasecmp("CN=",av,3)) {
-        av+=3;
-        if ((avp=strchr(av,','))) {
-          *avp='\0';
-        }
-      }
       if (margs->debug)
         fprintf(stderr, "%s| %s: Entry %d \"%s\" is member of group named \"%s\"\n",LogTime(), PROGRAM, j+1, av, group);
-    else
-        break;
-
+      free(av);
+      break;
     }
+    free(av);
   }
 
   /*
@@ -446,7 +537,6 @@ int search_group_tree(struct main_args *margs,LDAP *ld, char* bindp, char *ldap_
     free(attr_value);
     attr_value=NULL;
   }
-  ldap_msgfree(res);
 
   return retval;
 }
@@ -479,6 +569,26 @@ int ldap_set_defaults(struct main_args *margs, LDAP *ld) {
     return rc;
   }
 #endif /* LDAP_OPT_NETWORK_TIMEOUT */
+#ifdef LDAP_OPT_X_KEEPALIVE_IDLE
+  /*
+   * Let TCP keepalives detect connections dropped by firewalls or servers
+   * while pooled. Failures are not fatal.
+   */
+  val = KEEPALIVE_IDLE;
+  rc = ldap_set_option(ld, LDAP_OPT_X_KEEPALIVE_IDLE, &val);
+  if ( rc == LDAP_SUCCESS ) {
+    val = KEEPALIVE_PROBES;
+    rc = ldap_set_option(ld, LDAP_OPT_X_KEEPALIVE_PROBES, &val);
+  }
+  if ( rc == LDAP_SUCCESS ) {
+    val = KEEPALIVE_INTERVAL;
+    rc = ldap_set_option(ld, LDAP_OPT_X_KEEPALIVE_INTERVAL, &val);
+  }
+  if ( rc != LDAP_SUCCESS ) {
+    if(margs->debug)
+      fprintf(stderr, "%s| %s: Error while setting keepalive: %s\n",LogTime(), PROGRAM,ldap_err2string(rc));
+  }
+#endif /* LDAP_OPT_X_KEEPALIVE_IDLE */
   return LDAP_SUCCESS;
 }
 
@@ -523,6 +633,9 @@ int ldap_set_ssl_defaults(struct main_args *margs) {
       return rc;
     }
   }
+#ifdef TLS_RESUME
+  tls_init(margs);
+#endif
 #elif defined(HAVE_LDAPSSL_CLIENT_INIT)
   /* 
    *  Solaris SSL ldap calls require path to certificate database
@@ -574,65 +687,34 @@ int get_attributes(struct main_args *margs,LDAP *ld,LDAPMessage *res, const char
  */
 
   LDAPMessage *msg;
+  struct berval **values;
   char **attr_value=NULL;
   int max_attr=0;
+  int il;
 
   attr_value=*ret_value;
   /*
-   * loop over attributes
+   * Read the attribute of each entry by name. The searches request only
+   * the attributes needed, so there is nothing else to skip.
    */
   if (margs->debug)
     fprintf(stderr, "%s| %s: Search ldap entries for attribute : %s\n",LogTime(), PROGRAM,attribute);
   for (msg = ldap_first_entry (ld, res); msg; msg = ldap_next_entry (ld, msg))
     {
+      if ( (values = ldap_get_values_len (ld, msg, (char *)attribute)) == NULL )
+        continue;
+      for (il = 0; values[il] != NULL; il++)
+        {
+          attr_value= realloc (attr_value,(max_attr+1)*sizeof(char *));
+          if ( !attr_value) 
+            break;
 
-      BerElement *b;
-      char *attr;
-
-      switch (ldap_msgtype( msg )) {
-
-      case LDAP_RES_SEARCH_ENTRY:
-
-	for (attr = ldap_first_attribute (ld, msg, &b); attr;
-	     attr = ldap_next_attribute (ld, msg, b))
-	  {
-	    if (strcasecmp (attr, attribute) == 0)
-	      {
-		struct berval **values;
-		int il;
-
-		if ( (values = ldap_get_values_len (ld, msg, attr)) != NULL )
-		  {
-		    for (il = 0; values[il] != NULL; il++)
-		      {
-
-			attr_value= realloc (attr_value,(il+1)*sizeof(char *));
-			if ( !attr_value) 
-			  break;
-
-                        attr_value[il] = malloc (values[il]->bv_len + 1);
-                        memcpy(attr_value[il],values[il]->bv_val,values[il]->bv_len);   
-			attr_value[il][values[il]->bv_len]=0;
-		      }
-		    max_attr=il;
-		  }
-		ber_bvecfree(values);
-	      }
-	    ldap_memfree (attr);
-	  }
-	ber_free (b, 0);
-	break;
-      case LDAP_RES_SEARCH_REFERENCE:
-	if (margs->debug)
-	  fprintf(stderr, "%s| %s: Received a search reference message\n",LogTime(), PROGRAM);
-	break;
-      case LDAP_RES_SEARCH_RESULT:
-	if (margs->debug)
-	  fprintf(stderr, "%s| %s: Received a search result message\n",LogTime(), PROGRAM);
-	break;
-      default:
-	break;
-      }
+          attr_value[max_attr] = malloc (values[il]->bv_len + 1);
+          memcpy(attr_value[max_attr],values[il]->bv_val,values[il]->bv_len);   
+          attr_value[max_attr][values[il]->bv_len]=0;
+          max_attr++;
+        }
+      ber_bvecfree(values);
     }
 
   if (margs->debug)
@@ -642,6 +724,122 @@ int get_attributes(struct main_args *margs,LDAP *ld,LDAPMessage *res, const char
   return max_attr;
 }
 
+/*
+ * First value of attribute in the first entry of res (caller frees)
+ * or NULL
+ */
+char *get_attribute(struct main_args *margs,LDAP *ld,LDAPMessage *res, const char *attribute) {
+  LDAPMessage *msg;
+  struct berval **values;
+  char *value=NULL;
+
+  if ((msg = ldap_first_entry (ld, res)) == NULL)
+    return NULL;
+  if ( (values = ldap_get_values_len (ld, msg, (char *)attribute)) == NULL )
+    return NULL;
+  if (values[0]) {
+    value = malloc (values[0]->bv_len + 1);
+    memcpy(value,values[0]->bv_val,values[0]->bv_len);
+    value[values[0]->bv_len]=0;
+  }
+  ber_bvecfree(values);
+  if (margs->debug)
+    fprintf(stderr, "%s| %s: Attribute %s is %s\n",LogTime(), PROGRAM,attribute,value?value:"not set");
+  return value;
+}
+
+#ifdef HAVE_OPENLDAP
+/*
+ * Open an ldaps connection to host:port
+ */
+LDAP *tool_ldaps_open(struct main_args *margs, char* host, int port) {
+    LDAP *ld=NULL;
+    LDAPURLDesc *url=NULL;
+    char *ldapuri=NULL;
+    int rc=0;
+
+    url = malloc(sizeof(*url));
+    memset( url, 0, sizeof(*url));
+#ifdef HAVE_LDAP_URL_LUD_SCHEME
+    url->lud_scheme = (char *)"ldaps";
+#endif
+    url->lud_host = host;
+    url->lud_port = port;
+#ifdef HAVE_LDAP_SCOPE_DEFAULT
+    url->lud_scope = LDAP_SCOPE_DEFAULT;
+#else
+    url->lud_scope = LDAP_SCOPE_SUBTREE;
+#endif
+#ifdef HAVE_LDAP_URL_DESC2STR
+    ldapuri = ldap_url_desc2str( url );
+#elif defined(HAVE_LDAP_URL_PARSE)
+    rc = ldap_url_parse(ldapuri, &url);
+    if (rc != LDAP_SUCCESS) {
+      fprintf(stderr, "%s| %s: Error while parsing url: %s\n",LogTime(), PROGRAM,ldap_err2string(rc));
+      if (ldapuri)
+	free(ldapuri);
+      if (url)
+	free(url);
+      return NULL;
+    }
+#else
+#error "No URL parsing function"
+#endif      
+    if (url) {
+      free(url);
+      url=NULL;
+    }
+    rc = ldap_initialize(&ld, ldapuri);
+    if (ldapuri)
+      free(ldapuri);
+    if (rc != LDAP_SUCCESS) {
+      fprintf(stderr, "%s| %s: Error while initialising connection to ldap server: %s\n",LogTime(), PROGRAM,ldap_err2string(rc));
+      ldap_unbind(ld);
+      ld = NULL;
+      return NULL;
+    } 
+    rc = ldap_set_defaults(margs,ld);
+    if (rc != LDAP_SUCCESS) {
+      fprintf(stderr, "%s| %s: Error while setting default options for ldap server: %s\n",LogTime(), PROGRAM,ldap_err2string(rc));
+      ldap_unbind(ld);
+      ld = NULL;
+      return NULL;
+    }
+    return ld;
+}
+#endif
+
+/*
+ * Remember how the ssl connection ld to host:port was set up (Start TLS
+ * or ldaps and port), so the next connection does not try Start TLS again
+ * if the server only supports ldaps
+ */
+static void ldap_transport(struct main_args *margs, LDAP *ld, char *host, int port, char *ssl) {
+#if defined(HAVE_OPENLDAP) && defined(HAVE_LDAP_URL_LUD_SCHEME)
+  LDAPURLDesc *url=NULL;
+  char *uri=NULL;
+
+  if (!ssl)
+    return;
+  if (ldap_get_option(ld,LDAP_OPT_URI,&uri) != LDAP_OPT_SUCCESS || !uri)
+    return;
+  if (ldap_url_parse(uri,&url) == LDAP_SUCCESS) {
+    if (url->lud_scheme && !strcasecmp(url->lud_scheme,"ldaps"))
+      dc_set_transport(margs,host,port,DC_LDAPS,url->lud_port?url->lud_port:LDAPS_PORT);
+    else
+      dc_set_transport(margs,host,port,DC_STARTTLS,port);
+    ldap_free_urldesc(url);
+  }
+  ldap_memfree(uri);
+#else
+  margs = margs;
+  ld = ld;
+  host = host;
+  port = port;
+  ssl = ssl;
+#endif
+}
+
 /*
  * call to open ldap server with or without SSL
  */
@@ -650,6 +848,7 @@ LDAP *tool_ldap_open(struct main_args *margs, char* host, int port, char *ssl) {
 #ifdef HAVE_OPENLDAP
     LDAPURLDesc *url=NULL;
     char *ldapuri=NULL;
+    int tport;
 #endif
     int rc=0;
 
@@ -658,13 +857,24 @@ LDAP *tool_ldap_open(struct main_args *margs, char* host, int port, char *ssl) {
        * (Not sure if this is the best way)
        */
 #ifdef HAVE_OPENLDAP
+      if (ssl && dc_get_transport(margs,host,port,&tport) == DC_LDAPS) {
+        /*
+         * Server is known to need ldaps
+         */
+        if (margs->debug)
+          fprintf(stderr, "%s| %s: Use ldaps on port %d for ldap server %s\n",LogTime(), PROGRAM,tport,host);
+        rc = ldap_set_ssl_defaults(margs);
+        if (rc != LDAP_SUCCESS) {
+          fprintf(stderr, "%s| %s: Error while setting SSL default options for ldap server: %s\n",LogTime(), PROGRAM,ldap_err2string(rc));
+          return NULL;
+        }
+        return tool_ldaps_open(margs,host,tport);
+      }
       url = malloc(sizeof(*url));
       memset( url, 0, sizeof(*url));
 #ifdef HAVE_LDAP_URL_LUD_SCHEME
-      if (ssl) 
-        url->lud_scheme = (char *)"ldaps";
-      else
-        url->lud_scheme = (char *)"ldap";
+      /* ssl is set up with Start TLS below */
+      url->lud_scheme = (char *)"ldap";
 #endif
       url->lud_host = host;
       url->lud_port = port;
@@ -733,54 +943,8 @@ LDAP *tool_ldap_open(struct main_args *margs, char* host, int port, char *ssl) {
 	if ( rc != LDAP_SUCCESS ) {
 	  fprintf(stderr, "%s| %s: Error while setting start_tls for ldap server: %s\n",LogTime(), PROGRAM,ldap_err2string(rc));
           ldap_unbind(ld);
-          ld=NULL;
-          url = malloc(sizeof(*url));
-          memset( url, 0, sizeof(*url));
-#ifdef HAVE_LDAP_URL_LUD_SCHEME
-          url->lud_scheme = (char *)"ldaps";
-#endif
-          url->lud_host = host;
-          url->lud_port = port;
-#ifdef HAVE_LDAP_SCOPE_DEFAULT
-          url->lud_scope = LDAP_SCOPE_DEFAULT;
-#else
-          url->lud_scope = LDAP_SCOPE_SUBTREE;
-#endif
-#ifdef HAVE_LDAP_URL_DESC2STR
-          ldapuri = ldap_url_desc2str( url );
-#elif defined(HAVE_LDAP_URL_PARSE)
-          rc = ldap_url_parse(ldapuri, &url);
-          if (rc != LDAP_SUCCESS) {
-            fprintf(stderr, "%s| %s: Error while parsing url: %s\n",LogTime(), PROGRAM,ldap_err2string(rc));
-            if (ldapuri)
-	      free(ldapuri);
-            if (url)
-	      free(url);
-            return NULL;
-          }
-#else
-#error "No URL parsing function"
-#endif      
-          if (url) {
-	    free(url);
-            url=NULL;
-          }
-          rc = ldap_initialize(&ld, ldapuri);
-          if (ldapuri)
-	    free(ldapuri);
-          if (rc != LDAP_SUCCESS) {
-            fprintf(stderr, "%s| %s: Error while initialising connection to ldap server: %s\n",LogTime(), PROGRAM,ldap_err2string(rc));
-            ldap_unbind(ld);
-            ld = NULL;
-            return NULL;
-          } 
-          rc = ldap_set_defaults(margs,ld);
-          if (rc != LDAP_SUCCESS) {
-            fprintf(stderr, "%s| %s: Error while setting default options for ldap server: %s\n",LogTime(), PROGRAM,ldap_err2string(rc));
-            ldap_unbind(ld);
-            ld = NULL;
-            return NULL;
-          }
+          /* Fall back to ldaps */
+          return tool_ldaps_open(margs,host,port == LDAP_PORT ? LDAPS_PORT : port);
 	}
 #elif defined(HAVE_LDAPSSL_CLIENT_INIT)
 	ld = ldapssl_init(host,port,1);
@@ -804,37 +968,211 @@ LDAP *tool_ldap_open(struct main_args *margs, char* host, int port, char *ssl) {
       return ld;
 }
 
+#ifdef HAVE_OPENLDAP
 /*
- * ldap calls to get attribute from Ldap Directory Server
+ * Search on ld and, if there is no answer after after milliseconds, on a
+ * connection to another server of the domain as well. The first answer is
+ * taken and the other search abandoned.
  */
-int get_memberof(struct main_args *margs,char* user,char* domain,char *group) {
+static int ldap_search_hedged(struct main_args *margs,LDAP *ld,double after,char *base,int scope,char *filter,char **attrs,struct timeval *timeout,LDAPMessage **res) {
+  LDAP *lds[2];
+  int ids[2];
+  struct pollfd pfd[2];
+  struct timeval start,hstart,tv;
+  double limit,wait;
+  int i,n,rc,err,done=-1,hedged=0;
+
+  gettimeofday(&start,NULL);
+  hstart=start;
+  limit=timeout->tv_sec*1000.0+timeout->tv_usec/1000.0;
+  *res=NULL;
+  lds[0]=ld;
+  lds[1]=NULL;
+  ids[1]=-1;
+  rc = ldap_search_ext(ld, base, scope, filter, attrs, 0,
+                       NULL, NULL, timeout, 0, &ids[0]);
+  if (rc != LDAP_SUCCESS)
+    return rc;
+
+  while (done < 0 && (lds[0] || lds[1])) {
+    for (i=0;i<2 && done < 0;i++) {
+      if (!lds[i])
+        continue;
+      tv.tv_sec=0;
+      tv.tv_usec=0;
+      rc = ldap_result(lds[i], ids[i], LDAP_MSG_ALL, &tv, res);
+      if (rc > 0) {
+        done=i;
+      } else if (rc < 0) {
+        if (i == 1)
+          pool_release(margs,lds[1],1);
+        lds[i]=NULL;
+      }
+    }
+    if (done >= 0 || dc_since(&start) >= limit)
+      break;
+    if (!hedged && dc_since(&start) >= after) {
+      hedged=1;
+      lds[1]=pool_hedge(margs,ld);
+      if (lds[1]) {
+        gettimeofday(&hstart,NULL);
+        rc = ldap_search_ext(lds[1], base, scope, filter, attrs, 0,
+                             NULL, NULL, timeout, 0, &ids[1]);
+        if (rc != LDAP_SUCCESS) {
+          pool_release(margs,lds[1],1);
+          lds[1]=NULL;
+        }
+      }
+      continue;
+    }
+    /*
+     * Wait for an answer (at most 50 ms as TLS may keep data buffered)
+     */
+    wait=(hedged ? limit : after) - dc_since(&start);
+    if (wait > 50)
+      wait=50;
+    if (wait < 0)
+      wait=0;
+    for (i=0,n=0;i<2;i++) {
+      if (lds[i] && ldap_get_option(lds[i], LDAP_OPT_DESC, &pfd[n].fd) == LDAP_OPT_SUCCESS) {
+        pfd[n].events=POLLIN;
+        n++;
+      }
+    }
+    poll(pfd,n,(int)wait);
+  }
+
+  if (done >= 0) {
+    rc = ldap_parse_result(lds[done], *res, &err, NULL, NULL, NULL, NULL, 0);
+    if (rc == LDAP_SUCCESS)
+      rc=err;
+    if (rc == LDAP_SUCCESS || rc == LDAP_NO_SUCH_OBJECT)
+      dc_latency(margs,pool_dc(lds[done]),0,done ? dc_since(&hstart) : dc_since(&start));
+  } else {
+    if (*res)
+      ldap_msgfree(*res);
+    *res=NULL;
+    rc = lds[0] || lds[1] ? LDAP_TIMEOUT : LDAP_SERVER_DOWN;
+  }
+  if (hedged && lds[1])
+    dc_hedged(margs,pool_dc(ld),pool_dc(lds[1]),done == 1);
+  for (i=0;i<2;i++) {
+    if (lds[i] && i != done)
+      ldap_abandon_ext(lds[i], ids[i], NULL, NULL);
+  }
+  if (done == 1) {
+    /* the slow server was at least this slow */
+    dc_latency(margs,pool_dc(ld),0,dc_since(&start));
+  }
+  if (lds[1])
+    pool_release(margs,lds[1],0);
+  return rc;
+}
+#endif
+
+/*
+ * ldap_search_ext_s on a pooled connection which records the time taken
+ * for the server of the connection (see support_dc.c). With -Q slow
+ * searches are hedged to a second server.
+ */
+int ldap_search_timed(struct main_args *margs,LDAP *ld,char *base,int scope,char *filter,char **attrs,struct timeval *timeout,LDAPMessage **res) {
+  struct timeval start;
+  int rc;
+#ifdef HAVE_OPENLDAP
+  double after;
+
+  if (margs->hedge && (after=dc_hedge_after(pool_dc(ld))) > 0) {
+    rc = ldap_search_hedged(margs,ld,after,base,scope,filter,attrs,timeout,res);
+  } else
+#endif
+  {
+    gettimeofday(&start,NULL);
+    rc = ldap_search_ext_s(ld, base, scope, filter, attrs, 0,
+                           NULL, NULL, timeout, 0, res);
+    if (rc == LDAP_SUCCESS || rc == LDAP_NO_SUCH_OBJECT)
+      dc_latency(margs,pool_dc(ld),0,dc_since(&start));
+  }
+  return rc;
+}
+
+#ifdef CONNECT_RACE
+/*
+ * Set up ldap on a socket already connected to host (see connect_race)
+ */
+LDAP *tool_ldap_open_fd(struct main_args *margs, int fd, char* host, int port, char *ssl) {
+  LDAP *ld=NULL;
+  char *ldapuri;
+  size_t len;
+  int rc,tport;
+
+  if (ssl && dc_get_transport(margs,host,port,&tport) == DC_LDAPS) {
+    close(fd);
+    return tool_ldap_open(margs,host,port,ssl);
+  }
+  len=strlen(host)+20;
+  ldapuri=malloc(len);
+  if (strchr(host,':'))
+    snprintf(ldapuri,len,"ldap://[%s]:%d",host,port);
+  else
+    snprintf(ldapuri,len,"ldap://%s:%d",host,port);
+  rc = ldap_init_fd(fd, LDAP_PROTO_TCP, ldapuri, &ld);
+  free(ldapuri);
+  if (rc != LDAP_SUCCESS) {
+    fprintf(stderr, "%s| %s: Error while initialising connection to ldap server: %s\n",LogTime(), PROGRAM,ldap_err2string(rc));
+    close(fd);
+    return NULL;
+  }
+  rc = ldap_set_defaults(margs,ld);
+  if (rc != LDAP_SUCCESS) {
+    fprintf(stderr, "%s| %s: Error while setting default options for ldap server: %s\n",LogTime(), PROGRAM,ldap_err2string(rc));
+    ldap_unbind(ld);
+    return NULL;
+  }
+  if (ssl) {
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: Set SSL defaults\n",LogTime(), PROGRAM);
+    rc = ldap_set_ssl_defaults(margs);
+    if (rc != LDAP_SUCCESS) {
+      fprintf(stderr, "%s| %s: Error while setting SSL default options for ldap server: %s\n",LogTime(), PROGRAM,ldap_err2string(rc));
+      ldap_unbind(ld);
+      return NULL;
+    }
+    rc = ldap_start_tls_s(ld, NULL, NULL);
+    if ( rc != LDAP_SUCCESS ) {
+      fprintf(stderr, "%s| %s: Error while setting start_tls for ldap server: %s\n",LogTime(), PROGRAM,ldap_err2string(rc));
+      ldap_unbind(ld);
+      /* Fall back to ldaps */
+      return tool_ldaps_open(margs,host,port == LDAP_PORT ? LDAPS_PORT : port);
+    }
+  }
+  return ld;
+}
+#endif
+
+/*
+ * Set up an authenticated connection to an ldap server of domain (or to the
+ * server given by the ldap url) and determine if it is an AD server.
+ * Release with free_ldap_connection.
+ */
+LDAP *get_ldap_connection(struct main_args *margs,char* domain,char **bind_path,struct ldap_creds **ldap_creds,struct dcstruct **dc) {
   LDAP *ld=NULL;
-  LDAPMessage *res;
 #ifndef HAVE_SUN_LDAP_SDK
   int ldap_debug=0;
 #endif
   struct ldap_creds *lcreds=NULL;
   char *bindp=NULL;
-  char *filter=NULL;
-  char *search_exp;
-  struct timeval searchtime;
   int i,j,rc=0,kc=1;
-  int retval;
-  char **attr_value=NULL;
-  char *av=NULL,*avp=NULL;
-  int max_attr=0;
   struct hstruct *hlist=NULL;
-  int nhosts=0;
+  struct castruct *alist=NULL;
+  int nhosts=0,naddrs=0,fd;
+  struct dcstruct *dp=NULL;
+  struct timeval start;
   char *hostname;
   char *host;
   int port;
   char *ssl=NULL;
   char* p;
-  char* ldap_filter_esc=NULL;
-
 
-  searchtime.tv_sec  = SEARCH_TIMEOUT;
-  searchtime.tv_usec = 0;
   /*
    * Fill Kerberos memory cache with credential from keytab for SASL/GSSAPI
    */
@@ -852,7 +1190,6 @@ int get_memberof(struct main_args *margs,char* user,char* domain,char *group) {
     /*
      * If Kerberos fails and no url given exit here
      */
-    retval=0;
     goto cleanup;
   }
 
@@ -881,16 +1218,57 @@ int get_memberof(struct main_args *margs,char* user,char* domain,char *group) {
      * Loop over list of ldap servers of users domain
      */
     nhosts=get_ldap_hostname_list(margs,&hlist,0,domain);
-    for (i=0;i<nhosts;i++) {
+    dc_ring(domain,hlist,nhosts);
+    nhosts=dc_filter(margs,hlist,nhosts);
+#ifdef CONNECT_RACE
+    naddrs=connect_list(margs,hlist,nhosts,&alist);
+#endif
+    j=0;
+    while (1) {
+      fd=-1;
+#ifdef ASYNC_SETUP
+      if (naddrs > 0) {
+        /*
+         * Connect, Start TLS and bind to the servers, overlapping slow ones
+         */
+        ld=setup_race(margs,hlist,alist,naddrs,bindp,margs->ssl,&i,&start);
+        if (!ld)
+          break;
+        port=389;
+        if (hlist[i].port != -1)
+          port=hlist[i].port;
+        goto bound;
+      }
+#endif
+      if (naddrs > 0) {
+        /*
+         * Race connects to all addresses of the servers not tried yet
+         */
+        fd=connect_race(margs,alist,naddrs,&i);
+        if (fd < 0)
+          break;
+      } else {
+        if (j >= nhosts)
+          break;
+        i=j++;
+      }
       port=389;
       if (hlist[i].port != -1)
 	port=hlist[i].port;
       if (margs->debug)
 	fprintf(stderr, "%s| %s: Setting up connection to ldap server %s:%d\n",LogTime(), PROGRAM, hlist[i].host,port);
 
+      gettimeofday(&start,NULL);
+#ifdef CONNECT_RACE
+      if (fd >= 0)
+        ld = tool_ldap_open_fd(margs,fd,hlist[i].host,port,margs->ssl);
+      else
+#endif
       ld = tool_ldap_open(margs,hlist[i].host,port,margs->ssl);
-      if (!ld)
-	  continue;
+      if (!ld) {
+        dc_failed(margs,dc_get(hlist[i].host,port,1));
+	continue;
+      }
 
       /*
        * ldap bind with SASL/GSSAPI authentication (only possible if a domain was part of the username)
@@ -903,14 +1281,26 @@ int get_memberof(struct main_args *margs,char* user,char* domain,char *group) {
       rc = tool_sasl_bind(ld, bindp, margs->ssl);
       if (rc != LDAP_SUCCESS) {
         fprintf(stderr, "%s| %s: Error while binding to ldap server with SASL/GSSAPI: %s\n",LogTime(), PROGRAM,ldap_err2string(rc));
+        if (rc == LDAP_SERVER_DOWN || rc == LDAP_CONNECT_ERROR)
+          dc_failed(margs,dc_get(hlist[i].host,port,1));
         ldap_unbind(ld);
         ld=NULL;
         continue;
       }
+#ifdef ASYNC_SETUP
+    bound:
+#endif
       lcreds=malloc(sizeof(struct ldap_creds));
       lcreds->dn = bindp?strdup(bindp):NULL;
       lcreds->pw = margs->ssl?strdup(margs->ssl):NULL;
       ldap_set_rebind_proc(ld, ldap_sasl_rebind,(char *)lcreds);
+      dp=dc_get(hlist[i].host,port,1);
+      dc_latency(margs,dp,1,dc_since(&start));
+      dc_success(margs,dp);
+      ldap_transport(margs,ld,hlist[i].host,port,margs->ssl);
+#ifdef TLS_RESUME
+      tls_save(margs,ld);
+#endif
       if ( ld != NULL ) {
 	if (margs->debug)
 	    fprintf(stderr, "%s| %s: %s initialised %sconnection to ldap server %s:%d\n",LogTime(), PROGRAM, ld?"Successfully":"Failed to",margs->ssl?"SSL protected ":"",hlist[i].host,port);	break;
@@ -922,7 +1312,27 @@ int get_memberof(struct main_args *margs,char* user,char* domain,char *group) {
       continue;
 #endif
     }
-    free_hostname_list(&hlist,nhosts);
+#ifdef CONNECT_RACE
+    /*
+     * Servers of which all addresses failed to connect
+     */
+    for (j=0;j<nhosts;j++) {
+      int tried=0,failed=1;
+
+      for (i=0;i<naddrs;i++) {
+        if (alist[i].host != j)
+          continue;
+        tried=1;
+        if (alist[i].state != CA_DONE)
+          failed=0;
+      }
+      if (tried && failed)
+        dc_failed(margs,dc_get(hlist[j].host,hlist[j].port,1));
+    }
+#endif
+    if (alist)
+      free(alist);
+    free_hostname_list(&hlist,nhosts);
     if ( ld == NULL ) {
       if (margs->debug)
         fprintf(stderr, "%s| %s: Error during initialisation of ldap connection: %s\n",LogTime(), PROGRAM,strerror(errno));
@@ -957,11 +1367,17 @@ int get_memberof(struct main_args *margs,char* user,char* domain,char *group) {
     if (host)
       free(host);
     host=NULL;
+    for (i=0;i<nhosts;i++)
+      hlist[i].port=port;
+    nhosts=dc_filter(margs,hlist,nhosts);
     for (i=0;i<nhosts;i++) {
 
+      gettimeofday(&start,NULL);
       ld = tool_ldap_open(margs,hlist[i].host,port,ssl);
-      if (!ld) 
-	  continue;
+      if (!ld) {
+        dc_failed(margs,dc_get(hlist[i].host,port,1));
+	continue;
+      }
       /*
        * ldap bind with username/password authentication
        */
@@ -979,6 +1395,13 @@ int get_memberof(struct main_args *margs,char* user,char* domain,char *group) {
       lcreds->dn = strdup(margs->luser);
       lcreds->pw = strdup(margs->lpass);
       ldap_set_rebind_proc(ld, ldap_simple_rebind,(char *)lcreds);
+      dp=dc_get(hlist[i].host,port,1);
+      dc_latency(margs,dp,1,dc_since(&start));
+      dc_success(margs,dp);
+      ldap_transport(margs,ld,hlist[i].host,port,ssl);
+#ifdef TLS_RESUME
+      tls_save(margs,ld);
+#endif
       if (margs->debug)
 	fprintf(stderr, "%s| %s: %s set up %sconnection to ldap server %s:%d\n",LogTime(), PROGRAM, ld?"Successfully":"Failed to",ssl?"SSL protected ":"",hlist[i].host,port);
       break;
@@ -997,13 +1420,9 @@ int get_memberof(struct main_args *margs,char* user,char* domain,char *group) {
   if ( ld == NULL ) {
     if (margs->debug)
       fprintf(stderr, "%s| %s: Error during initialisation of ldap connection: %s\n",LogTime(), PROGRAM,strerror(errno));
-    retval=0;
     goto cleanup;
   }
  
-  /*
-   * ldap search for user
-   */
   /* 
    * Check if server is AD by querying for attribute samaccountname
    */
@@ -1013,127 +1432,864 @@ int get_memberof(struct main_args *margs,char* user,char* domain,char *group) {
     fprintf(stderr, "%s| %s: Error determining ldap server type: %s\n",LogTime(), PROGRAM,ldap_err2string(rc));
     ldap_unbind(ld);
     ld=NULL;
-    retval=0;
     goto cleanup;
   }
-  
-  if (margs->AD)
-    filter=(char *)FILTER_AD;
-  else
-    filter=(char *)FILTER;
 
-  ldap_filter_esc = escape_filter(user);
+  *bind_path=bindp;
+  *ldap_creds=lcreds;
+  if (dc)
+    *dc=dp;
+  return ld;
 
-  search_exp=malloc(strlen(filter)+strlen(ldap_filter_esc)+1);
-  snprintf(search_exp,strlen(filter)+strlen(ldap_filter_esc)+1, filter, ldap_filter_esc);
-  
-  if (ldap_filter_esc)
-     free (ldap_filter_esc);
+ cleanup:
+  if (domain)
+    krb5_cleanup();
+  if (lcreds) {
+    if (lcreds->dn)
+      free(lcreds->dn);
+    if (lcreds->pw)
+      free(lcreds->pw);
+    free(lcreds);
+  }
+  if (bindp)
+    free(bindp);
+  return NULL;
+}
+
+void free_ldap_connection(struct main_args *margs,LDAP *ld,char* domain,char *bindp,struct ldap_creds *lcreds) {
+  int rc;
+
+  if (ld) {
+    rc = ldap_unbind(ld);
+    if (rc != LDAP_SUCCESS) {
+      fprintf(stderr, "%s| %s: Error unbind ldap server: %s\n",LogTime(), PROGRAM,ldap_err2string(rc));
+    }
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: Unbind ldap server\n",LogTime(), PROGRAM);
+  }
+  if (domain)
+    krb5_cleanup();
+  if (lcreds) {
+    if (lcreds->dn)
+      free(lcreds->dn);
+    if (lcreds->pw)
+      free(lcreds->pw);
+    free(lcreds);
+  }
+  if (bindp)
+    free(bindp);
+}
+
+/*
+ * Fetch the memberOf values of several users of one domain with
+ * (|(samaccountname=user1)(samaccountname=user2)...) searches and keep them
+ * for get_memberof. Only done for AD servers. The number of users per
+ * search is limited by the adaptive window of the server (see
+ * support_dc.c). Users beyond it are searched for on an idle pooled
+ * connection to another server if there is one. Returns the number of
+ * users fetched (the first ones of users), the others should wait for the
+ * next batch.
+ */
+int get_memberof_batch(struct main_args *margs,char* domain,char **users,int nusers) {
+  LDAP *ld=NULL,*hd;
+  char *bindp=NULL;
+  int i,n,w;
+
+  if (!domain || nusers < 1)
+    return 0;
+
+  ld = pool_get(margs,domain,&bindp);
+  if (!ld)
+    return 0;
+  if (!margs->AD || margs->gmethod != GM_TREE) {
+    pool_release(margs,ld,0);
+    return 0;
+  }
+
+  w=dc_window(pool_dc(ld));
+  if (w > nusers)
+    w=nusers;
+  n=get_memberof_chunk(margs,ld,bindp,domain,users,w);
+  i = n < 0 ? 0 : w;
+  /* the bind path is the same for all servers of the domain */
+  if (n >= 0 && i < nusers && (hd=pool_hedge(margs,ld))) {
+    w=dc_window(pool_dc(hd));
+    if (w > nusers-i)
+      w=nusers-i;
+    if (get_memberof_chunk(margs,hd,bindp,domain,users+i,w) >= 0)
+      i+=w;
+    pool_release(margs,hd,0);
+  }
+  pool_release(margs,ld,0);
+  return i;
+}
+
+/*
+ * One search for the memberOf values of nusers users. Returns -1 on error.
+ */
+static int get_memberof_chunk(struct main_args *margs,LDAP *ld,char *bindp,char* domain,char **users,int nusers) {
+  LDAPMessage *res=NULL,*msg;
+  char *search_exp,*sp;
+  char *ldap_filter_esc;
+  char *key;
+  char **attr_value;
+  char *attrs[3];
+  struct berval **values,**names;
+  struct timeval searchtime,start;
+  int *found;
+  int i,j,n,rc,len,nfound=0;
+
+  searchtime.tv_sec  = SEARCH_TIMEOUT;
+  searchtime.tv_usec = 0;
+
+  len=strlen("(|)")+1;
+  for (i=0;i<nusers;i++) {
+    ldap_filter_esc = escape_filter(users[i]);
+    len += strlen(FILTER_AD)+strlen(ldap_filter_esc);
+    free(ldap_filter_esc);
+  }
+  search_exp=malloc(len);
+  strcpy(search_exp,"(|");
+  sp=search_exp+2;
+  for (i=0;i<nusers;i++) {
+    ldap_filter_esc = escape_filter(users[i]);
+    snprintf(sp,len-(sp-search_exp),FILTER_AD,ldap_filter_esc);
+    sp+=strlen(sp);
+    free(ldap_filter_esc);
+  }
+  strcat(search_exp,")");
+
+  attrs[0]=(char *)ATTRIBUTE_SAM;
+  attrs[1]=(char *)ATTRIBUTE_AD;
+  attrs[2]=NULL;
 
   if (margs->debug)
     fprintf(stderr, "%s| %s: Search ldap server with bind path %s and filter : %s\n",LogTime(), PROGRAM,bindp,search_exp);
-  rc = ldap_search_ext_s(ld, bindp, LDAP_SCOPE_SUBTREE,
-		         search_exp, NULL, 0,
-                         NULL, NULL, &searchtime, 0, &res);
-   if (search_exp)
-    free(search_exp);
-
+  gettimeofday(&start,NULL);
+  rc = ldap_search_timed(margs, ld, bindp, LDAP_SCOPE_SUBTREE,
+                         search_exp, attrs, &searchtime, &res);
+  dc_window_sample(margs,pool_dc(ld),nusers,dc_since(&start),rc);
+  free(search_exp);
   if (rc != LDAP_SUCCESS) {
     fprintf(stderr, "%s| %s: Error searching ldap server: %s\n",LogTime(), PROGRAM,ldap_err2string(rc));
-    ldap_unbind(ld);
-    ld=NULL;
-    retval=0;
-    goto cleanup;
+    if (res)
+      ldap_msgfree(res);
+    return -1;
+  }
+  if (margs->debug)
+    fprintf(stderr, "%s| %s: Found %d ldap entr%s for %d users\n",LogTime(), PROGRAM, ldap_count_entries( ld, res),ldap_count_entries( ld, res)>1||ldap_count_entries( ld, res)==0?"ies":"y",nusers);
+
+  found=calloc(nusers,sizeof(int));
+  for (msg = ldap_first_entry (ld, res); msg; msg = ldap_next_entry (ld, msg)) {
+    names = ldap_get_values_len (ld, msg, ATTRIBUTE_SAM);
+    if (!names || !names[0]) {
+      if (names)
+        ber_bvecfree(names);
+      continue;
+    }
+    for (i=0;i<nusers;i++) {
+      if (!found[i] && strlen(users[i]) == names[0]->bv_len && !strncasecmp(users[i],names[0]->bv_val,names[0]->bv_len))
+        break;
+    }
+    ber_bvecfree(names);
+    if (i == nusers)
+      continue;
+    found[i]=1;
+    attr_value=NULL;
+    n=0;
+    if ( (values = ldap_get_values_len (ld, msg, ATTRIBUTE_AD)) != NULL ) {
+      for (n=0; values[n] != NULL; n++)
+        ;
+      attr_value=malloc((n+1)*sizeof(char *));
+      for (j=0;j<n;j++) {
+        attr_value[j] = malloc (values[j]->bv_len + 1);
+        memcpy(attr_value[j],values[j]->bv_val,values[j]->bv_len);
+        attr_value[j][values[j]->bv_len]=0;
+      }
+      ber_bvecfree(values);
+    }
+    key=cache_key(users[i],domain);
+    uentry_put(margs,key,attr_value,n);
+    free(key);
+    for (j=0;j<n;j++)
+      free(attr_value[j]);
+    if (attr_value)
+      free(attr_value);
+    nfound++;
+  }
+  /*
+   * Users not found have no group memberships
+   */
+  for (i=0;i<nusers;i++) {
+    if (!found[i]) {
+      key=cache_key(users[i],domain);
+      uentry_put(margs,key,NULL,0);
+      free(key);
+    }
+  }
+  free(found);
+  ldap_msgfree(res);
+  if (margs->debug)
+    fprintf(stderr, "%s| %s: Fetched group memberships of %d of %d users with one search\n",LogTime(), PROGRAM,nfound,nusers);
+  return nusers;
+}
+
+/*
+ * Binary value (SID) as hex string (caller frees)
+ */
+static char *sid_hex(struct berval *bv) {
+  char *hex;
+  ber_len_t i;
+
+  hex=malloc(2*bv->bv_len+1);
+  for (i=0;i<bv->bv_len;i++)
+    snprintf(hex+2*i,3,"%02x",(unsigned char)bv->bv_val[i]);
+  hex[2*bv->bv_len]='\0';
+  return hex;
+}
+
+/*
+ * DNs (or with sids set objectSid values in hex) of the groups named group
+ * (cn) below bindp, kept for an hour (see gref_get). Returns the number of
+ * values (caller frees) or -1 on error.
+ */
+static int get_group_refs(struct main_args *margs,LDAP *ld,char *bindp,char *domain,char *group,int sids,char ***refs) {
+  LDAPMessage *res=NULL,*msg;
+  struct timeval searchtime;
+  struct berval **values;
+  char *search_exp,*ldap_filter_esc;
+  char *attrs[2];
+  char *key,*gkey,*dn;
+  int n,rc,len;
+
+  gkey=cache_key(group,domain);
+  key=malloc(strlen(gkey)+5);
+  snprintf(key,strlen(gkey)+5,"%s%s",sids?"sid:":"",gkey);
+  free(gkey);
+  n=gref_get(margs,key,refs);
+  if (n >= 0) {
+    free(key);
+    return n;
   }
 
+  searchtime.tv_sec  = SEARCH_TIMEOUT;
+  searchtime.tv_usec = 0;
+  ldap_filter_esc = escape_filter(group);
+  len=strlen(FILTER_GROUP_CN)+strlen(ldap_filter_esc)+1;
+  search_exp=malloc(len);
+  snprintf(search_exp,len,FILTER_GROUP_CN,ldap_filter_esc);
+  free(ldap_filter_esc);
+  attrs[0]=(char *)(sids?ATTRIBUTE_SID:ATTRIBUTE_NONE);
+  attrs[1]=NULL;
+
   if (margs->debug)
-    fprintf(stderr, "%s| %s: Found %d ldap entr%s\n",LogTime(), PROGRAM, ldap_count_entries( ld, res),ldap_count_entries( ld, res)>1||ldap_count_entries( ld, res)==0?"ies":"y");
+    fprintf(stderr, "%s| %s: Search ldap server with bind path %s and filter : %s\n",LogTime(), PROGRAM,bindp,search_exp);
+  rc = ldap_search_timed(margs, ld, bindp, LDAP_SCOPE_SUBTREE,
+                         search_exp, attrs, &searchtime, &res);
+  free(search_exp);
+  if (rc != LDAP_SUCCESS) {
+    fprintf(stderr, "%s| %s: Error searching ldap server: %s\n",LogTime(), PROGRAM,ldap_err2string(rc));
+    if (res)
+      ldap_msgfree(res);
+    free(key);
+    return -1;
+  }
 
-  if (ldap_count_entries( ld, res)!=0 ) {
+  *refs=NULL;
+  n=0;
+  len=ldap_count_entries(ld,res);
+  if (len > 0)
+    *refs=(char **)malloc(len*sizeof(char *));
+  for (msg = ldap_first_entry (ld, res); msg && n < len; msg = ldap_next_entry (ld, msg)) {
+    if (sids) {
+      if ((values=ldap_get_values_len(ld,msg,ATTRIBUTE_SID))) {
+        if (values[0])
+          (*refs)[n++]=sid_hex(values[0]);
+        ber_bvecfree(values);
+      }
+    } else if ((dn=ldap_get_dn(ld,msg))) {
+      (*refs)[n++]=strdup(dn);
+      ldap_memfree(dn);
+    }
+  }
+  ldap_msgfree(res);
+  if (n == 0)
+    fprintf(stderr, "%s| %s: Group %s not found in domain %s\n",LogTime(), PROGRAM,group,domain?domain:"NULL");
+  gref_put(margs,key,*refs,n);
+  free(key);
+  return n;
+}
 
-    if (margs->AD)
-      max_attr = get_attributes(margs,ld,res,ATTRIBUTE_AD,&attr_value);
-    else {
-      max_attr = get_attributes(margs,ld,res,ATTRIBUTE,&attr_value);
+/*
+ * Look up the configured groups of domain (group@domain and group@) at
+ * startup (-w), so that -G chain or token does not do it on the first
+ * request
+ */
+void group_warmup(struct main_args *margs,LDAP *ld,char *bindp,char *domain) {
+  struct gdstruct *gp;
+  char **refs=NULL;
+  int i,n;
+
+  if (!margs->AD || margs->gmethod == GM_TREE)
+    return;
+  for (gp=margs->groups; gp; gp=gp->next) {
+    if (!gp->domain || (*gp->domain && strcasecmp(gp->domain,domain)))
+      continue;
+    n=get_group_refs(margs,ld,bindp,domain,gp->group,margs->gmethod == GM_TOKEN,&refs);
+    for (i=0;i<n;i++)
+      free(refs[i]);
+    if (refs)
+      free(refs);
+    refs=NULL;
+  }
+}
+
+/*
+ * DNs (or objectSid values) of all groups of the list. Returns the number
+ * of values (caller frees) or -1 on error.
+ */
+static int get_group_list(struct main_args *margs,LDAP *ld,char *bindp,char *domain,char **groups,int ngroups,int sids,char ***refs) {
+  char **gr=NULL;
+  int i,j,n,ng;
+
+  *refs=NULL;
+  n=0;
+  for (i=0;i<ngroups;i++) {
+    ng=get_group_refs(margs,ld,bindp,domain,groups[i],sids,&gr);
+    if (ng < 0) {
+      for (j=0;j<n;j++)
+        free((*refs)[j]);
+      if (*refs)
+        free(*refs);
+      *refs=NULL;
+      return -1;
     }
+    if (ng > 0) {
+      *refs=(char **)realloc(*refs,(n+ng)*sizeof(char *));
+      for (j=0;j<ng;j++)
+        (*refs)[n++]=gr[j];
+    }
+    if (gr)
+      free(gr);
+    gr=NULL;
+  }
+  return n;
+}
 
-    /*
-     * Compare group names
-     */
-    retval=0;
-    for (j=0;j<max_attr;j++) {
+/*
+ * Read the tokenGroups of the user, the SIDs of all groups it is a
+ * (nested) member of including the primary group, with a base search on
+ * its entry and compare them with the objectSid of the groups. Two
+ * searches per user, no walk of the group tree (-m does not apply).
+ * Returns -1 on error.
+ */
+static int get_memberof_token(struct main_args *margs,LDAP *ld,char *bindp,char *user,char *domain,char **groups,int ngroups) {
+  LDAPMessage *res=NULL,*msg;
+  struct timeval searchtime;
+  struct berval **values;
+  char *search_exp,*ldap_filter_esc;
+  char **sids=NULL;
+  char *attrs[2];
+  char *dn=NULL,*hex;
+  int i,j,n,rc,len,retval=0;
+
+  n=get_group_list(margs,ld,bindp,domain,groups,ngroups,1,&sids);
+  if (n <= 0)
+    return n;
 
-      /* Compare first CN= value assuming it is the same as the group name itself */
-      av=attr_value[j];
-      if (!strncasecmp("CN=",av,3)) {
-        av+=3;
-        if ((avp=strchr(av,','))) {
-          *avp='\0';
+  searchtime.tv_sec  = SEARCH_TIMEOUT;
+  searchtime.tv_usec = 0;
+  ldap_filter_esc = escape_filter(user);
+  len=strlen(FILTER_AD)+strlen(ldap_filter_esc)+1;
+  search_exp=malloc(len);
+  snprintf(search_exp,len,FILTER_AD,ldap_filter_esc);
+  free(ldap_filter_esc);
+  attrs[0]=(char *)ATTRIBUTE_NONE;
+  attrs[1]=NULL;
+  if (margs->debug)
+    fprintf(stderr, "%s| %s: Search ldap server with bind path %s and filter : %s\n",LogTime(), PROGRAM,bindp,search_exp);
+  rc = ldap_search_timed(margs, ld, bindp, LDAP_SCOPE_SUBTREE,
+                         search_exp, attrs, &searchtime, &res);
+  free(search_exp);
+  if (rc != LDAP_SUCCESS) {
+    fprintf(stderr, "%s| %s: Error searching ldap server: %s\n",LogTime(), PROGRAM,ldap_err2string(rc));
+    retval=-1;
+    goto cleanup;
+  }
+  if ((msg=ldap_first_entry(ld,res)))
+    dn=ldap_get_dn(ld,msg);
+  ldap_msgfree(res);
+  res=NULL;
+  if (!dn) {
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: User %s not found\n",LogTime(), PROGRAM,user);
+    goto cleanup;
+  }
+
+  attrs[0]=(char *)ATTRIBUTE_TOKEN;
+  if (margs->debug)
+    fprintf(stderr, "%s| %s: Read %s of %s\n",LogTime(), PROGRAM,ATTRIBUTE_TOKEN,dn);
+  rc = ldap_search_timed(margs, ld, dn, LDAP_SCOPE_BASE,
+                         (char *)FILTER_ANY, attrs, &searchtime, &res);
+  if (rc != LDAP_SUCCESS) {
+    fprintf(stderr, "%s| %s: Error searching ldap server: %s\n",LogTime(), PROGRAM,ldap_err2string(rc));
+    retval=-1;
+    goto cleanup;
+  }
+  if ((msg=ldap_first_entry(ld,res)) && (values=ldap_get_values_len(ld,msg,ATTRIBUTE_TOKEN))) {
+    for (i=0; values[i] && !retval; i++) {
+      hex=sid_hex(values[i]);
+      for (j=0;j<n;j++) {
+        if (!strcmp(hex,sids[j])) {
+          retval=1;
+          break;
         }
       }
-      if (margs->debug) { 
-        int n;
-        fprintf(stderr, "%s| %s: Entry %d \"%s\" in hex UTF-8 is ",LogTime(), PROGRAM, j+1, av);
-        for (n=0; av[n] != '\0'; n++)
-           fprintf(stderr, "%02x",(unsigned char)av[n]);
-        fprintf(stderr, "\n");
-      }
-      if (!strcasecmp(group,av)) {
-        retval=1;
-        if (margs->debug)
-	  fprintf(stderr, "%s| %s: Entry %d \"%s\" matches group name \"%s\"\n",LogTime(), PROGRAM, j+1, av, group);
-        else
-          break;
-      } else {
+      free(hex);
+    }
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: User %s is %s(nested) member of %s%s (%d token groups)\n",LogTime(), PROGRAM,user,retval?"":"not ",ngroups>1?"one of the groups ":"group ",ngroups>1?"":groups[0],i);
+    ber_bvecfree(values);
+  }
+
+ cleanup:
+  if (res)
+    ldap_msgfree(res);
+  if (dn)
+    ldap_memfree(dn);
+  for (j=0;j<n;j++)
+    free(sids[j]);
+  if (sids)
+    free(sids);
+  return retval;
+}
+
+/*
+ * Ask the AD server if user is a (nested) member of one of the groups with
+ * the LDAP_MATCHING_RULE_IN_CHAIN rule, one search instead of a walk of
+ * the group tree (-m does not apply). No groups are remembered for change
+ * notifications, so any change drops the answer. Returns -1 on error.
+ */
+static int get_memberof_chain(struct main_args *margs,LDAP *ld,char *bindp,char *user,char *domain,char **groups,int ngroups) {
+  LDAPMessage *res=NULL;
+  struct timeval searchtime;
+  char *search_exp,*sp,*ldap_filter_esc;
+  char **dns=NULL;
+  char *attrs[2];
+  int i,n,rc,len,retval=0;
+
+  n=get_group_list(margs,ld,bindp,domain,groups,ngroups,0,&dns);
+  if (n <= 0)
+    return n;
+
+  ldap_filter_esc = escape_filter(user);
+  len=strlen("(&(|))")+strlen(FILTER_AD)+strlen(ldap_filter_esc)+1;
+  free(ldap_filter_esc);
+  for (i=0;i<n;i++) {
+    ldap_filter_esc = escape_filter(dns[i]);
+    len += strlen(FILTER_CHAIN)+strlen(ldap_filter_esc);
+    free(ldap_filter_esc);
+  }
+  search_exp=malloc(len);
+  strcpy(search_exp,"(&");
+  sp=search_exp+2;
+  ldap_filter_esc = escape_filter(user);
+  snprintf(sp,len-(sp-search_exp),FILTER_AD,ldap_filter_esc);
+  free(ldap_filter_esc);
+  if (n > 1)
+    strcat(search_exp,"(|");
+  for (i=0;i<n;i++) {
+    sp=search_exp+strlen(search_exp);
+    ldap_filter_esc = escape_filter(dns[i]);
+    snprintf(sp,len-(sp-search_exp),FILTER_CHAIN,ldap_filter_esc);
+    free(ldap_filter_esc);
+    free(dns[i]);
+  }
+  free(dns);
+  if (n > 1)
+    strcat(search_exp,")");
+  strcat(search_exp,")");
+
+  searchtime.tv_sec  = SEARCH_TIMEOUT;
+  searchtime.tv_usec = 0;
+  attrs[0]=(char *)ATTRIBUTE_NONE;
+  attrs[1]=NULL;
+  if (margs->debug)
+    fprintf(stderr, "%s| %s: Search ldap server with bind path %s and filter : %s\n",LogTime(), PROGRAM,bindp,search_exp);
+  rc = ldap_search_timed(margs, ld, bindp, LDAP_SCOPE_SUBTREE,
+                         search_exp, attrs, &searchtime, &res);
+  free(search_exp);
+  if (rc != LDAP_SUCCESS) {
+    fprintf(stderr, "%s| %s: Error searching ldap server: %s\n",LogTime(), PROGRAM,ldap_err2string(rc));
+    if (res)
+      ldap_msgfree(res);
+    return -1;
+  }
+  retval = ldap_count_entries(ld,res) > 0;
+  ldap_msgfree(res);
+  if (margs->debug)
+    fprintf(stderr, "%s| %s: User %s is %s(nested) member of %s%s\n",LogTime(), PROGRAM,user,retval?"":"not ",ngroups>1?"one of the groups ":"group ",ngroups>1?"":groups[0]);
+  return retval;
+}
+
+/*
+ * Check with the users memberOf values, fetched once, if the user is a
+ * (nested) member of one of the groups (-G tree). The group tree is
+ * expanded level by level and each group is read only once, whatever the
+ * number of groups. Returns -1 on error.
+ */
+static int get_memberof_tree(struct main_args *margs,LDAP *ld,char *bindp,char *user,char *domain,char **groups,int ngroups) {
+  LDAPMessage *res=NULL;
+  struct timeval searchtime;
+  char **dns=NULL,**parents=NULL;
+  int *depths=NULL;
+  char *search_exp,*ldap_filter_esc,*key,*av;
+  char *attrs[2];
+  int ndns,sdns,nparents,len,rc,i,j,k;
+  int retval=0;
+
+  searchtime.tv_sec  = SEARCH_TIMEOUT;
+  searchtime.tv_usec = 0;
+
+  /*
+   * Use the users group memberships if they were fetched already
+   */
+  key=cache_key(user,domain);
+  ndns = uentry_get(margs,key,&dns);
+  free(key);
+
+  if (ndns < 0) {
+    attrs[0]=(char *)ATTRIBUTE_AD;
+    attrs[1]=NULL;
+    ldap_filter_esc = escape_filter(user);
+    search_exp=malloc(strlen(FILTER_AD)+strlen(ldap_filter_esc)+1);
+    snprintf(search_exp,strlen(FILTER_AD)+strlen(ldap_filter_esc)+1, FILTER_AD, ldap_filter_esc);
+    free(ldap_filter_esc);
+
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: Search ldap server with bind path %s and filter : %s\n",LogTime(), PROGRAM,bindp,search_exp);
+    rc = ldap_search_timed(margs, ld, bindp, LDAP_SCOPE_SUBTREE,
+                           search_exp, attrs, &searchtime, &res);
+    free(search_exp);
+    if (rc != LDAP_SUCCESS) {
+      fprintf(stderr, "%s| %s: Error searching ldap server: %s\n",LogTime(), PROGRAM,ldap_err2string(rc));
+      if (res)
+        ldap_msgfree(res);
+      return(-1);
+    }
+    if (ldap_count_entries(ld,res) == 0) {
+      if (margs->debug)
+        fprintf(stderr, "%s| %s: User %s not found\n",LogTime(), PROGRAM,user);
+      ldap_msgfree(res);
+      return(0);
+    }
+    ndns = get_attributes(margs,ld,res,ATTRIBUTE_AD,&dns);
+    ldap_msgfree(res);
+  }
+
+  sdns=ndns;
+  depths=(int *)calloc(sdns+1,sizeof(int));
+  for (i=0;i<ndns;i++)
+    dep_add(margs,dns[i]);
+
+  /*
+   * Breadth first over the groups found so far. Compare the first CN=
+   * value of each group against all groups before reading its parents.
+   */
+  for (i=0;i<ndns && !retval;i++) {
+    av=dns[i];
+    if (!strncasecmp("CN=",av,3))
+      av+=3;
+    len=strcspn(av,",");
+    for (k=0;k<ngroups;k++) {
+      if ((int)strlen(groups[k]) == len && !strncasecmp(groups[k],av,len)) {
         if (margs->debug)
-  	  fprintf(stderr, "%s| %s: Entry %d \"%s\" does not match group name \"%s\"\n",LogTime(), PROGRAM, j+1, av, group);
+          fprintf(stderr, "%s| %s: Group \"%s\" at depth %d matches group name \"%s\"\n",LogTime(), PROGRAM,dns[i],depths[i],groups[k]);
+        retval=1;
+        break;
       }
     }
-    /* 
-     * Do recursive group search for AD only since posixgroups can not contain other groups
-     */
-    if (!retval && margs->AD) {
-      if (margs->debug && max_attr > 0)
-        fprintf(stderr, "%s| %s: Perform recursive group search\n",LogTime(), PROGRAM);
-      for (j=0;j<max_attr;j++) {
+    if (retval || depths[i]+1 > margs->mdepth)
+      continue;
 
-        av=attr_value[j];
-        if (search_group_tree(margs,ld,bindp,av,group,1)) {
-          retval=1;
-          if (!strncasecmp("CN=",av,3)) {
-            av+=3;
-            if ((avp=strchr(av,','))) {
-              *avp='\0';
-            }
-          }
-          if (margs->debug)
-            fprintf(stderr, "%s| %s: Entry %d group \"%s\" is (in)direct member of group \"%s\"\n",LogTime(), PROGRAM, j+1, av, group);
-          else
-            break;
-        }
+    nparents = get_group_parents(margs,ld,bindp,dns[i],&parents);
+    if (nparents < 0) {
+      retval=-1;
+      break;
+    }
+    for (j=0;j<nparents;j++) {
+      for (k=0;k<ndns && strcasecmp(dns[k],parents[j]);k++);
+      if (k < ndns) {
+        free(parents[j]);
+        continue;
+      }
+      if (ndns == sdns) {
+        sdns=2*sdns+8;
+        dns=(char **)realloc(dns,sdns*sizeof(char *));
+        depths=(int *)realloc(depths,sdns*sizeof(int));
       }
+      dns[ndns]=parents[j];
+      depths[ndns++]=depths[i]+1;
     }
+    if (parents)
+      free(parents);
+    parents=NULL;
+  }
+
+  if (margs->debug && retval >= 0)
+    fprintf(stderr, "%s| %s: User %s is %s(nested) member of %s%s (%d group%s found)\n",LogTime(), PROGRAM,user,retval?"":"not ",ngroups>1?"one of the groups":"group ",ngroups>1?"":groups[0],ndns,ndns==1?"":"s");
+
+  for (i=0;i<ndns;i++)
+    free(dns[i]);
+  if (dns)
+    free(dns);
+  free(depths);
+  return(retval);
+}
+
+/*
+ * Check with one user search and one group tree walk (-G tree), one
+ * search (-G chain) or one token read (-G token) if user is a member of
+ * one of the groups. Returns -1 if the server is not an AD server, then
+ * each group must be checked with get_memberof, and MEMBER_ERROR if the
+ * server could not be asked.
+ */
+int get_memberof_any(struct main_args *margs,char *user,char *domain,char **groups,int ngroups) {
+  int retval,stale=0;
+
+  if (ngroups < 1)
+    return(-1);
+  retval = get_memberof_any_try(margs,user,domain,groups,ngroups,&stale);
+  if (stale) {
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: Lost pooled ldap connection. Retry with new connection\n",LogTime(), PROGRAM);
+    retval = get_memberof_any_try(margs,user,domain,groups,ngroups,&stale);
+  }
+  return(retval);
+}
 
+static int get_memberof_any_try(struct main_args *margs,char *user,char *domain,char **groups,int ngroups,int *stale) {
+  LDAP *ld;
+  char *bindp=NULL;
+  char *key;
+  int retval;
+
+  if (margs->affinity && domain) {
+    key=cache_key(user,domain);
+    dc_affinity(key);
+    free(key);
+  }
+  ld = pool_get(margs,domain,&bindp);
+  dc_affinity(NULL);
+  if ( ld == NULL )
+    return(MEMBER_ERROR);
+  if (!margs->AD) {
+    *stale = pool_release(margs,ld,0);
+    return(-1);
+  }
+  if (margs->gmethod == GM_TREE)
+    retval = get_memberof_tree(margs,ld,bindp,user,domain,groups,ngroups);
+  else if (margs->gmethod == GM_CHAIN)
+    retval = get_memberof_chain(margs,ld,bindp,user,domain,groups,ngroups);
+  else
+    retval = get_memberof_token(margs,ld,bindp,user,domain,groups,ngroups);
+  *stale = pool_release(margs,ld,retval < 0);
+  return(retval < 0 ? MEMBER_ERROR : retval);
+}
+
+/*
+ * ldap calls to get attribute from Ldap Directory Server. Returns
+ * MEMBER_ERROR if the server could not be asked.
+ */
+int get_memberof(struct main_args *margs,char* user,char* domain,char *group) {
+  int retval,stale=0;
+
+  retval = get_memberof_try(margs,user,domain,group,&stale);
+  if (stale) {
     /*
-     * Cleanup
+     * A pooled connection was found dead. Try once with a new one.
      */
-    if (attr_value){
-      for (j=0;j<max_attr;j++) {
-        free(attr_value[j]);
-      }
-      free(attr_value);
-      attr_value=NULL;
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: Lost pooled ldap connection. Retry with new connection\n",LogTime(), PROGRAM);
+    retval = get_memberof_try(margs,user,domain,group,&stale);
+  }
+  return(retval);
+}
+
+static int get_memberof_try(struct main_args *margs,char* user,char* domain,char *group,int *stale) {
+  LDAP *ld=NULL;
+  LDAPMessage *res;
+  char *bindp=NULL;
+  char *filter=NULL;
+  char *search_exp;
+  char *key;
+  struct timeval searchtime;
+  int j,rc=0;
+  int retval=0;
+  char **attr_value=NULL;
+  char *av=NULL;
+  char *attrs[2];
+  int max_attr=0;
+  char* ldap_filter_esc=NULL;
+
+
+  searchtime.tv_sec  = SEARCH_TIMEOUT;
+  searchtime.tv_usec = 0;
+
+  if (margs->affinity && domain) {
+    key=cache_key(user,domain);
+    dc_affinity(key);
+    free(key);
+  }
+  ld = pool_get(margs,domain,&bindp);
+  dc_affinity(NULL);
+  if ( ld == NULL )
+    return(MEMBER_ERROR);
+
+  /*
+   * Let the AD server follow the nested groups
+   */
+  if (margs->AD && margs->gmethod != GM_TREE) {
+    if (margs->gmethod == GM_CHAIN)
+      retval = get_memberof_chain(margs,ld,bindp,user,domain,&group,1);
+    else
+      retval = get_memberof_token(margs,ld,bindp,user,domain,&group,1);
+    if (retval < 0) {
+      *stale = pool_release(margs,ld,1);
+      ld=NULL;
+      retval=MEMBER_ERROR;
     }
-    ldap_msgfree(res);
-  } else if (ldap_count_entries( ld, res)==0 && margs->AD) {
-    ldap_msgfree(res);
-    ldap_unbind(ld);
-    ld=NULL;
-    retval=0;
     goto cleanup;
-  } else {
-    ldap_msgfree(res);
-    retval=0;
+  }
+
+  /*
+   * Use the users group memberships if they were fetched already
+   */
+  max_attr = -1;
+  if (margs->AD) {
+    key=cache_key(user,domain);
+    max_attr = uentry_get(margs,key,&attr_value);
+    free(key);
+  }
+
+  if (max_attr < 0) {
+    if (margs->AD)
+      filter=(char *)FILTER_AD;
+    else
+      filter=(char *)FILTER;
+    attrs[0]=(char *)(margs->AD?ATTRIBUTE_AD:ATTRIBUTE);
+    attrs[1]=NULL;
+
+    ldap_filter_esc = escape_filter(user);
+
+    search_exp=malloc(strlen(filter)+strlen(ldap_filter_esc)+1);
+    snprintf(search_exp,strlen(filter)+strlen(ldap_filter_esc)+1, filter, ldap_filter_esc);
+  
+    if (ldap_filter_esc)
+       free (ldap_filter_esc);
+
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: Search ldap server with bind path %s and filter : %s\n",LogTime(), PROGRAM,bindp,search_exp);
+    rc = ldap_search_timed(margs, ld, bindp, LDAP_SCOPE_SUBTREE,
+		           search_exp, attrs, &searchtime, &res);
+     if (search_exp)
+      free(search_exp);
+
+    if (rc != LDAP_SUCCESS) {
+      fprintf(stderr, "%s| %s: Error searching ldap server: %s\n",LogTime(), PROGRAM,ldap_err2string(rc));
+      *stale = pool_release(margs,ld,1);
+      ld=NULL;
+      retval=MEMBER_ERROR;
+      goto cleanup;
+    }
+
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: Found %d ldap entr%s\n",LogTime(), PROGRAM, ldap_count_entries( ld, res),ldap_count_entries( ld, res)>1||ldap_count_entries( ld, res)==0?"ies":"y");
+
+    if (ldap_count_entries( ld, res)!=0 ) {
+
+      if (margs->AD)
+        max_attr = get_attributes(margs,ld,res,ATTRIBUTE_AD,&attr_value);
+      else {
+        max_attr = get_attributes(margs,ld,res,ATTRIBUTE,&attr_value);
+      }
+      ldap_msgfree(res);
+    } else if (ldap_count_entries( ld, res)==0 && margs->AD) {
+      ldap_msgfree(res);
+      retval=0;
+      goto cleanup;
+    } else {
+      ldap_msgfree(res);
+      max_attr=0;
+    }
+  }
+
+  /*
+   * Remember the groups the answer depends on before the names are cut
+   */
+  if (margs->AD) {
+    for (j=0;j<max_attr;j++)
+      dep_add(margs,attr_value[j]);
+  }
+
+  /*
+   * Compare group names
+   */
+  retval=0;
+  for (j=0;j<max_attr;j++) {
+
+    /* Compare first CN= value assuming it is the same as the group name itself */
+    av=group_cn(attr_value[j]);
+    if (margs->debug) { 
+      int n;
+      fprintf(stderr, "%s| %s: Entry %d \"%s\" in hex UTF-8 is ",LogTime(), PROGRAM, j+1, av);
+      for (n=0; av[n] != '\0'; n++)
+         fprintf(stderr, "%02x",(unsigned char)av[n]);
+      fprintf(stderr, "\n");
+    }
+    if (!strcasecmp(group,av)) {
+      retval=1;
+      if (margs->debug)
+	  fprintf(stderr, "%s| %s: Entry %d \"%s\" matches group name \"%s\"\n",LogTime(), PROGRAM, j+1, av, group);
+      else {
+        free(av);
+        break;
+      }
+    } else {
+      if (margs->debug)
+	  fprintf(stderr, "%s| %s: Entry %d \"%s\" does not match group name \"%s\"\n",LogTime(), PROGRAM, j+1, av, group);
+    }
+    free(av);
+  }
+  /* 
+   * Do recursive group search for AD only since posixgroups can not contain other groups
+   */
+  if (!retval && margs->AD) {
+    if (margs->debug && max_attr > 0)
+      fprintf(stderr, "%s| %s: Perform recursive group search\n",LogTime(), PROGRAM);
+    for (j=0;j<max_attr;j++) {
+
+      if (search_group_tree(margs,ld,bindp,attr_value[j],group,1)) {
+        retval=1;
+        if (margs->debug) {
+          av=group_cn(attr_value[j]);
+          fprintf(stderr, "%s| %s: Entry %d group \"%s\" is (in)direct member of group \"%s\"\n",LogTime(), PROGRAM, j+1, av, group);
+          free(av);
+        } else
+          break;
+      }
+    }
+  }
+
+  /*
+   * Cleanup
+   */
+  if (attr_value){
+    for (j=0;j<max_attr;j++) {
+      free(attr_value[j]);
+    }
+    free(attr_value);
+    attr_value=NULL;
   }
 
   if (!margs->AD && retval == 0) {
@@ -1143,6 +2299,8 @@ int get_memberof(struct main_args *margs,char* user,char* domain,char *group) {
     if (margs->debug)
       fprintf(stderr, "%s| %s: Search for primary group membership: \"%s\"\n",LogTime(), PROGRAM,group);
     filter=(char *)FILTER_UID;
+    attrs[0]=(char *)ATTRIBUTE_GID;
+    attrs[1]=NULL;
 
     ldap_filter_esc = escape_filter(user);
 
@@ -1154,14 +2312,14 @@ int get_memberof(struct main_args *margs,char* user,char* domain,char *group) {
 
     if (margs->debug)
       fprintf(stderr, "%s| %s: Search ldap server with bind path %s and filter: %s\n",LogTime(), PROGRAM,bindp,search_exp);
-    rc = ldap_search_ext_s(ld, bindp, LDAP_SCOPE_SUBTREE,
-	   	           search_exp, NULL, 0,
-                           NULL, NULL, &searchtime, 0, &res);
+    rc = ldap_search_timed(margs, ld, bindp, LDAP_SCOPE_SUBTREE,
+	   	           search_exp, attrs, &searchtime, &res);
     if (search_exp)
       free(search_exp);
 
     if ( rc != LDAP_SUCCESS ) {
       fprintf(stderr, "%s| %s: Search returned with error %s\n",LogTime(), PROGRAM, ldap_err2string(rc));
+      retval=MEMBER_ERROR;
       goto cleanup;
     }
  
@@ -1176,6 +2334,7 @@ int get_memberof(struct main_args *margs,char* user,char* domain,char *group) {
 
       ldap_msgfree(res);
       filter=(char *)FILTER_GID;
+      attrs[0]=(char *)ATTRIBUTE;
 
       ldap_filter_esc = escape_filter(attr_value[0]);
 
@@ -1187,14 +2346,14 @@ int get_memberof(struct main_args *margs,char* user,char* domain,char *group) {
 
       if (margs->debug)
 	fprintf(stderr, "%s| %s: Search ldap server with bind path %s and filter: %s\n",LogTime(), PROGRAM,bindp,search_exp);
-      rc = ldap_search_ext_s(ld, bindp, LDAP_SCOPE_SUBTREE,
-  			     search_exp, NULL, 0,
-                             NULL, NULL, &searchtime, 0, &res);
+      rc = ldap_search_timed(margs, ld, bindp, LDAP_SCOPE_SUBTREE,
+  			     search_exp, attrs, &searchtime, &res);
       if (search_exp)
 	free(search_exp);
 
       if ( rc != LDAP_SUCCESS ) {
         fprintf(stderr, "%s| %s: Search returned with error %s\n",LogTime(), PROGRAM, ldap_err2string(rc));
+        retval=MEMBER_ERROR;
         goto cleanup;
       }
  
@@ -1249,26 +2408,9 @@ int get_memberof(struct main_args *margs,char* user,char* domain,char *group) {
     }
   }
 
-  rc = ldap_unbind(ld);
-  ld=NULL;
-  if (rc != LDAP_SUCCESS) {
-    fprintf(stderr, "%s| %s: Error unbind ldap server: %s\n",LogTime(), PROGRAM,ldap_err2string(rc));
-  }
-  if (margs->debug)
-    fprintf(stderr, "%s| %s: Unbind ldap server\n",LogTime(), PROGRAM);
  cleanup:
-  if (domain)
-    krb5_cleanup();
-  if (lcreds) {
-    if (lcreds->dn)
-      free(lcreds->dn);
-    if (lcreds->pw)
-      free(lcreds->pw);
-    free(lcreds);
-  }
-  if (bindp)
-    free(bindp);
-  bindp=NULL;
+  if (ld)
+    *stale = pool_release(margs,ld,0);
   return(retval) ;
 
 }
@@ -39,8 +39,32 @@ int check_memberof(struct main_args *margs,char *user,char *domain) {
    *
    */
   struct gdstruct* gr;
-  int found=0;
+  char **groups;
+  int found=0,failed=0,ngroups=0,rc;
 
+  /*
+   * Test all groups for the users domain at once (AD only)
+   */
+  for (gr=margs->groups; gr; gr=gr->next)
+    ngroups++;
+  groups=(char **)malloc((ngroups+1)*sizeof(char *));
+  ngroups=0;
+  for (gr=margs->groups; gr; gr=gr->next) {
+    if (!gr->domain || (domain && (!strcasecmp(gr->domain,domain) || !strcasecmp(gr->domain,""))))
+      groups[ngroups++]=gr->group;
+  }
+  found=get_memberof_any(margs,user,domain,groups,ngroups);
+  free(groups);
+  if (found == MEMBER_ERROR) {
+    fprintf(stderr,"%s| %s: Could not check membership of user %s\n",LogTime(), PROGRAM,user);
+    return(MEMBER_ERROR);
+  }
+  if (found >= 0) {
+    if (margs->debug || margs->log)
+      fprintf(stderr,"%s| %s: User %s is %smember of one of %d groups\n",LogTime(), PROGRAM,user,found?"":"not ",ngroups);
+    return(found);
+  }
+  found=0;
 
   /* Check users domain */
 
@@ -52,7 +76,10 @@ int check_memberof(struct main_args *margs,char *user,char *domain) {
       if (margs->debug)
 	fprintf(stderr,"%s| %s: Found group@domain %s@%s\n",LogTime(), PROGRAM,gr->group,gr->domain);
       /* query ldap */
-      if (get_memberof(margs,user,domain,gr->group)) {
+      rc=get_memberof(margs,user,domain,gr->group);
+      if (rc == MEMBER_ERROR) {
+	failed++;
+      } else if (rc) {
         if (margs->debug || margs->log)
 	  fprintf(stderr,"%s| %s: User %s is member of group@domain %s@%s\n",LogTime(), PROGRAM,user,gr->group,gr->domain);
 	found++;
@@ -78,7 +105,10 @@ int check_memberof(struct main_args *margs,char *user,char *domain) {
       if (margs->debug)
 	fprintf(stderr,"%s| %s: Found group@domain %s@%s\n",LogTime(), PROGRAM,gr->group,gr->domain);
       /* query ldap */
-      if (get_memberof(margs,user,domain,gr->group)) {
+      rc=get_memberof(margs,user,domain,gr->group);
+      if (rc == MEMBER_ERROR) {
+	failed++;
+      } else if (rc) {
         if (margs->debug || margs->log)
 	  fprintf(stderr,"%s| %s: User %s is member of group@domain %s@%s\n",LogTime(), PROGRAM,user,gr->group,gr->domain);
 	found++;
@@ -104,7 +134,10 @@ int check_memberof(struct main_args *margs,char *user,char *domain) {
       if (margs->debug)
 	fprintf(stderr,"%s| %s: Found group@domain %s@%s\n",LogTime(), PROGRAM,gr->group,gr->domain?gr->domain:"NULL");
       /* query ldap */
-      if (get_memberof(margs,user,domain,gr->group)) {
+      rc=get_memberof(margs,user,domain,gr->group);
+      if (rc == MEMBER_ERROR) {
+	failed++;
+      } else if (rc) {
         if (margs->debug || margs->log)
 	  fprintf(stderr,"%s| %s: User %s is member of group@domain %s@%s\n",LogTime(), PROGRAM,user,gr->group,gr->domain?gr->domain:"NULL");
 	found++;
@@ -120,6 +153,12 @@ int check_memberof(struct main_args *margs,char *user,char *domain) {
   if (found)
     return(1);
 
+  /* Not a member of the groups which could be checked */
+  if (failed) {
+    fprintf(stderr,"%s| %s: Could not check membership of user %s\n",LogTime(), PROGRAM,user);
+    return(MEMBER_ERROR);
+  }
+
   return(0);
 }
 
@@ -0,0 +1,352 @@
+/*
+ * -----------------------------------------------------------------------------
+ *
+ * Author: Markus Moeller (markus_moeller at compuserve.com)
+ *
+ * Copyright (C) 2007 Markus Moeller. All rights reserved.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * -----------------------------------------------------------------------------
+ */
+
+
+#include <sys/select.h>
+#include <strings.h>
+
+#include "support.h"
+
+/*
+ * Invalidate cached answers and group edges when groups change (-W).
+ *
+ * For every watched subtree (-W base@DOMAIN[:base@DOMAIN]) a connection is
+ * kept open with an asynchronous search carrying the AD change notification
+ * control (LDAP_SERVER_NOTIFICATION_OID) or, for other servers, the
+ * persistent search control. The server returns an entry for each change
+ * below base. A change of a group removes
+ *
+ *   - the cached edges of the group
+ *   - the cached positive answers which were derived via the group
+ *   - all negative answers and answers without dependency information
+ *     (e.g. from peers), as the change may have added a user
+ *
+ * A change of another object (e.g. a user) removes only the edges and
+ * positive answers derived via it.
+ *
+ * AD accepts a subtree notification search only on the head of a naming
+ * context (e.g. DC=example,DC=com) and answers unwillingToPerform for an
+ * OU. The watch then falls back to the objects directly below base.
+ *
+ * If a subscription ends, changes may have been missed. All cached answers
+ * and edges are dropped then and the subscription is renewed after
+ * NOTIFY_RETRY seconds. A server which rejects the control does not
+ * support notifications, the subtree is not watched any more then.
+ */
+
+#define NOTIFY_RETRY 60
+#define NOTIFY_OID_AD "1.2.840.113556.1.4.528"
+#define NOTIFY_OID_PSEARCH "2.16.840.1.113730.3.4.3"
+
+struct wstruct {
+  char *base;
+  char *domain;
+  LDAP *ld;
+  char *bindp;
+  struct ldap_creds *lcreds;
+  int  msgid;
+  int  scope;
+  int  lost;
+  int  unsupported;
+  time_t retry;
+  struct wstruct *next;
+};
+
+static struct wstruct *watches=NULL;
+
+static int notify_subscribe(struct main_args *margs,struct wstruct *wp);
+static void notify_close(struct main_args *margs,struct wstruct *wp);
+static int notify_unsupported(struct main_args *margs,struct wstruct *wp,int rc);
+static int notify_group(LDAP *ld,LDAPMessage *msg);
+
+static void notify_close(struct main_args *margs,struct wstruct *wp) {
+  if (wp->ld) {
+    ldap_abandon_ext(wp->ld,wp->msgid,NULL,NULL);
+    free_ldap_connection(margs,wp->ld,NULL,wp->bindp,wp->lcreds);
+  }
+  wp->ld=NULL;
+  wp->bindp=NULL;
+  wp->lcreds=NULL;
+  wp->msgid=-1;
+  wp->retry=time(NULL)+NOTIFY_RETRY;
+}
+
+/*
+ * Give up the watch if the server does not support the control. A
+ * subtree watch refused by AD is renewed for one level right away.
+ */
+static int notify_unsupported(struct main_args *margs,struct wstruct *wp,int rc) {
+  if (rc != LDAP_UNAVAILABLE_CRITICAL_EXTENSION && rc != LDAP_UNWILLING_TO_PERFORM)
+    return(0);
+  if (rc == LDAP_UNWILLING_TO_PERFORM && wp->scope == LDAP_SCOPE_SUBTREE) {
+    fprintf(stderr, "%s| %s: Ldap server does not watch the subtree %s. Watch the objects directly below it\n",LogTime(), PROGRAM,wp->base);
+    notify_close(margs,wp);
+    wp->scope=LDAP_SCOPE_ONELEVEL;
+    wp->retry=time(NULL);
+    return(1);
+  }
+  fprintf(stderr, "%s| %s: Ldap server does not support change notifications (%s). Stop watching %s\n",LogTime(), PROGRAM,ldap_err2string(rc),wp->base);
+  notify_close(margs,wp);
+  wp->unsupported=1;
+  wp->lost=0;
+  return(1);
+}
+
+static int notify_subscribe(struct main_args *margs,struct wstruct *wp) {
+#ifdef LDAP_OPT_DESC
+  LDAPControl ctrl,*ctrls[2];
+  BerElement *ber=NULL;
+  struct berval *bv=NULL;
+  char *attrs[2];
+  int rc;
+
+  wp->ld=get_ldap_connection(margs,wp->domain,&wp->bindp,&wp->lcreds,NULL);
+  /* the Kerberos credentials are only needed for the bind */
+  if (wp->domain)
+    krb5_cleanup();
+  if (!wp->ld) {
+    fprintf(stderr, "%s| %s: Could not connect to watch %s@%s\n",LogTime(), PROGRAM,wp->base,wp->domain?wp->domain:"");
+    wp->bindp=NULL;
+    wp->lcreds=NULL;
+    wp->retry=time(NULL)+NOTIFY_RETRY;
+    return(1);
+  }
+
+  if (margs->AD) {
+    ctrl.ldctl_oid=(char *)NOTIFY_OID_AD;
+    ctrl.ldctl_value.bv_len=0;
+    ctrl.ldctl_value.bv_val=NULL;
+  } else {
+    /*
+     * PersistentSearch ::= SEQUENCE { changeTypes INTEGER (all = 15),
+     *                                 changesOnly BOOLEAN, returnECs BOOLEAN }
+     */
+    ber=ber_alloc_t(LBER_USE_DER);
+    if (!ber || ber_printf(ber,"{ibb}",15,1,0) < 0 || ber_flatten(ber,&bv) < 0) {
+      fprintf(stderr, "%s| %s: Error encoding persistent search control\n",LogTime(), PROGRAM);
+      if (ber)
+        ber_free(ber,1);
+      notify_close(margs,wp);
+      return(1);
+    }
+    ber_free(ber,1);
+    ctrl.ldctl_oid=(char *)NOTIFY_OID_PSEARCH;
+    ctrl.ldctl_value=*bv;
+  }
+  ctrl.ldctl_iscritical=1;
+  ctrls[0]=&ctrl;
+  ctrls[1]=NULL;
+  attrs[0]=(char *)"objectclass";
+  attrs[1]=NULL;
+
+  rc = ldap_search_ext(wp->ld, wp->base, wp->scope,
+                       "(objectclass=*)", attrs, 0,
+                       ctrls, NULL, NULL, 0, &wp->msgid);
+  if (bv)
+    ber_bvfree(bv);
+  if (rc != LDAP_SUCCESS) {
+    if (notify_unsupported(margs,wp,rc))
+      return(1);
+    fprintf(stderr, "%s| %s: Error subscribing to changes below %s: %s\n",LogTime(), PROGRAM,wp->base,ldap_err2string(rc));
+    notify_close(margs,wp);
+    return(1);
+  }
+  if (margs->debug)
+    fprintf(stderr, "%s| %s: Watching changes below %s\n",LogTime(), PROGRAM,wp->base);
+  if (wp->lost) {
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: Changes may have been missed. Drop cache\n",LogTime(), PROGRAM);
+    cache_cleanup();
+    wp->lost=0;
+  }
+  return(0);
+#else
+  fprintf(stderr, "%s| %s: Change notifications are not supported with this ldap library\n",LogTime(), PROGRAM);
+  wp->retry=time(NULL)+NOTIFY_RETRY;
+  return(1);
+#endif
+}
+
+/*
+ * Watch list format: base@domain[:base@domain]
+ */
+int notify_init(struct main_args *margs) {
+  struct wstruct *wp;
+  char *p,*np,*d;
+
+  if (!margs->wlist)
+    return(0);
+
+  for (p=margs->wlist; p && *p; p=np) {
+    if ((np=strchr(p,':')))
+      *np++ = '\0';
+    if (!*p)
+      continue;
+    wp=(struct wstruct *)calloc(1,sizeof(struct wstruct));
+    if ((d=strrchr(p,'@'))) {
+      *d++ = '\0';
+      if (*d) {
+        wp->domain=strdup(d);
+        strup(wp->domain);
+      }
+    }
+    if (!*p) {
+      fprintf(stderr, "%s| %s: No base given in watch list\n",LogTime(), PROGRAM);
+      if (wp->domain)
+        free(wp->domain);
+      free(wp);
+      return(1);
+    }
+    wp->base=strdup(p);
+    wp->msgid=-1;
+    wp->scope=LDAP_SCOPE_SUBTREE;
+    wp->next=watches;
+    watches=wp;
+    notify_subscribe(margs,wp);
+  }
+  return(0);
+}
+
+/*
+ * Changed entry is a group (by its objectclass values)
+ */
+static int notify_group(LDAP *ld,LDAPMessage *msg) {
+  struct berval **values;
+  int i,group=0;
+
+  if (!(values=ldap_get_values_len(ld,msg,"objectclass")))
+    return(0);
+  for (i=0;values[i] != NULL && !group;i++) {
+    if ((values[i]->bv_len == 5 && !strncasecmp(values[i]->bv_val,"group",5)) ||
+        (values[i]->bv_len == 12 && !strncasecmp(values[i]->bv_val,"groupOfNames",12)) ||
+        (values[i]->bv_len == 18 && !strncasecmp(values[i]->bv_val,"groupOfUniqueNames",18)) ||
+        (values[i]->bv_len == 10 && !strncasecmp(values[i]->bv_val,"posixGroup",10)))
+      group=1;
+  }
+  ber_bvecfree(values);
+  return(group);
+}
+
+/*
+ * Add the descriptors of the subscriptions to rfds
+ */
+int notify_fdset(fd_set *rfds,int maxfd) {
+#ifdef LDAP_OPT_DESC
+  struct wstruct *wp;
+  int fd;
+
+  for (wp=watches; wp; wp=wp->next) {
+    if (!wp->ld || ldap_get_option(wp->ld,LDAP_OPT_DESC,&fd) != LDAP_OPT_SUCCESS || fd < 0)
+      continue;
+    FD_SET(fd,rfds);
+    if (fd > maxfd)
+      maxfd=fd;
+  }
+#endif
+  return(maxfd);
+}
+
+/*
+ * Process change notifications of readable subscriptions
+ */
+void notify_check(struct main_args *margs,fd_set *rfds) {
+#ifdef LDAP_OPT_DESC
+  struct wstruct *wp;
+  LDAPMessage *res;
+  struct timeval tv;
+  char *dn;
+  int fd,rc,err,group;
+
+  for (wp=watches; wp; wp=wp->next) {
+    if (!wp->ld || ldap_get_option(wp->ld,LDAP_OPT_DESC,&fd) != LDAP_OPT_SUCCESS || fd < 0 || !FD_ISSET(fd,rfds))
+      continue;
+    tv.tv_sec=0;
+    tv.tv_usec=0;
+    while ((rc=ldap_result(wp->ld,wp->msgid,LDAP_MSG_ONE,&tv,&res)) > 0) {
+      if (rc == LDAP_RES_SEARCH_ENTRY) {
+        if ((dn=ldap_get_dn(wp->ld,res))) {
+          group=notify_group(wp->ld,res);
+          rc=cache_invalidate(margs,dn,group);
+          if (margs->debug || margs->log)
+            fprintf(stderr, "%s| %s: %s %s changed. Dropped %d cache entr%s\n",LogTime(), PROGRAM,group?"Group":"Object",dn,rc,rc==1?"y":"ies");
+          ldap_memfree(dn);
+        }
+        ldap_msgfree(res);
+        continue;
+      }
+      if (rc == LDAP_RES_SEARCH_RESULT) {
+        err=LDAP_OTHER;
+        ldap_parse_result(wp->ld,res,&err,NULL,NULL,NULL,NULL,0);
+        ldap_msgfree(res);
+        if (notify_unsupported(margs,wp,err)) {
+          rc=0;
+          break;
+        }
+        fprintf(stderr, "%s| %s: Watch of %s ended: %s\n",LogTime(), PROGRAM,wp->base,ldap_err2string(err));
+        rc=-1;
+        break;
+      }
+      ldap_msgfree(res);
+    }
+    if (rc < 0) {
+      if (margs->debug)
+        fprintf(stderr, "%s| %s: Lost watch of %s. Retry in %d seconds\n",LogTime(), PROGRAM,wp->base,NOTIFY_RETRY);
+      wp->lost=1;
+      notify_close(margs,wp);
+      cache_cleanup();
+    }
+  }
+#else
+  margs=margs;
+  rfds=rfds;
+#endif
+}
+
+/*
+ * Renew ended subscriptions
+ */
+void notify_idle(struct main_args *margs) {
+  struct wstruct *wp;
+  time_t now;
+
+  now=time(NULL);
+  for (wp=watches; wp; wp=wp->next) {
+    if (!wp->ld && !wp->unsupported && wp->retry <= now)
+      notify_subscribe(margs,wp);
+  }
+}
+
+void notify_cleanup(struct main_args *margs) {
+  struct wstruct *wp;
+
+  while ((wp=watches)) {
+    watches=wp->next;
+    if (wp->ld)
+      notify_close(margs,wp);
+    free(wp->base);
+    if (wp->domain)
+      free(wp->domain);
+    free(wp);
+  }
+}
@@ -0,0 +1,560 @@
+/*
+ * -----------------------------------------------------------------------------
+ *
+ * Author: Markus Moeller (markus_moeller at compuserve.com)
+ *
+ * Copyright (C) 2007 Markus Moeller. All rights reserved.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * -----------------------------------------------------------------------------
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "support.h"
+
+/*
+ * Share answers and group graph edges between helpers (e.g. on several
+ * proxies or between the children of one squid) with UDP datagrams:
+ *
+ *   <mac> SKL2 <sent> <config> <sender> <seq> V <expires> <verdict> <key>
+ *   <mac> SKL2 <sent> <config> <sender> <seq> E <expires> <n> <dn>\n<parent 1>\n...<parent n>
+ *
+ * mac is the hex SipHash-2-4 of the rest of the datagram keyed with the
+ * first 16 bytes of the -K file. Datagrams with a wrong mac or which were
+ * sent more than PEER_MAX_SKEW seconds ago are dropped.
+ *
+ * config is a hash of the options which change the answer for a user
+ * (groups, domain maps, ldap url and user, -m, -G). Answers are only
+ * taken from peers with the same configuration, so helpers for different
+ * external_acl_types can share a key and peers.
+ *
+ * sender is a random id chosen at startup and seq counts its datagrams.
+ * A datagram with a sequence number seen before (within the last
+ * PEER_WINDOW of the sender) is a replay and dropped.
+ *
+ * -P host:port[,host:port] peers (unicast or multicast) to send to
+ * -L [host:]port           address to listen on (joins the group if multicast)
+ */
+
+#define PEER_MAX_DGRAM 8192
+#define PEER_MAX_SKEW 30
+#define PEER_MAGIC "SKL2"
+#define PEER_WINDOW 64
+
+struct pstruct {
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  struct pstruct *next;
+};
+
+/*
+ * Sequence numbers seen from a sender: the highest and a bitmap of the
+ * PEER_WINDOW before it
+ */
+struct srstruct {
+  unsigned long long id;
+  unsigned long long seq;
+  unsigned long long window;
+  time_t seen;
+  struct srstruct *next;
+};
+
+static struct pstruct *peers=NULL;
+static int peer_lsock=-1;
+static int peer_sock4=-1;
+static int peer_sock6=-1;
+static unsigned char peer_key[16];
+static unsigned long long peer_config=0;
+static unsigned long long peer_id=0;
+static unsigned long long peer_seq=0;
+static struct srstruct *senders=NULL;
+
+static int peer_resolve(struct main_args *margs, char *hostport, int passive, struct sockaddr_storage *addr, socklen_t *addrlen);
+static int peer_socket(int family);
+static void peer_send(struct main_args *margs, char *msg, size_t len);
+static unsigned long long peer_hash_config(struct main_args *margs);
+static int peer_replay(unsigned long long id, unsigned long long seq, time_t now);
+static unsigned long long siphash(const unsigned char *k, const unsigned char *in, size_t inlen);
+
+#define ROTL(x,b) (unsigned long long)(((x) << (b)) | ((x) >> (64 - (b))))
+#define U8TO64_LE(p)                                                       \
+  (((unsigned long long)((p)[0])) | ((unsigned long long)((p)[1]) << 8) |  \
+   ((unsigned long long)((p)[2]) << 16) | ((unsigned long long)((p)[3]) << 24) | \
+   ((unsigned long long)((p)[4]) << 32) | ((unsigned long long)((p)[5]) << 40) | \
+   ((unsigned long long)((p)[6]) << 48) | ((unsigned long long)((p)[7]) << 56))
+#define SIPROUND                                                           \
+  do {                                                                     \
+    v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32);              \
+    v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2;                                 \
+    v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0;                                 \
+    v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32);              \
+  } while (0)
+
+/*
+ * SipHash-2-4 (https://131002.net/siphash/)
+ */
+static unsigned long long siphash(const unsigned char *k, const unsigned char *in, size_t inlen) {
+  unsigned long long v0 = 0x736f6d6570736575ULL;
+  unsigned long long v1 = 0x646f72616e646f6dULL;
+  unsigned long long v2 = 0x6c7967656e657261ULL;
+  unsigned long long v3 = 0x7465646279746573ULL;
+  unsigned long long k0 = U8TO64_LE(k);
+  unsigned long long k1 = U8TO64_LE(k + 8);
+  unsigned long long m;
+  unsigned long long b = ((unsigned long long)inlen) << 56;
+  const unsigned char *end = in + inlen - (inlen % 8);
+  int left = inlen & 7;
+
+  v3 ^= k1;
+  v2 ^= k0;
+  v1 ^= k1;
+  v0 ^= k0;
+  for (; in != end; in += 8) {
+    m = U8TO64_LE(in);
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+  }
+  switch (left) {
+  case 7: b |= ((unsigned long long)in[6]) << 48; /* FALLTHROUGH */
+  case 6: b |= ((unsigned long long)in[5]) << 40; /* FALLTHROUGH */
+  case 5: b |= ((unsigned long long)in[4]) << 32; /* FALLTHROUGH */
+  case 4: b |= ((unsigned long long)in[3]) << 24; /* FALLTHROUGH */
+  case 3: b |= ((unsigned long long)in[2]) << 16; /* FALLTHROUGH */
+  case 2: b |= ((unsigned long long)in[1]) << 8;  /* FALLTHROUGH */
+  case 1: b |= ((unsigned long long)in[0]); break;
+  case 0: break;
+  }
+  v3 ^= b;
+  SIPROUND;
+  SIPROUND;
+  v0 ^= b;
+  v2 ^= 0xff;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static int peer_resolve(struct main_args *margs, char *hostport, int passive, struct sockaddr_storage *addr, socklen_t *addrlen) {
+  struct addrinfo hints,*res=NULL;
+  char *host,*port,*p;
+  int rc;
+
+  host=strdup(hostport);
+  if (*host == '[' && (p=strchr(host,']'))) { /* [IPv6]:port */
+    *p++ = '\0';
+    port = (*p == ':') ? p+1 : NULL;
+    p = host+1;
+  } else if ((port=strrchr(host,':'))) {
+    *port++ = '\0';
+    p = host;
+  } else if (passive) { /* port only */
+    port = host;
+    p = NULL;
+  } else {
+    p = host;
+  }
+  if (!port || !*port) {
+    fprintf(stderr, "%s| %s: No port given for peer %s\n",LogTime(), PROGRAM,hostport);
+    free(host);
+    return(1);
+  }
+  memset(&hints,0,sizeof(hints));
+  hints.ai_family=AF_UNSPEC;
+  hints.ai_socktype=SOCK_DGRAM;
+  if (passive)
+    hints.ai_flags=AI_PASSIVE;
+  rc = getaddrinfo(p && *p ? p : NULL,port,&hints,&res);
+  if (rc != 0) {
+    fprintf(stderr, "%s| %s: Error while resolving peer %s with getaddrinfo: %s\n",LogTime(), PROGRAM,hostport,gai_strerror(rc));
+    free(host);
+    return(1);
+  }
+  memcpy(addr,res->ai_addr,res->ai_addrlen);
+  *addrlen=res->ai_addrlen;
+  if (margs->debug)
+    fprintf(stderr, "%s| %s: Resolved peer %s\n",LogTime(), PROGRAM,hostport);
+  freeaddrinfo(res);
+  free(host);
+  return(0);
+}
+
+static void peer_append(char **buf, size_t *len, const char *tag, const char *s1, const char *s2) {
+  size_t n;
+
+  n = strlen(tag)+(s1?strlen(s1):1)+(s2?strlen(s2):1)+3;
+  *buf=realloc(*buf,*len+n);
+  snprintf(*buf+*len,n,"%s=%s@%s\n",tag,s1?s1:"-",s2?s2:"-");
+  *len+=n-1;
+}
+
+/*
+ * Hash of the options which change the answer for a user
+ */
+static unsigned long long peer_hash_config(struct main_args *margs) {
+  struct gdstruct *gp;
+  struct ndstruct *np;
+  struct lsstruct *lp;
+  struct usstruct *up;
+  unsigned long long h;
+  char num[32];
+  char *buf=NULL;
+  size_t len=0;
+
+  for (gp=margs->groups; gp; gp=gp->next)
+    peer_append(&buf,&len,"g",gp->group,gp->domain);
+  for (np=margs->ndoms; np; np=np->next)
+    peer_append(&buf,&len,"N",np->netbios,np->domain);
+  for (lp=margs->lservs; lp; lp=lp->next)
+    peer_append(&buf,&len,"S",lp->lserver,lp->domain);
+  for (up=margs->usfxs; up; up=up->next)
+    peer_append(&buf,&len,"M",up->suffix,up->domain);
+  peer_append(&buf,&len,"D",margs->ddomain,NULL);
+  peer_append(&buf,&len,"l",margs->lurl,margs->lbind);
+  peer_append(&buf,&len,"u",margs->luser,NULL);
+  snprintf(num,sizeof(num),"%d",margs->mdepth);
+  peer_append(&buf,&len,"m",num,NULL);
+  snprintf(num,sizeof(num),"%d",margs->gmethod);
+  peer_append(&buf,&len,"G",num,NULL);
+  h=siphash(peer_key,(unsigned char *)buf,len);
+  free(buf);
+  return h;
+}
+
+/*
+ * Returns 1 if seq of sender id was seen before and records it otherwise
+ */
+static int peer_replay(unsigned long long id, unsigned long long seq, time_t now) {
+  struct srstruct *sp,**spp;
+  unsigned long long shift;
+
+  /*
+   * Forget silent senders. Everything they sent is older than
+   * PEER_MAX_SKEW by now and dropped anyway.
+   */
+  spp=&senders;
+  while ((sp=*spp)) {
+    if (sp->seen < now-2*PEER_MAX_SKEW) {
+      *spp=sp->next;
+      free(sp);
+    } else
+      spp=&sp->next;
+  }
+
+  for (sp=senders; sp && sp->id != id; sp=sp->next);
+  if (!sp) {
+    sp=(struct srstruct *)malloc(sizeof(struct srstruct));
+    sp->id=id;
+    sp->seq=seq;
+    sp->window=1;
+    sp->seen=now;
+    sp->next=senders;
+    senders=sp;
+    return(0);
+  }
+  if (seq > sp->seq) {
+    shift=seq-sp->seq;
+    sp->window = shift >= PEER_WINDOW ? 1 : (sp->window << shift) | 1;
+    sp->seq=seq;
+  } else {
+    shift=sp->seq-seq;
+    if (shift >= PEER_WINDOW || (sp->window & (1ULL << shift)))
+      return(1);
+    sp->window |= 1ULL << shift;
+  }
+  sp->seen=now;
+  return(0);
+}
+
+static int peer_socket(int family) {
+  int *sp;
+
+  sp = (family == AF_INET6) ? &peer_sock6 : &peer_sock4;
+  if (*sp < 0) {
+    *sp = socket(family,SOCK_DGRAM,0);
+    if (*sp >= 0)
+      fcntl(*sp,F_SETFL,O_NONBLOCK);
+  }
+  return *sp;
+}
+
+int peer_init(struct main_args *margs) {
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  struct pstruct *pp;
+  char *p,*np;
+  FILE *fp;
+  int on=1;
+
+  if (!margs->plist && !margs->plisten)
+    return(0);
+
+  if (!margs->pkey) {
+    fprintf(stderr, "%s| %s: Peer cache sharing needs a shared key file (-K)\n",LogTime(), PROGRAM);
+    return(1);
+  }
+  fp = fopen(margs->pkey,"r");
+  if (!fp || fread(peer_key,1,sizeof(peer_key),fp) != sizeof(peer_key)) {
+    fprintf(stderr, "%s| %s: Could not read %d bytes of shared key from %s\n",LogTime(), PROGRAM,(int)sizeof(peer_key),margs->pkey);
+    if (fp)
+      fclose(fp);
+    return(1);
+  }
+  fclose(fp);
+
+  peer_config=peer_hash_config(margs);
+  fp = fopen("/dev/urandom","r");
+  if (!fp || fread(&peer_id,1,sizeof(peer_id),fp) != sizeof(peer_id))
+    peer_id=((unsigned long long)time(NULL) << 32) ^ ((unsigned long long)getpid() << 16) ^ (unsigned long long)rand();
+  if (fp)
+    fclose(fp);
+  if (margs->debug)
+    fprintf(stderr, "%s| %s: Peer id %016llx, configuration %016llx\n",LogTime(), PROGRAM,peer_id,peer_config);
+
+  /*
+   * Peer list format: host:port[,host:port]
+   */
+  for (p=margs->plist; p && *p; p=np) {
+    if ((np=strchr(p,',')))
+      *np++ = '\0';
+    if (!*p)
+      continue;
+    if (peer_resolve(margs,p,0,&addr,&addrlen))
+      return(1);
+    pp=(struct pstruct *)malloc(sizeof(struct pstruct));
+    memcpy(&pp->addr,&addr,sizeof(addr));
+    pp->addrlen=addrlen;
+    pp->next=peers;
+    peers=pp;
+  }
+
+  if (margs->plisten) {
+    if (peer_resolve(margs,margs->plisten,1,&addr,&addrlen))
+      return(1);
+    peer_lsock = socket(addr.ss_family,SOCK_DGRAM,0);
+    if (peer_lsock < 0) {
+      fprintf(stderr, "%s| %s: Error while creating peer socket: %s\n",LogTime(), PROGRAM,strerror(errno));
+      return(1);
+    }
+    /* several helpers may listen on the same multicast group */
+    setsockopt(peer_lsock,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
+    if (addr.ss_family == AF_INET && IN_MULTICAST(ntohl(((struct sockaddr_in *)&addr)->sin_addr.s_addr))) {
+      struct ip_mreq mreq;
+      mreq.imr_multiaddr=((struct sockaddr_in *)&addr)->sin_addr;
+      mreq.imr_interface.s_addr=htonl(INADDR_ANY);
+      if (setsockopt(peer_lsock,IPPROTO_IP,IP_ADD_MEMBERSHIP,&mreq,sizeof(mreq)) < 0)
+        fprintf(stderr, "%s| %s: Error while joining peer multicast group: %s\n",LogTime(), PROGRAM,strerror(errno));
+    } else if (addr.ss_family == AF_INET6 && IN6_IS_ADDR_MULTICAST(&((struct sockaddr_in6 *)&addr)->sin6_addr)) {
+      struct ipv6_mreq mreq6;
+      mreq6.ipv6mr_multiaddr=((struct sockaddr_in6 *)&addr)->sin6_addr;
+      mreq6.ipv6mr_interface=0;
+      if (setsockopt(peer_lsock,IPPROTO_IPV6,IPV6_JOIN_GROUP,&mreq6,sizeof(mreq6)) < 0)
+        fprintf(stderr, "%s| %s: Error while joining peer multicast group: %s\n",LogTime(), PROGRAM,strerror(errno));
+    }
+    if (bind(peer_lsock,(struct sockaddr *)&addr,addrlen) < 0) {
+      fprintf(stderr, "%s| %s: Error while binding peer socket to %s: %s\n",LogTime(), PROGRAM,margs->plisten,strerror(errno));
+      close(peer_lsock);
+      peer_lsock=-1;
+      return(1);
+    }
+    fcntl(peer_lsock,F_SETFL,O_NONBLOCK);
+    if (addr.ss_family == AF_INET6)
+      peer_sock6=peer_lsock;
+    else
+      peer_sock4=peer_lsock;
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: Listening for peers on %s\n",LogTime(), PROGRAM,margs->plisten);
+  }
+  return(0);
+}
+
+int peer_fd(void) {
+  return peer_lsock;
+}
+
+static void peer_send(struct main_args *margs, char *msg, size_t len) {
+  struct pstruct *pp;
+  char *dgram;
+  int s;
+
+  dgram=malloc(len+18);
+  snprintf(dgram,18,"%016llx ",siphash(peer_key,(unsigned char *)msg,len));
+  memcpy(dgram+17,msg,len);
+  for (pp=peers; pp; pp=pp->next) {
+    s=peer_socket(pp->addr.ss_family);
+    if (s < 0)
+      continue;
+    if (sendto(s,dgram,len+17,0,(struct sockaddr *)&pp->addr,pp->addrlen) < 0 && margs->debug)
+      fprintf(stderr, "%s| %s: Error while sending to peer: %s\n",LogTime(), PROGRAM,strerror(errno));
+  }
+  free(dgram);
+}
+
+void peer_send_verdict(struct main_args *margs,char *key,int verdict) {
+  char msg[PEER_MAX_DGRAM];
+  int ttl,len;
+  time_t now;
+
+  ttl = verdict ? margs->cttl : margs->nttl;
+  if (!peers || ttl <= 0 || !key)
+    return;
+  now=time(NULL);
+  len=snprintf(msg,sizeof(msg),"%s %ld %016llx %016llx %llu V %ld %d %s",PEER_MAGIC,(long)now,peer_config,peer_id,++peer_seq,(long)(now+ttl),verdict?1:0,key);
+  if (len <= 0 || len >= (int)sizeof(msg))
+    return;
+  peer_send(margs,msg,len);
+}
+
+void peer_send_edge(struct main_args *margs,char *dn,char **parents,int nparents) {
+  char msg[PEER_MAX_DGRAM];
+  int i,len,n;
+  time_t now;
+
+  if (!peers || margs->cttl <= 0 || !dn || nparents < 0)
+    return;
+  now=time(NULL);
+  len=snprintf(msg,sizeof(msg),"%s %ld %016llx %016llx %llu E %ld %d %s",PEER_MAGIC,(long)now,peer_config,peer_id,++peer_seq,(long)(now+margs->cttl),nparents,dn);
+  for (i=0;i<nparents && len > 0 && len < (int)sizeof(msg);i++) {
+    n=snprintf(msg+len,sizeof(msg)-len,"\n%s",parents[i]);
+    len = n < 0 ? -1 : len+n;
+  }
+  if (len <= 0 || len >= (int)sizeof(msg)) {
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: Group %s too large to share with peers\n",LogTime(), PROGRAM,dn);
+    return;
+  }
+  peer_send(margs,msg,len);
+}
+
+/*
+ * Read all pending datagrams and add them to the caches
+ */
+void peer_receive(struct main_args *margs) {
+  char dgram[PEER_MAX_DGRAM+18];
+  char mac[17];
+  char **parents=NULL;
+  char *p,*np,*msg;
+  char type;
+  long sent,expires;
+  unsigned long long config,id,seq;
+  int verdict,nparents,i,n;
+  ssize_t len;
+  time_t now;
+
+  if (peer_lsock < 0)
+    return;
+
+  while ((len=recv(peer_lsock,dgram,sizeof(dgram)-1,0)) > 0) {
+    dgram[len]='\0';
+    if (len < 17 || dgram[16] != ' ')
+      continue;
+    msg=dgram+17;
+    snprintf(mac,sizeof(mac),"%016llx",siphash(peer_key,(unsigned char *)msg,len-17));
+    for (i=0,n=0;i<16;i++)
+      n |= mac[i] ^ dgram[i];
+    if (n) {
+      if (margs->debug)
+        fprintf(stderr, "%s| %s: Dropped peer message with wrong mac\n",LogTime(), PROGRAM);
+      continue;
+    }
+    n=0;
+    if (sscanf(msg,PEER_MAGIC " %ld %16llx %16llx %llu %c %ld %n",&sent,&config,&id,&seq,&type,&expires,&n) != 6 || n == 0)
+      continue;
+    now=time(NULL);
+    if (sent > now+PEER_MAX_SKEW || sent < now-PEER_MAX_SKEW) {
+      if (margs->debug)
+        fprintf(stderr, "%s| %s: Dropped stale peer message\n",LogTime(), PROGRAM);
+      continue;
+    }
+    if (id == peer_id)
+      continue;
+    if (config != peer_config) {
+      if (margs->debug)
+        fprintf(stderr, "%s| %s: Dropped peer message of helper with configuration %016llx\n",LogTime(), PROGRAM,config);
+      continue;
+    }
+    if (peer_replay(id,seq,now)) {
+      if (margs->debug)
+        fprintf(stderr, "%s| %s: Dropped replayed peer message %016llx/%llu\n",LogTime(), PROGRAM,id,seq);
+      continue;
+    }
+    p=msg+n;
+    if (type == 'V') {
+      if (sscanf(p,"%d %n",&verdict,&n) != 1)
+        continue;
+      p+=n;
+      /* never keep a shared answer longer than our own ttl */
+      if (expires > now + (verdict ? margs->cttl : margs->nttl))
+        expires = now + (verdict ? margs->cttl : margs->nttl);
+      if (margs->debug)
+        fprintf(stderr, "%s| %s: Got %s for %s from peer\n",LogTime(), PROGRAM,verdict?"OK":"ERR",p);
+      cache_store(margs,p,verdict?1:0,(time_t)expires);
+    } else if (type == 'E') {
+      if (sscanf(p,"%d %n",&nparents,&n) != 1 || nparents < 0 || nparents > PEER_MAX_DGRAM/2)
+        continue;
+      p+=n;
+      if ((np=strchr(p,'\n')))
+        *np++ = '\0';
+      if (expires > now + margs->cttl)
+        expires = now + margs->cttl;
+      parents = nparents ? (char **)malloc(nparents*sizeof(char *)) : NULL;
+      for (i=0;i<nparents && np;i++) {
+        parents[i]=np;
+        if ((np=strchr(np,'\n')))
+          *np++ = '\0';
+      }
+      if (i == nparents) {
+        if (margs->debug)
+          fprintf(stderr, "%s| %s: Got %d parent group%s for %s from peer\n",LogTime(), PROGRAM,nparents,nparents==1?"":"s",p);
+        edge_store(margs,p,parents,nparents,(time_t)expires);
+      }
+      if (parents)
+        free(parents);
+      parents=NULL;
+    }
+  }
+}
+
+void peer_cleanup(void) {
+  struct pstruct *pp;
+  struct srstruct *sp;
+
+  while ((pp=peers)) {
+    peers=pp->next;
+    free(pp);
+  }
+  while ((sp=senders)) {
+    senders=sp->next;
+    free(sp);
+  }
+  if (peer_sock4 >= 0 && peer_sock4 != peer_lsock)
+    close(peer_sock4);
+  if (peer_sock6 >= 0 && peer_sock6 != peer_lsock)
+    close(peer_sock6);
+  if (peer_lsock >= 0)
+    close(peer_lsock);
+  peer_sock4=peer_sock6=peer_lsock=-1;
+}
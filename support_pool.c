@@ -0,0 +1,471 @@
+/*
+ * -----------------------------------------------------------------------------
+ *
+ * Author: Markus Moeller (markus_moeller at compuserve.com)
+ *
+ * Copyright (C) 2007 Markus Moeller. All rights reserved.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * -----------------------------------------------------------------------------
+ */
+
+
+#include <unistd.h>
+
+#include "support.h"
+
+/*
+ * Pool of bound ldap connections, one per domain (the helper handles one
+ * request at a time) plus one to another server for hedged searches (-Q),
+ * which is set up while squid is idle.
+ * A connection is set up with get_ldap_connection on first use and kept
+ * for later requests and group checks. The Kerberos
+ * credential cache is only needed for the SASL/GSSAPI bind and is removed
+ * right after it. Connections which failed are closed and set up again on
+ * the next use, connections idle for more than -I seconds are closed.
+ * Connections are replaced after -R seconds (less up to a tenth, so that
+ * connections set up together are not replaced together) or requests, so
+ * that a server which is back from a failure or new gets its share again:
+ * the new connection goes to the best server at that time.
+ *
+ * With -A a domain can have a connection to each of its preferred servers
+ * (see dc_preferred) and a user's searches use the one to its server. If
+ * there is none a new connection is set up at most once per
+ * POOL_AFFINITY_RETRY seconds for that server (the connect race may still
+ * land on another one), else an idle connection to another server of the
+ * domain is used. A domain has at most POOL_DOMAIN_MAX connections.
+ *
+ * Connections idle for more than POOL_PROBE_IDLE seconds are checked with
+ * a rootDSE read, while squid is idle or else before they are reused. The
+ * probe waits at most POOL_PROBE_TIMEOUT seconds (not longer than a
+ * connect to a dead server would take).
+ */
+
+#define POOL_PROBE_IDLE 60
+#define POOL_PROBE_TIMEOUT 2
+#define POOL_AFFINITY_RETRY 60
+#define POOL_DOMAIN_MAX 8
+
+struct plstruct {
+  char *domain;
+  LDAP *ld;
+  char *bindp;
+  struct ldap_creds *lcreds;
+  struct dcstruct *dc;
+  int  AD;
+  int  busy;
+  int  reused;
+  int  uses;
+  time_t used;
+  time_t probed;
+  time_t expires;
+  struct plstruct *next;
+};
+
+static struct plstruct *pool=NULL;
+
+static void pool_close(struct main_args *margs,struct plstruct *pp);
+static void pool_warm(struct main_args *margs,char *domain);
+static struct plstruct *pool_new(struct main_args *margs,char *domain);
+static int pool_probe(struct main_args *margs,struct plstruct *pp);
+static int pool_unchecked(struct plstruct *pp,time_t now);
+static int pool_expired(struct main_args *margs,struct plstruct *pp);
+static void pool_spare(struct main_args *margs);
+
+static void pool_close(struct main_args *margs,struct plstruct *pp) {
+  struct plstruct **ppp;
+
+  for (ppp=&pool; *ppp; ppp=&(*ppp)->next) {
+    if (*ppp == pp) {
+      *ppp=pp->next;
+      break;
+    }
+  }
+  if (margs->debug)
+    fprintf(stderr, "%s| %s: Close ldap connection for domain %s\n",LogTime(), PROGRAM,pp->domain?pp->domain:"NULL");
+  free_ldap_connection(margs,pp->ld,NULL,pp->bindp,pp->lcreds);
+  if (pp->domain)
+    free(pp->domain);
+  free(pp);
+}
+
+/*
+ * Check that the server still answers. Returns 0 if it does.
+ */
+static int pool_probe(struct main_args *margs,struct plstruct *pp) {
+  LDAPMessage *res=NULL;
+  struct timeval searchtime;
+  char *attrs[2];
+  int rc;
+
+  searchtime.tv_sec = POOL_PROBE_TIMEOUT;
+  searchtime.tv_usec = 0;
+  attrs[0]=(char *)"supportedLDAPVersion";
+  attrs[1]=NULL;
+  rc = ldap_search_ext_s(pp->ld, "", LDAP_SCOPE_BASE,
+                         "(objectclass=*)", attrs, 0,
+                         NULL, NULL, &searchtime, 1, &res);
+  if (res)
+    ldap_msgfree(res);
+  if (rc != LDAP_SUCCESS) {
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: Probe of ldap connection for domain %s failed: %s\n",LogTime(), PROGRAM,pp->domain?pp->domain:"NULL",ldap_err2string(rc));
+    return(1);
+  }
+  pp->probed=time(NULL);
+  return(0);
+}
+
+/*
+ * Connection has not been used or probed for POOL_PROBE_IDLE seconds
+ */
+static int pool_unchecked(struct plstruct *pp,time_t now) {
+  return(now - (pp->probed > pp->used ? pp->probed : pp->used) >= POOL_PROBE_IDLE);
+}
+
+/*
+ * Connection has reached its lifetime or number of requests
+ */
+static int pool_expired(struct main_args *margs,struct plstruct *pp) {
+  if (margs->plife > 0 && time(NULL) >= pp->expires) {
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: Replace ldap connection for domain %s after %d seconds\n",LogTime(), PROGRAM,pp->domain?pp->domain:"NULL",margs->plife);
+    return(1);
+  }
+  if (margs->preqs > 0 && pp->uses >= margs->preqs) {
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: Replace ldap connection for domain %s after %d requests\n",LogTime(), PROGRAM,pp->domain?pp->domain:"NULL",pp->uses);
+    return(1);
+  }
+  return(0);
+}
+
+/*
+ * Return a bound connection for domain (NULL for the ldap url) and its
+ * bind path. The connection must be given back with pool_release.
+ */
+LDAP *pool_get(struct main_args *margs,char *domain,char **bind_path) {
+  struct plstruct *pp,*any;
+  struct dcstruct *pref;
+  time_t now;
+  int n;
+
+  pool_idle(margs,0);
+  pref=domain?dc_preferred(domain):NULL;
+  now=time(NULL);
+ again:
+  any=NULL;
+  n=0;
+  for (pp=pool; pp; pp=pp->next) {
+    if (!((!domain && !pp->domain) || (domain && pp->domain && !strcasecmp(domain,pp->domain))))
+      continue;
+    n++;
+    if (pp->busy)
+      continue;
+    if (!pref || pp->dc == pref)
+      break;
+    if (!any)
+      any=pp;
+  }
+  /*
+   * No connection to the preferred server: use another one unless a new
+   * connection to it is due
+   */
+  if (!pp && any && (n >= POOL_DOMAIN_MAX || now - pref->pooled < POOL_AFFINITY_RETRY)) {
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: No ldap connection to preferred server %s:%d\n",LogTime(), PROGRAM,pref->host,pref->port);
+    pp=any;
+  }
+  if (pp) {
+    if (pool_expired(margs,pp) || (pool_unchecked(pp,now) && pool_probe(margs,pp))) {
+      pool_close(margs,pp);
+      goto again;
+    }
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: Reuse ldap connection for domain %s\n",LogTime(), PROGRAM,domain?domain:"NULL");
+    pp->busy=1;
+    pp->reused=1;
+    pp->uses++;
+    margs->AD=pp->AD;
+    *bind_path=pp->bindp;
+    return(pp->ld);
+  }
+
+  if (pref)
+    pref->pooled=now;
+  pp=pool_new(margs,domain);
+  if (!pp)
+    return(NULL);
+  if (pref && pp->dc != pref && margs->debug)
+    fprintf(stderr, "%s| %s: New ldap connection for domain %s went to another server than %s:%d\n",LogTime(), PROGRAM,domain,pref->host,pref->port);
+  *bind_path=pp->bindp;
+  return(pp->ld);
+}
+
+/*
+ * Set up a new (busy) connection for domain
+ */
+static struct plstruct *pool_new(struct main_args *margs,char *domain) {
+  struct plstruct *pp;
+  LDAP *ld;
+  char *bindp=NULL;
+  struct ldap_creds *lcreds=NULL;
+  struct dcstruct *dc=NULL;
+  static int seeded=0;
+
+  if (!seeded) {
+    srand((unsigned int)(time(NULL)^getpid()));
+    seeded=1;
+  }
+  ld = get_ldap_connection(margs,domain,&bindp,&lcreds,&dc);
+  /* The credential cache is only needed for the bind */
+  if (domain)
+    krb5_cleanup();
+  if (!ld)
+    return(NULL);
+
+  pp=(struct plstruct *)malloc(sizeof(struct plstruct));
+  pp->domain=domain?strdup(domain):NULL;
+  pp->ld=ld;
+  pp->bindp=bindp;
+  pp->lcreds=lcreds;
+  pp->dc=dc;
+  pp->AD=margs->AD;
+  pp->busy=1;
+  pp->reused=0;
+  pp->uses=1;
+  pp->used=time(NULL);
+  pp->probed=pp->used;
+  pp->expires=pp->used+margs->plife;
+  if (margs->plife >= 10)
+    pp->expires-=rand()%(margs->plife/10);
+  pp->next=pool;
+  pool=pp;
+  return(pp);
+}
+
+/*
+ * Idle pooled connection to another server of the domain of ld for a
+ * hedged search or NULL. No connection is set up here, as that would hold
+ * up the search which is hedged (see pool_spare). Give it back with
+ * pool_release.
+ */
+LDAP *pool_hedge(struct main_args *margs,LDAP *ld) {
+  struct plstruct *pp,*hp;
+
+  for (pp=pool; pp; pp=pp->next) {
+    if (pp->ld == ld)
+      break;
+  }
+  if (!pp || !pp->dc)
+    return(NULL);
+  for (hp=pool; hp; hp=hp->next) {
+    if (hp->busy || !hp->dc || hp->dc == pp->dc)
+      continue;
+    if ((!pp->domain && !hp->domain) || (pp->domain && hp->domain && !strcasecmp(pp->domain,hp->domain))) {
+      if (pool_expired(margs,hp)) {
+        pool_close(margs,hp);
+        break;
+      }
+      hp->busy=1;
+      hp->reused=1;
+      hp->uses++;
+      return(hp->ld);
+    }
+  }
+  return(NULL);
+}
+
+/*
+ * With -Q set up a connection to a second server for a domain which has
+ * connections to one server only, so that pool_hedge finds one. Called
+ * while squid is idle, at most once per POOL_PROBE_IDLE seconds.
+ */
+static void pool_spare(struct main_args *margs) {
+  static time_t tried=0;
+  struct plstruct *pp,*hp,*np;
+  time_t now;
+  int AD;
+
+  now=time(NULL);
+  if (now - tried < POOL_PROBE_IDLE)
+    return;
+  for (pp=pool; pp; pp=pp->next) {
+    if (pp->busy || !pp->dc)
+      continue;
+    for (hp=pool; hp; hp=hp->next) {
+      if (hp->dc && hp->dc != pp->dc &&
+          ((!pp->domain && !hp->domain) || (pp->domain && hp->domain && !strcasecmp(pp->domain,hp->domain))))
+        break;
+    }
+    if (hp)
+      continue;
+    tried=now;
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: Set up ldap connection to a second server for domain %s\n",LogTime(), PROGRAM,pp->domain?pp->domain:"NULL");
+    AD=margs->AD;
+    dc_avoid(pp->dc);
+    np=pool_new(margs,pp->domain);
+    dc_avoid(NULL);
+    margs->AD=AD;
+    if (!np)
+      return;
+    np->busy=0;
+    /* no other server */
+    if (np->dc == pp->dc)
+      pool_close(margs,np);
+    return;
+  }
+}
+
+/*
+ * Give a connection back. It is closed if it failed (failed != 0 or the
+ * last operation found the server down) or if pooling is off (-I 0).
+ * Returns 1 if a reused connection was found down, i.e. the operation
+ * is worth a retry with a new connection.
+ */
+int pool_release(struct main_args *margs,LDAP *ld,int failed) {
+  struct plstruct *pp;
+  int down=0;
+#ifdef LDAP_OPT_ERROR_NUMBER
+  int err=LDAP_SUCCESS;
+#endif
+
+  for (pp=pool; pp; pp=pp->next) {
+    if (pp->ld == ld)
+      break;
+  }
+  if (!pp)
+    return(0);
+#ifdef LDAP_OPT_ERROR_NUMBER
+  if (ldap_get_option(ld,LDAP_OPT_ERROR_NUMBER,&err) == LDAP_OPT_SUCCESS && (err == LDAP_SERVER_DOWN || err == LDAP_CONNECT_ERROR))
+    down=1;
+#endif
+  if (down)
+    failed=1;
+  if (down && !pp->reused)
+    dc_failed(margs,pp->dc);
+  down = down && pp->reused;
+  pp->busy=0;
+  pp->used=time(NULL);
+  if (failed || margs->itimeout <= 0)
+    pool_close(margs,pp);
+  return(down);
+}
+
+/*
+ * Server a pooled connection is connected to
+ */
+struct dcstruct *pool_dc(LDAP *ld) {
+  struct plstruct *pp;
+
+  for (pp=pool; pp; pp=pp->next) {
+    if (pp->ld == ld)
+      return(pp->dc);
+  }
+  return(NULL);
+}
+
+/*
+ * Close connections which have not been used for -I seconds and, if
+ * probe is set, replace connections which reached their lifetime,
+ * check connections idle for POOL_PROBE_IDLE seconds and set up spare
+ * connections for hedging.
+ * Returns the number of open connections.
+ */
+int pool_idle(struct main_args *margs,int probe) {
+  struct plstruct *pp,*pn,*np;
+  char *domain;
+  time_t now,used;
+  int n=0;
+
+  if (probe && margs->hedge)
+    pool_spare(margs);
+  now=time(NULL);
+  for (pp=pool; pp; pp=pn) {
+    pn=pp->next;
+    if (!pp->busy && now - pp->used >= margs->itimeout)
+      pool_close(margs,pp);
+    else if (probe && !pp->busy && pool_expired(margs,pp)) {
+      domain=pp->domain?strdup(pp->domain):NULL;
+      used=pp->used;
+      pool_close(margs,pp);
+      np=pool_new(margs,domain);
+      if (np) {
+        /* the replacement is closed when the connection would have been */
+        np->busy=0;
+        np->used=used;
+        n++;
+      }
+      if (domain)
+        free(domain);
+    } else if (probe && !pp->busy && pool_unchecked(pp,now) && pool_probe(margs,pp))
+      pool_close(margs,pp);
+    else
+      n++;
+  }
+  return(n);
+}
+
+static void pool_warm(struct main_args *margs,char *domain) {
+  struct plstruct *pp;
+  char *bindp=NULL;
+  char *realm;
+  LDAP *ld;
+
+  if (!domain || !*domain)
+    return;
+  realm=strdup(domain);
+  strup(realm);
+  for (pp=pool; pp; pp=pp->next) {
+    if (pp->domain && !strcasecmp(pp->domain,realm)) {
+      free(realm);
+      return;
+    }
+  }
+  if (margs->debug)
+    fprintf(stderr, "%s| %s: Warm up ldap connection for domain %s\n",LogTime(), PROGRAM,realm);
+  ld = pool_get(margs,realm,&bindp);
+  if (ld) {
+    group_warmup(margs,ld,bindp,realm);
+    pool_release(margs,ld,0);
+  }
+  else
+    fprintf(stderr, "%s| %s: Warm up of ldap connection for domain %s failed\n",LogTime(), PROGRAM,realm);
+  free(realm);
+}
+
+/*
+ * Set up a bound connection for each domain of the group list (-g), the
+ * ldap server list (-S) and the default domain (-D) before the first
+ * request arrives. With -I 0 the connections are closed again, but server
+ * state (site, transport, latency) is still learned.
+ */
+void pool_warmup(struct main_args *margs) {
+  struct gdstruct *gp;
+  struct lsstruct *lp;
+
+  for (gp=margs->groups; gp; gp=gp->next)
+    pool_warm(margs,gp->domain);
+  for (lp=margs->lservs; lp; lp=lp->next)
+    pool_warm(margs,lp->domain);
+  pool_warm(margs,margs->ddomain);
+}
+
+void pool_cleanup(struct main_args *margs) {
+  while (pool)
+    pool_close(margs,pool);
+}
@@ -306,12 +306,15 @@ static void swap(struct hstruct *a, struct hstruct *b ) {
   struct hstruct c;
 
   c.host=a->host;
+  c.port=a->port;
   c.priority=a->priority;
   c.weight=a->weight;
   a->host=b->host;
+  a->port=b->port;
   a->priority=b->priority;
   a->weight=b->weight;
   b->host=c.host;
+  b->port=c.port;
   b->priority=c.priority;
   b->weight=c.weight;
 }
@@ -356,6 +359,18 @@ static int compare_hosts(struct hstruct *host1, struct hstruct *host2) {
   if ( (host1->priority > host2->priority ) &&  (host2->priority == -1) ) 
     return -1;
   if ( host1->priority == host2->priority ) {
+    /*
+     * Prefer servers with lower observed latency, but try servers
+     * without measurements first
+     */
+    double l1=dc_score(host1->host,host1->port);
+    double l2=dc_score(host2->host,host2->port);
+    if ( l1 < 0 && l2 >= 0 )
+      return -1;
+    if ( l1 >= 0 && l2 < 0 )
+      return 1;
+    if ( l1 >= 0 && l2 >= 0 && l1 != l2 )
+      return l1 < l2 ? -1 : 1;
     if ( host1->weight > host2->weight )
       return -1;
     if ( host1->weight < host2->weight )
@@ -434,50 +449,29 @@ int get_hostname_list(struct main_args *margs, struct hstruct **hlist, int nhost
   return(nhosts);
 }
 
-int get_ldap_hostname_list(struct main_args *margs, struct hstruct **hlist, int nh, char* domain) {
+/*
+ * Add the servers of the _ldap._tcp SRV records of domain (or of the AD
+ * site of domain if site is not NULL) to hlist. Returns the new number of
+ * servers.
+ */
+int get_srv_hostname_list(struct main_args *margs, struct hstruct **hlist, int nh, char *site, char* domain) {
 
   char name[sysconf(_SC_HOST_NAME_MAX)];
   char host[NS_MAXDNAME];
   char *service=NULL;
   struct hstruct *hp=NULL; 
-  struct lsstruct *ls=NULL;
-  int nhosts=0;
   int size; 
   int type, rdlength;
   int priority, weight, port;
-  int len,olen;
-  int i,j,k;
+  int len,olen,slen;
   u_char *buffer=NULL;
   u_char *p;
 
-  ls = margs->lservs;
-  while(ls) {
-    if (margs->debug)
-      fprintf(stderr,"%s| %s: Ldap server loop: lserver@domain %s@%s\n",LogTime(), PROGRAM,ls->lserver,ls->domain);
-    if (ls->domain && !strcasecmp(ls->domain,domain)) {
-      if (margs->debug)
-        fprintf(stderr,"%s| %s: Found lserver@domain %s@%s\n",LogTime(), PROGRAM,ls->lserver,ls->domain);
-       hp = realloc(hp, sizeof(struct hstruct) * (nhosts + 1));
-       hp[nhosts].host      = strdup(ls->lserver);
-       hp[nhosts].port      = -1;
-       hp[nhosts].priority  = -2;
-       hp[nhosts].weight    = -2;
-       nhosts++;
-    }
-    ls = ls->next;
-  }
-  /* found ldap servers in predefined list -> exit */
-  if (nhosts > 0) 
-     goto cleanup;
-
-  if (margs->ssl) {
-    service=malloc(strlen("_ldaps._tcp.")+strlen(domain)+1);
-    strcpy(service,"_ldaps._tcp.");
-  } else {
-    service=malloc(strlen("_ldap._tcp.")+strlen(domain)+1);
-    strcpy(service,"_ldap._tcp.");
-  }
-  strcat(service,domain);
+  slen=strlen("_ldaps._tcp.")+strlen(domain)+1;
+  if (site)
+    slen+=strlen(site)+strlen("._sites.");
+  service=malloc(slen);
+  snprintf(service,slen,"%s%s%s%s",margs->ssl?"_ldaps._tcp.":"_ldap._tcp.",site?site:"",site?"._sites.":"",domain);
 
 #ifndef PACKETSZ_MULT
 /* 
@@ -493,10 +487,7 @@ int get_ldap_hostname_list(struct main_args *margs, struct hstruct **hlist, int
     fprintf(stderr,"%s| %s: Error while resolving service record %s with res_search\n",LogTime(), PROGRAM,service); 
     nsError(h_errno,service);
     if (margs->ssl) {
-      free(service);
-      service=malloc(strlen("_ldap._tcp.")+strlen(domain)+1);
-      strcpy(service,"_ldap._tcp.");
-      strcat(service,domain);
+      snprintf(service,slen,"_ldap._tcp.%s%s%s",site?site:"",site?"._sites.":"",domain);
       if ((len = res_search(service, ns_c_in, ns_t_srv, (u_char *)buffer, PACKETSZ_MULT*NS_PACKETSZ))<0) {
         fprintf(stderr,"%s| %s: Error while resolving service record %s with res_search\n",LogTime(), PROGRAM,service);
         nsError(h_errno,service);
@@ -606,6 +597,65 @@ int get_ldap_hostname_list(struct main_args *margs, struct hstruct **hlist, int
     goto cleanup;
   }
 
+
+ cleanup:
+  if (buffer)
+    free(buffer);
+  if (service)
+    free(service);
+  *hlist=hp;
+  return(nh);
+}
+
+int get_ldap_hostname_list(struct main_args *margs, struct hstruct **hlist, int nh, char* domain) {
+
+  struct hstruct *hp=NULL; 
+  struct lsstruct *ls=NULL;
+  char *site;
+  int nhosts=0;
+  int i,j,k,n;
+
+  ls = margs->lservs;
+  while(ls) {
+    if (margs->debug)
+      fprintf(stderr,"%s| %s: Ldap server loop: lserver@domain %s@%s\n",LogTime(), PROGRAM,ls->lserver,ls->domain);
+    if (ls->domain && !strcasecmp(ls->domain,domain)) {
+      if (margs->debug)
+        fprintf(stderr,"%s| %s: Found lserver@domain %s@%s\n",LogTime(), PROGRAM,ls->lserver,ls->domain);
+       hp = realloc(hp, sizeof(struct hstruct) * (nhosts + 1));
+       hp[nhosts].host      = strdup(ls->lserver);
+       hp[nhosts].port      = -1;
+       hp[nhosts].priority  = -2;
+       hp[nhosts].weight    = -2;
+       nhosts++;
+    }
+    ls = ls->next;
+  }
+  /* found ldap servers in predefined list -> exit */
+  if (nhosts > 0) 
+     goto cleanup;
+
+  hp=*hlist;
+  n=nh;
+  /*
+   * Prefer the servers of the AD site of the helper. The other servers
+   * of the domain are kept as fallback behind them.
+   */
+  site=get_site(margs,domain);
+  if (site) {
+    nh=get_srv_hostname_list(margs,&hp,nh,site,domain);
+    if (nh > n) {
+      k=nh;
+      nh=get_srv_hostname_list(margs,&hp,nh,NULL,domain);
+      for (i=k;i<nh;i++)
+        hp[i].priority+=65536;
+    }
+  }
+  if (nh == n)
+    nh=get_srv_hostname_list(margs,&hp,nh,NULL,domain);
+  if (nh == n)
+    goto cleanup;
+
   nhosts = get_hostname_list(margs,&hp,nh,domain);
 
   if (margs->debug)
@@ -646,22 +696,11 @@ int get_ldap_hostname_list(struct main_args *margs, struct hstruct **hlist, int
   if (margs->debug) {
     fprintf(stderr, "%s| %s: Sorted ldap server names for domain %s:\n",LogTime(), PROGRAM,domain);
     for (i=0;i<nhosts;i++) {
-      fprintf(stderr, "%s| %s: Host: %s Port: %d Priority: %d Weight: %d\n",LogTime(), PROGRAM,hp[i].host,hp[i].port,hp[i].priority,hp[i].weight);
+      fprintf(stderr, "%s| %s: Host: %s Port: %d Priority: %d Weight: %d Latency: %.1f ms\n",LogTime(), PROGRAM,hp[i].host,hp[i].port,hp[i].priority,hp[i].weight,dc_score(hp[i].host,hp[i].port));
     }
   }
- 
-  if (buffer)
-    free(buffer);
-  if (service)
-    free(service);
-  *hlist=hp;
-  return(nhosts);
 
  cleanup:
-  if (buffer)
-    free(buffer);
-  if (service)
-    free(service);
   *hlist=hp;
   return(nhosts);
 }
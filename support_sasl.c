@@ -258,6 +258,54 @@ int tool_sasl_bind( LDAP *ld , char *binddn, char* ssl)
     }
     return rc;
   }
+
+#ifdef ASYNC_SETUP
+/*
+ * One step of a SASL/GSSAPI bind for a non-blocking setup (see
+ * support_setup.c). Call it with res NULL and *defaults NULL first and
+ * then with the answer to *msgid as long as it returns
+ * LDAP_SASL_BIND_IN_PROGRESS. The mechanism is given, so that no blocking
+ * search for the supported mechanisms is done.
+ */
+int tool_sasl_bind_step( LDAP *ld, char *binddn, char *ssl, LDAPMessage *res, void **defaults, const char **rmech, int *msgid )
+{
+  unsigned sasl_flags = LDAP_SASL_QUIET;
+  char  *sasl_mech = (char *)"GSSAPI";
+  char  *sasl_secprops;
+  int rc=LDAP_SUCCESS;
+
+  if (!*defaults) {
+    if (ssl)
+      sasl_secprops = (char *)"maxssf=0";
+    else
+      sasl_secprops = (char *)"maxssf=56";
+    rc = ldap_set_option( ld, LDAP_OPT_X_SASL_SECPROPS,
+			  (void *) sasl_secprops );
+    if( rc != LDAP_SUCCESS) {
+      fprintf(stderr,"%s| %s: Could not set LDAP_OPT_X_SASL_SECPROPS: %s: %s\n",LogTime(), PROGRAM, sasl_secprops,ldap_err2string(rc));
+      return rc;
+    }
+    *defaults = lutil_sasl_defaults( ld, sasl_mech, NULL, NULL, NULL, NULL );
+    *rmech = NULL;
+    *msgid = 0;
+  }
+
+  rc = ldap_sasl_interactive_bind( ld, binddn,
+				   sasl_mech, NULL, NULL,
+				   sasl_flags, lutil_sasl_interact, *defaults,
+				   res, rmech, msgid );
+  if (rc != LDAP_SASL_BIND_IN_PROGRESS) {
+    lutil_sasl_freedefs( *defaults );
+    *defaults = NULL;
+  }
+  return rc;
+}
+
+void tool_sasl_freedefs( void *defaults )
+{
+  lutil_sasl_freedefs( defaults );
+}
+#endif
 #else
 void dummy(void);
 void dummy(void) {
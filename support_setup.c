@@ -0,0 +1,294 @@
+/*
+ * -----------------------------------------------------------------------------
+ *
+ * Author: Markus Moeller (markus_moeller at compuserve.com)
+ *
+ * Copyright (C) 2007 Markus Moeller. All rights reserved.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * -----------------------------------------------------------------------------
+ */
+
+
+#include <errno.h>
+#include <poll.h>
+
+#include "support.h"
+
+#ifdef ASYNC_SETUP
+/*
+ * Set up connections to the ldap servers of a domain without blocking in
+ * Start TLS or the SASL/GSSAPI bind: the Start TLS request and each step
+ * of the SASL exchange are sent and their answers polled for. If a server
+ * has not finished its setup after SETUP_DELAY milliseconds the next
+ * server is connected (see connect_race) and set up at the same time, up
+ * to SETUP_MAX at once. The first bound connection wins and the others
+ * are dropped. A setup not finished after SETUP_TIMEOUT milliseconds
+ * fails. The sockets are polled SETUP_POLL milliseconds at most, as the
+ * library may have read an answer already (e.g. buffered in TLS).
+ *
+ * The TLS handshake after the Start TLS answer, an ldaps fallback and
+ * getting the Kerberos service ticket in the first SASL step still block
+ * in the libraries.
+ */
+
+#define SETUP_DELAY 250
+#define SETUP_MAX 3
+#define SETUP_TIMEOUT 5000
+#define SETUP_POLL 50
+
+static int setup_sasl(struct main_args *margs,struct sustruct *sp,LDAPMessage *res);
+static void setup_failed(struct main_args *margs,struct sustruct *sp,const char *what,int rc);
+
+static void setup_failed(struct main_args *margs,struct sustruct *sp,const char *what,int rc) {
+  fprintf(stderr, "%s| %s: Error during %s with ldap server %s:%d: %s\n",LogTime(), PROGRAM,what,sp->host,sp->port,ldap_err2string(rc));
+  if (rc == LDAP_SERVER_DOWN || rc == LDAP_CONNECT_ERROR || rc == LDAP_TIMEOUT)
+    dc_failed(margs,dc_get(sp->host,sp->port,1));
+  setup_cancel(sp);
+  sp->state=SU_FAILED;
+}
+
+/*
+ * Send the next SASL bind request, res is the answer to the last one
+ */
+static int setup_sasl(struct main_args *margs,struct sustruct *sp,LDAPMessage *res) {
+  int rc;
+
+  rc = tool_sasl_bind_step(sp->ld,sp->bindp,sp->ssl,res,&sp->defaults,&sp->rmech,&sp->msgid);
+  if (rc == LDAP_SASL_BIND_IN_PROGRESS) {
+    sp->state=SU_SASL;
+  } else if (rc == LDAP_SUCCESS) {
+    sp->state=SU_DONE;
+  } else {
+    setup_failed(margs,sp,"SASL/GSSAPI bind",rc);
+  }
+  return(sp->state);
+}
+
+/*
+ * Start the setup of a connection on the connected socket fd
+ */
+int setup_start(struct main_args *margs,struct sustruct *sp,int fd,char *host,int port,char *ssl,char *bindp) {
+  int rc,tport;
+
+  memset(sp,0,sizeof(struct sustruct));
+  sp->host=host;
+  sp->port=port;
+  sp->ssl=ssl;
+  sp->bindp=bindp;
+  gettimeofday(&sp->start,NULL);
+  if (margs->debug)
+    fprintf(stderr, "%s| %s: Setting up connection to ldap server %s:%d\n",LogTime(), PROGRAM,host,port);
+
+  if (ssl && dc_get_transport(margs,host,port,&tport) == DC_LDAPS) {
+    /* tool_ldap_open_fd goes to ldaps */
+    sp->ld = tool_ldap_open_fd(margs,fd,host,port,ssl);
+    ssl=NULL;
+  } else {
+    sp->ld = tool_ldap_open_fd(margs,fd,host,port,NULL);
+  }
+  if (!sp->ld) {
+    dc_failed(margs,dc_get(host,port,1));
+    sp->state=SU_FAILED;
+    return(sp->state);
+  }
+  if (!ssl)
+    return(setup_sasl(margs,sp,NULL));
+
+  if (margs->debug)
+    fprintf(stderr, "%s| %s: Set SSL defaults\n",LogTime(), PROGRAM);
+  rc = ldap_set_ssl_defaults(margs);
+  if (rc == LDAP_SUCCESS)
+    rc = ldap_start_tls(sp->ld,NULL,NULL,&sp->msgid);
+  if (rc != LDAP_SUCCESS) {
+    setup_failed(margs,sp,"start_tls",rc);
+    return(sp->state);
+  }
+  sp->state=SU_TLS;
+  return(sp->state);
+}
+
+/*
+ * Take in the answers which arrived and send the next request. Does not
+ * block (except in the cases above). Returns the new state.
+ */
+int setup_step(struct main_args *margs,struct sustruct *sp) {
+  LDAPMessage *res;
+  struct timeval zero;
+  int rc,err;
+
+  while (sp->state == SU_TLS || sp->state == SU_SASL) {
+    zero.tv_sec=0;
+    zero.tv_usec=0;
+    res=NULL;
+    rc = ldap_result(sp->ld,sp->msgid,LDAP_MSG_ALL,&zero,&res);
+    if (rc == 0)
+      break;
+    if (rc < 0 || !res) {
+      err=LDAP_SERVER_DOWN;
+      ldap_get_option(sp->ld,LDAP_OPT_ERROR_NUMBER,&err);
+      setup_failed(margs,sp,sp->state == SU_TLS ? "start_tls" : "SASL/GSSAPI bind",err);
+      break;
+    }
+    if (sp->state == SU_SASL) {
+      setup_sasl(margs,sp,res);
+      ldap_msgfree(res);
+      continue;
+    }
+
+    err=LDAP_OTHER;
+    rc = ldap_parse_result(sp->ld,res,&err,NULL,NULL,NULL,NULL,1);
+    if (rc == LDAP_SUCCESS)
+      rc=err;
+    if (rc == LDAP_SUCCESS)
+      rc = ldap_install_tls(sp->ld);
+    if (rc != LDAP_SUCCESS) {
+      fprintf(stderr, "%s| %s: Error while setting start_tls for ldap server: %s\n",LogTime(), PROGRAM,ldap_err2string(rc));
+      ldap_unbind(sp->ld);
+      /* Fall back to ldaps */
+      sp->ld = tool_ldaps_open(margs,sp->host,sp->port == LDAP_PORT ? LDAPS_PORT : sp->port);
+      if (!sp->ld) {
+        dc_failed(margs,dc_get(sp->host,sp->port,1));
+        sp->state=SU_FAILED;
+        break;
+      }
+    }
+    setup_sasl(margs,sp,NULL);
+  }
+  return(sp->state);
+}
+
+/*
+ * Socket to poll for the answers of a setup or -1
+ */
+int setup_desc(struct sustruct *sp) {
+  int fd=-1;
+
+  if (!sp->ld || (sp->state != SU_TLS && sp->state != SU_SASL))
+    return(-1);
+  if (ldap_get_option(sp->ld,LDAP_OPT_DESC,&fd) != LDAP_OPT_SUCCESS)
+    return(-1);
+  return(fd);
+}
+
+/*
+ * Drop an unfinished setup
+ */
+void setup_cancel(struct sustruct *sp) {
+  if (sp->defaults)
+    tool_sasl_freedefs(sp->defaults);
+  sp->defaults=NULL;
+  if (sp->ld)
+    ldap_unbind(sp->ld);
+  sp->ld=NULL;
+}
+
+/*
+ * Set up a bound connection to one of the servers of alist (from
+ * connect_list on hlist). Returns the connection, the index of its server
+ * in host and the start of its setup in start, or NULL.
+ */
+LDAP *setup_race(struct main_args *margs,struct hstruct *hlist,struct castruct *alist,int naddrs,char *bindp,char *ssl,int *host,struct timeval *start) {
+  struct sustruct su[SETUP_MAX];
+  int hosts[SETUP_MAX];
+  struct pollfd pfd[SETUP_MAX];
+  struct timeval last;
+  LDAP *ld=NULL;
+  int i,n,fd,h,port,nact,timeout,done=0,winner=-1;
+
+  for (i=0;i<SETUP_MAX;i++)
+    su[i].state=SU_FAILED;
+  last.tv_sec=0;
+  last.tv_usec=0;
+
+  while (winner < 0) {
+    nact=0;
+    for (i=0;i<SETUP_MAX;i++)
+      if (su[i].state == SU_TLS || su[i].state == SU_SASL)
+        nact++;
+    /*
+     * Start the next server if nothing is set up or the setups are slow
+     */
+    if (!done && nact < SETUP_MAX && (nact == 0 || dc_since(&last) >= SETUP_DELAY)) {
+      fd=connect_race(margs,alist,naddrs,&h);
+      if (fd < 0) {
+        done=1;
+      } else {
+        for (i=0;su[i].state != SU_FAILED;i++)
+          ;
+        port = hlist[h].port != -1 ? hlist[h].port : 389;
+        hosts[i]=h;
+        gettimeofday(&last,NULL);
+        if (setup_start(margs,&su[i],fd,hlist[h].host,port,ssl,bindp) == SU_DONE)
+          winner=i;
+        continue;
+      }
+    }
+    if (nact == 0) {
+      if (done)
+        break;
+      continue;
+    }
+
+    /*
+     * Wait for an answer, a timeout or the next server to be due
+     */
+    timeout=SETUP_POLL;
+    for (i=0,n=0;i<SETUP_MAX;i++) {
+      if ((fd=setup_desc(&su[i])) < 0)
+        continue;
+      pfd[n].fd=fd;
+      pfd[n].events=POLLIN;
+      pfd[n].revents=0;
+      n++;
+      if (SETUP_TIMEOUT - dc_since(&su[i].start) < timeout)
+        timeout=(int)(SETUP_TIMEOUT - dc_since(&su[i].start));
+    }
+    if (!done && nact < SETUP_MAX && SETUP_DELAY - dc_since(&last) < timeout)
+      timeout=(int)(SETUP_DELAY - dc_since(&last));
+    if (timeout < 0)
+      timeout=0;
+    if (poll(pfd,n,timeout) < 0 && errno != EINTR)
+      break;
+
+    for (i=0;i<SETUP_MAX && winner < 0;i++) {
+      if (su[i].state != SU_TLS && su[i].state != SU_SASL)
+        continue;
+      if (setup_step(margs,&su[i]) == SU_DONE) {
+        winner=i;
+      } else if ((su[i].state == SU_TLS || su[i].state == SU_SASL) && dc_since(&su[i].start) >= SETUP_TIMEOUT) {
+        setup_failed(margs,&su[i],su[i].state == SU_TLS ? "start_tls" : "SASL/GSSAPI bind",LDAP_TIMEOUT);
+      }
+    }
+  }
+
+  for (i=0;i<SETUP_MAX;i++) {
+    if (i == winner)
+      continue;
+    if (su[i].state == SU_TLS || su[i].state == SU_SASL) {
+      if (margs->debug)
+        fprintf(stderr, "%s| %s: Drop setup of connection to ldap server %s:%d\n",LogTime(), PROGRAM,su[i].host,su[i].port);
+      setup_cancel(&su[i]);
+    }
+  }
+  if (winner < 0)
+    return(NULL);
+  ld=su[winner].ld;
+  *host=hosts[winner];
+  *start=su[winner].start;
+  return(ld);
+}
+#endif
@@ -0,0 +1,415 @@
+/*
+ * -----------------------------------------------------------------------------
+ *
+ * Author: Markus Moeller (markus_moeller at compuserve.com)
+ *
+ * Copyright (C) 2007 Markus Moeller. All rights reserved.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * -----------------------------------------------------------------------------
+ */
+
+
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+
+#include "support.h"
+
+/*
+ * AD site discovery
+ *
+ * The AD site of the helper is learned with a CLDAP netlogon ping
+ * ([MS-ADTS] 6.3.3): an ldap search over UDP port 389 of the rootDSE with
+ * filter (&(DnsDomain=<domain>)(NtVer=\06\00\00\00)) for attribute Netlogon.
+ * The answer is a NETLOGON_SAM_LOGON_RESPONSE_EX structure which contains
+ * the name of the site of the client address (ClientSiteName). A few
+ * servers of the domain are pinged at once and the first answer is used.
+ *
+ * The site is kept per domain for SITE_TTL seconds (SITE_NEG_TTL seconds
+ * if no site could be learned, e.g. for non AD servers).
+ *
+ * With the environment variable CLDAP_SERVER=host[:port] (e.g. a local
+ * stub responder for testing) only that server is pinged instead of the
+ * servers from the SRV records.
+ */
+
+#define CLDAP_PORT 389
+#define SITE_PINGS 3
+#define SITE_TIMEOUT 1000
+#define SITE_TTL 3600
+#define SITE_NEG_TTL 600
+
+#define NETLOGON_NT_VERSION_5EX 0x04
+#define NETLOGON_NT_VERSION_5EX_WITH_IP 0x02
+#define LOGON_SAM_LOGON_RESPONSE_EX 23
+#define LOGON_SAM_USER_UNKNOWN_EX 25
+
+struct ststruct {
+  char *domain;
+  char *site;
+  time_t expires;
+  struct ststruct *next;
+};
+
+static struct ststruct *sites=NULL;
+static int cldap_id=0;
+
+static int ber_tlv(unsigned char *out, int tag, const unsigned char *val, int len);
+static int ber_next(const unsigned char **p, const unsigned char *end, int tag, int *len);
+static int cldap_request(unsigned char *buf, char *domain, int id);
+static char *cldap_response(struct main_args *margs, const unsigned char *buf, int len, int id);
+static int netlogon_name(const unsigned char *buf, int len, int *off, char *name, int nlen);
+static int cldap_server(struct main_args *margs, struct hstruct **hlist);
+
+/*
+ * Write tag, length and value to out. Returns the length written.
+ */
+static int ber_tlv(unsigned char *out, int tag, const unsigned char *val, int len) {
+  int n=0;
+
+  out[n++]=tag;
+  if (len < 128) {
+    out[n++]=len;
+  } else if (len < 256) {
+    out[n++]=0x81;
+    out[n++]=len;
+  } else {
+    out[n++]=0x82;
+    out[n++]=(len>>8) & 0xff;
+    out[n++]=len & 0xff;
+  }
+  memmove(out+n,val,len);
+  return(n+len);
+}
+
+/*
+ * Read tag and length at *p. Returns 0 and moves *p to the value if the
+ * tag is the expected one.
+ */
+static int ber_next(const unsigned char **p, const unsigned char *end, int tag, int *len) {
+  const unsigned char *q=*p;
+  int i,n;
+
+  if (end-q < 2 || *q != tag)
+    return(-1);
+  q++;
+  if (*q & 0x80) {
+    n=*q++ & 0x7f;
+    if (n < 1 || n > 3 || end-q < n)
+      return(-1);
+    for (*len=0,i=0;i<n;i++)
+      *len=(*len<<8) | *q++;
+  } else {
+    *len=*q++;
+  }
+  if (*len > end-q)
+    return(-1);
+  *p=q;
+  return(0);
+}
+
+/*
+ * Build the netlogon ping for domain in buf (at least 1024 bytes)
+ */
+static int cldap_request(unsigned char *buf, char *domain, int id) {
+  unsigned char a[512],b[512],c[512];
+  unsigned char ntver[4]={NETLOGON_NT_VERSION_5EX | NETLOGON_NT_VERSION_5EX_WITH_IP,0,0,0};
+  unsigned char v[2];
+  int na,nb,nc;
+
+  /* (DnsDomain=<domain>) */
+  na=ber_tlv(a,0x04,(const unsigned char *)"DnsDomain",9);
+  na+=ber_tlv(a+na,0x04,(const unsigned char *)domain,strlen(domain));
+  nb=ber_tlv(b,0xa3,a,na);
+  /* (NtVer=\06\00\00\00) */
+  na=ber_tlv(a,0x04,(const unsigned char *)"NtVer",5);
+  na+=ber_tlv(a+na,0x04,ntver,4);
+  nb+=ber_tlv(b+nb,0xa3,a,na);
+  /* search request: base "", scope base, no deref, no limits, filter (&...), attribute Netlogon */
+  v[0]=0;
+  nc=ber_tlv(c,0x04,v,0);
+  nc+=ber_tlv(c+nc,0x0a,v,1);
+  nc+=ber_tlv(c+nc,0x0a,v,1);
+  nc+=ber_tlv(c+nc,0x02,v,1);
+  nc+=ber_tlv(c+nc,0x02,v,1);
+  nc+=ber_tlv(c+nc,0x01,v,1);
+  nc+=ber_tlv(c+nc,0xa0,b,nb);
+  na=ber_tlv(a,0x04,(const unsigned char *)"Netlogon",8);
+  nc+=ber_tlv(c+nc,0x30,a,na);
+  /* message: id, request */
+  v[0]=(id>>8) & 0x7f;
+  v[1]=id & 0xff;
+  na=ber_tlv(a,0x02,v,2);
+  na+=ber_tlv(a+na,0x63,c,nc);
+  return(ber_tlv(buf,0x30,a,na));
+}
+
+/*
+ * Read a (compressed) DNS name of the netlogon structure at *off
+ */
+static int netlogon_name(const unsigned char *buf, int len, int *off, char *name, int nlen) {
+  int p=*off,n=0,jumps=0,l;
+
+  name[0]='\0';
+  while (1) {
+    if (p >= len)
+      return(-1);
+    l=buf[p];
+    if ((l & 0xc0) == 0xc0) {
+      if (p+1 >= len || ++jumps > 16)
+        return(-1);
+      if (jumps == 1)
+        *off=p+2;
+      p=((l & 0x3f)<<8) | buf[p+1];
+      continue;
+    }
+    p++;
+    if (l == 0)
+      break;
+    if (p+l > len || n+l+2 > nlen)
+      return(-1);
+    if (n)
+      name[n++]='.';
+    memcpy(name+n,buf+p,l);
+    n+=l;
+    name[n]='\0';
+    p+=l;
+  }
+  if (jumps == 0)
+    *off=p;
+  return(0);
+}
+
+/*
+ * Parse the answer to a netlogon ping. Returns the client site or NULL.
+ */
+static char *cldap_response(struct main_args *margs, const unsigned char *buf, int len, int id) {
+  const unsigned char *p=buf,*end=buf+len,*aend;
+  char name[256],dcsite[256];
+  int l,off,i,rid=0,opcode;
+
+  if (ber_next(&p,end,0x30,&l))
+    return(NULL);
+  end=p+l;
+  if (ber_next(&p,end,0x02,&l) || l > 4)
+    return(NULL);
+  for (i=0;i<l;i++)
+    rid=(rid<<8) | *p++;
+  if (rid != id)
+    return(NULL);
+  if (ber_next(&p,end,0x64,&l))
+    return(NULL);
+  end=p+l;
+  if (ber_next(&p,end,0x04,&l))
+    return(NULL);
+  p+=l;
+  if (ber_next(&p,end,0x30,&l))
+    return(NULL);
+  while (p < end) {
+    if (ber_next(&p,end,0x30,&l))
+      return(NULL);
+    aend=p+l;
+    if (ber_next(&p,aend,0x04,&l))
+      return(NULL);
+    if (l != 8 || strncasecmp((const char *)p,"netlogon",8)) {
+      p=aend;
+      continue;
+    }
+    p+=l;
+    if (ber_next(&p,aend,0x31,&l) || ber_next(&p,aend,0x04,&l))
+      return(NULL);
+    /*
+     * NETLOGON_SAM_LOGON_RESPONSE_EX: opcode, sbz, flags, domain guid and
+     * the names forest, domain, host, netbios domain, netbios host, user,
+     * server site and client site
+     */
+    if (l < 24)
+      return(NULL);
+    opcode=p[0] | (p[1]<<8);
+    if (opcode != LOGON_SAM_LOGON_RESPONSE_EX && opcode != LOGON_SAM_USER_UNKNOWN_EX)
+      return(NULL);
+    off=24;
+    for (i=0;i<8;i++) {
+      if (netlogon_name(p,l,&off,name,sizeof(name)))
+        return(NULL);
+      if (i == 6)
+        strcpy(dcsite,name);
+    }
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: Netlogon ping: server site %s client site %s\n",LogTime(), PROGRAM,dcsite,name);
+    if (!name[0])
+      return(NULL);
+    return(strdup(name));
+  }
+  return(NULL);
+}
+
+/*
+ * Ping up to SITE_PINGS servers of hlist and return the site of the
+ * helper (or NULL)
+ */
+char *cldap_site(struct main_args *margs, char *domain, struct hstruct *hlist, int nhosts) {
+  struct addrinfo hints,*res,*ai;
+  struct pollfd pfd[2*SITE_PINGS];
+  unsigned char buf[1500];
+  char port[16];
+  char *site=NULL;
+  int i,n=0,len,rc,id;
+  struct timeval start;
+
+  if (strlen(domain) > 255)
+    return(NULL);
+  id=++cldap_id & 0x7fff;
+  len=cldap_request(buf,domain,id);
+
+  for (i=0;i<nhosts && i<SITE_PINGS;i++) {
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family=AF_UNSPEC;
+    hints.ai_socktype=SOCK_DGRAM;
+    snprintf(port,sizeof(port),"%d",hlist[i].port);
+    rc = getaddrinfo(hlist[i].host,port,&hints,&res);
+    if (rc) {
+      if (margs->debug)
+        fprintf(stderr, "%s| %s: Error while resolving %s: %s\n",LogTime(), PROGRAM,hlist[i].host,gai_strerror(rc));
+      continue;
+    }
+    for (ai=res; ai && n<2*SITE_PINGS; ai=ai->ai_next) {
+      pfd[n].fd=socket(ai->ai_family,SOCK_DGRAM,0);
+      if (pfd[n].fd < 0)
+        continue;
+      if (connect(pfd[n].fd,ai->ai_addr,ai->ai_addrlen) < 0 || send(pfd[n].fd,buf,len,0) != len) {
+        close(pfd[n].fd);
+        continue;
+      }
+      if (margs->debug)
+        fprintf(stderr, "%s| %s: Sent netlogon ping for domain %s to %s:%s\n",LogTime(), PROGRAM,domain,hlist[i].host,port);
+      pfd[n].events=POLLIN;
+      n++;
+      break;
+    }
+    freeaddrinfo(res);
+  }
+
+  gettimeofday(&start,NULL);
+  while (!site && n > 0 && dc_since(&start) < SITE_TIMEOUT) {
+    rc=poll(pfd,n,SITE_TIMEOUT-(int)dc_since(&start));
+    if (rc < 0 && errno != EINTR)
+      break;
+    for (i=0;i<n && !site;i++) {
+      if (!(pfd[i].revents & (POLLIN|POLLERR)))
+        continue;
+      len=recv(pfd[i].fd,buf,sizeof(buf),0);
+      if (len > 0) {
+        site=cldap_response(margs,buf,len,id);
+        continue;
+      }
+      /* e.g. port unreachable */
+      close(pfd[i].fd);
+      pfd[i]=pfd[--n];
+      i--;
+    }
+  }
+  for (i=0;i<n;i++)
+    close(pfd[i].fd);
+  return(site);
+}
+
+/*
+ * Server given with CLDAP_SERVER=host[:port] ([IPv6]:port) if set
+ */
+static int cldap_server(struct main_args *margs, struct hstruct **hlist) {
+  char *env,*host,*p;
+  int port=CLDAP_PORT;
+
+  if (!(env=getenv("CLDAP_SERVER")) || !*env)
+    return(0);
+  host=strdup(env);
+  if (*host == '[' && (p=strchr(host,']'))) {
+    *p++='\0';
+    memmove(host,host+1,strlen(host));
+    if (*p == ':')
+      port=atoi(p+1);
+  } else if ((p=strrchr(host,':')) && p == strchr(host,':')) {
+    *p++='\0';
+    port=atoi(p);
+  }
+  if (port <= 0 || port > 65535) {
+    fprintf(stderr, "%s| %s: Invalid port in CLDAP_SERVER=%s\n",LogTime(), PROGRAM,env);
+    free(host);
+    return(0);
+  }
+  if (margs->debug)
+    fprintf(stderr, "%s| %s: Netlogon ping goes to CLDAP_SERVER %s port %d\n",LogTime(), PROGRAM,host,port);
+  *hlist=(struct hstruct *)calloc(1,sizeof(struct hstruct));
+  (*hlist)[0].host=host;
+  (*hlist)[0].port=port;
+  return(1);
+}
+
+/*
+ * Site of the helper in domain or NULL if unknown
+ */
+char *get_site(struct main_args *margs, char *domain) {
+  struct ststruct *sp;
+  struct hstruct *hlist=NULL;
+  time_t now;
+  int i,nhosts;
+
+  now=time(NULL);
+  for (sp=sites; sp; sp=sp->next) {
+    if (!strcasecmp(sp->domain,domain))
+      break;
+  }
+  if (sp && sp->expires > now)
+    return(sp->site);
+  if (!sp) {
+    sp=(struct ststruct *)calloc(1,sizeof(struct ststruct));
+    sp->domain=strdup(domain);
+    sp->next=sites;
+    sites=sp;
+  }
+  if (sp->site)
+    free(sp->site);
+
+  if (!(nhosts=cldap_server(margs,&hlist))) {
+    nhosts=get_srv_hostname_list(margs,&hlist,0,NULL,domain);
+    /* the netlogon ping always goes to the udp ldap port */
+    for (i=0;i<nhosts;i++)
+      hlist[i].port=CLDAP_PORT;
+  }
+  sp->site=cldap_site(margs,domain,hlist,nhosts);
+  free_hostname_list(&hlist,nhosts);
+  sp->expires=now+(sp->site?SITE_TTL:SITE_NEG_TTL);
+  if (sp->site)
+    fprintf(stderr, "%s| %s: Using ldap servers of site %s for domain %s\n",LogTime(), PROGRAM,sp->site,domain);
+  else if (margs->debug)
+    fprintf(stderr, "%s| %s: No site found for domain %s\n",LogTime(), PROGRAM,domain);
+  return(sp->site);
+}
+
+void site_cleanup(void) {
+  struct ststruct *sp;
+
+  while ((sp=sites)) {
+    sites=sp->next;
+    free(sp->domain);
+    if (sp->site)
+      free(sp->site);
+    free(sp);
+  }
+}
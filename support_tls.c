@@ -0,0 +1,181 @@
+/*
+ * -----------------------------------------------------------------------------
+ *
+ * Author: Markus Moeller (markus_moeller at compuserve.com)
+ *
+ * Copyright (C) 2007 Markus Moeller. All rights reserved.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * -----------------------------------------------------------------------------
+ */
+
+
+#include "support.h"
+
+#ifdef TLS_RESUME
+#include <openssl/ssl.h>
+
+/*
+ * TLS session resumption
+ *
+ * OpenLDAP does a full TLS handshake for every StartTLS or ldaps
+ * connection. With the OpenSSL backend the session of the last connection
+ * to a server is kept here and offered again from the TLS connect callback,
+ * which runs right before the handshake. Servers which still know the
+ * session (or accept its ticket) skip the certificate exchange and key
+ * agreement. The number of full and resumed handshakes is logged.
+ */
+
+struct tlstruct {
+  char *host;
+  SSL_SESSION *session;
+  struct tlstruct *next;
+};
+
+static struct tlstruct *tsessions=NULL;
+static int tls_enabled=0;
+static long tls_full=0;
+static long tls_resumed=0;
+
+static char *tls_host(LDAP *ld);
+static struct tlstruct *tls_get(char *host,int create);
+static int tls_connect_cb(LDAP *ld, void *ssl, void *ctx, void *arg);
+
+/*
+ * Server name of the connection ld
+ */
+static char *tls_host(LDAP *ld) {
+  char *uri=NULL,*host=NULL;
+  LDAPURLDesc *url=NULL;
+
+  if (ldap_get_option(ld,LDAP_OPT_URI,&uri) != LDAP_OPT_SUCCESS || !uri)
+    return(NULL);
+  if (ldap_url_parse(uri,&url) == LDAP_SUCCESS) {
+    if (url->lud_host)
+      host=strdup(url->lud_host);
+    ldap_free_urldesc(url);
+  }
+  ldap_memfree(uri);
+  return(host);
+}
+
+static struct tlstruct *tls_get(char *host,int create) {
+  struct tlstruct *tp;
+
+  if (!host)
+    return(NULL);
+  for (tp=tsessions; tp; tp=tp->next) {
+    if (!strcasecmp(tp->host,host))
+      return(tp);
+  }
+  if (!create)
+    return(NULL);
+  tp=(struct tlstruct *)calloc(1,sizeof(struct tlstruct));
+  tp->host=strdup(host);
+  tp->next=tsessions;
+  tsessions=tp;
+  return(tp);
+}
+
+/*
+ * Called by OpenLDAP before the TLS handshake
+ */
+static int tls_connect_cb(LDAP *ld, void *ssl, void *ctx, void *arg) {
+  struct main_args *margs=(struct main_args *)arg;
+  struct tlstruct *tp;
+  char *host;
+
+  ctx = ctx;
+  host=tls_host(ld);
+  tp=tls_get(host,0);
+  if (tp && tp->session && SSL_set_session((SSL *)ssl,tp->session) == 1) {
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: Offer cached TLS session to ldap server %s\n",LogTime(), PROGRAM,host);
+  }
+  if (host)
+    free(host);
+  return 0;
+}
+
+/*
+ * Install the connect callback (only with the OpenSSL backend)
+ */
+void tls_init(struct main_args *margs) {
+  char *pkg=NULL;
+
+  if (tls_enabled)
+    return;
+  tls_enabled=-1;
+  if (ldap_get_option(NULL,LDAP_OPT_X_TLS_PACKAGE,&pkg) != LDAP_OPT_SUCCESS || !pkg || strcmp(pkg,"OpenSSL")) {
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: TLS session resumption not supported with TLS library %s\n",LogTime(), PROGRAM,pkg?pkg:"unknown");
+    if (pkg)
+      ldap_memfree(pkg);
+    return;
+  }
+  ldap_memfree(pkg);
+  if (ldap_set_option(NULL,LDAP_OPT_X_TLS_CONNECT_CB,(void *)tls_connect_cb) != LDAP_OPT_SUCCESS ||
+      ldap_set_option(NULL,LDAP_OPT_X_TLS_CONNECT_ARG,(void *)margs) != LDAP_OPT_SUCCESS) {
+    fprintf(stderr, "%s| %s: Error while setting TLS connect callback\n",LogTime(), PROGRAM);
+    return;
+  }
+  tls_enabled=1;
+}
+
+/*
+ * Count the handshake of the (bound) connection ld and keep its session
+ * for the next connection to the same server
+ */
+void tls_save(struct main_args *margs,LDAP *ld) {
+  struct tlstruct *tp;
+  SSL *ssl=NULL;
+  char *host;
+
+  if (tls_enabled != 1)
+    return;
+  if (ldap_get_option(ld,LDAP_OPT_X_TLS_SSL_CTX,&ssl) != LDAP_OPT_SUCCESS || !ssl)
+    return;
+  if (SSL_session_reused(ssl))
+    tls_resumed++;
+  else
+    tls_full++;
+  host=tls_host(ld);
+  tp=tls_get(host,1);
+  if (tp) {
+    if (tp->session)
+      SSL_SESSION_free(tp->session);
+    tp->session=SSL_get1_session(ssl);
+  }
+  if (margs->debug)
+    fprintf(stderr, "%s| %s: %s TLS handshake with ldap server %s. Handshakes: %ld full, %ld resumed\n",LogTime(), PROGRAM,SSL_session_reused(ssl)?"Resumed":"Full",host?host:"unknown",tls_full,tls_resumed);
+  if (host)
+    free(host);
+}
+
+void tls_cleanup(void) {
+  struct tlstruct *tp;
+
+  if (tls_full+tls_resumed > 0)
+    fprintf(stderr, "%s| %s: TLS handshakes: %ld full, %ld resumed (%ld%%)\n",LogTime(), PROGRAM,tls_full,tls_resumed,100*tls_resumed/(tls_full+tls_resumed));
+  while ((tp=tsessions)) {
+    tsessions=tp->next;
+    if (tp->session)
+      SSL_SESSION_free(tp->session);
+    free(tp->host);
+    free(tp);
+  }
+}
+#endif
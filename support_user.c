@@ -0,0 +1,251 @@
+/*
+ * -----------------------------------------------------------------------------
+ *
+ * Author: Markus Moeller (markus_moeller at compuserve.com)
+ *
+ * Copyright (C) 2007 Markus Moeller. All rights reserved.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * -----------------------------------------------------------------------------
+ */
+
+#include <ctype.h>
+
+#include "support.h"
+struct usstruct *init_us(void);
+
+struct usstruct *init_us(void) {
+  struct usstruct *ussp;
+  ussp=(struct usstruct *)malloc(sizeof(struct usstruct));
+  ussp->suffix=NULL;
+  ussp->domain=NULL;
+  ussp->next=NULL;
+  return ussp;
+}
+
+int create_us(struct main_args *margs) {
+  char *np,*dp;
+  char *p;
+  struct usstruct *ussp=NULL,*usspn=NULL;
+  /*
+   *  upn suffix list format:
+   *
+   *     mlist=Pattern1[:Pattern2]
+   *
+   *     Pattern=UPN-Suffix@Domain    UPN suffix used by users of a specific Kerberos domain
+   *                             usstruct.domain=Domain, usstruct.suffix=UPN-Suffix
+   *
+   *
+   */
+  p=margs->mlist;
+  np=margs->mlist;
+  if (margs->debug)
+    fprintf(stderr, "%s| %s: UPN suffix list %s\n",LogTime(), PROGRAM,margs->mlist?margs->mlist:"NULL");
+  dp=NULL;
+
+  if (!p) {
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: No UPN suffixes defined.\n",LogTime(), PROGRAM);
+    return(0);
+  }
+  while (*p) { /* loop over suffix list */
+    if ( *p == '\n' || *p == '\r' ) { /* Ignore CR and LF if exist */
+      p++;
+      continue;
+    }
+    if ( *p == '@' ) { /* end of suffix - start of domain name */
+      if (p == np) { /* empty suffix not allowed */
+	if (margs->debug)
+	  fprintf(stderr, "%s| %s: No UPN suffix defined for domain %s\n",LogTime(), PROGRAM,p);
+	return(1);
+      }
+      *p = '\0';
+      p++; 
+      ussp=init_us();
+      ussp->suffix=strdup(np);
+      if (usspn) /* Have already an existing structure */
+	ussp->next=usspn;
+      dp=p; /* after @ starts new domain name */ 
+    } else if ( *p == ':' ) { /* end of suffix or end of domain name */
+      if (p == np) { /* empty suffix not allowed */
+	if (margs->debug)
+	  fprintf(stderr, "%s| %s: No UPN suffix defined for domain %s\n",LogTime(), PROGRAM,p);
+	return(1);
+      }
+      *p = '\0';
+      p++;
+      if (dp) {  /* end of domain name */
+	ussp->domain=strdup(dp);
+	dp=NULL;
+      } else { /* end of suffix and no domain name */
+	ussp=init_us();
+	ussp->suffix=strdup(np);
+	if (usspn) /* Have already an existing structure */
+	  ussp->next=usspn;
+      }
+      usspn=ussp; 
+      np=p; /* after : starts new suffix */ 
+      if (!ussp->domain || !strcmp(ussp->domain,"")) {
+        if (margs->debug)
+          fprintf(stderr, "%s| %s: No domain defined for UPN suffix %s\n",LogTime(), PROGRAM,ussp->suffix);
+        return(1);
+      }
+      if (margs->debug) 
+	fprintf(stderr, "%s| %s: UPN suffix %s  Domain %s\n",LogTime(), PROGRAM,ussp->suffix,ussp->domain);
+    } else 
+      p++;
+  }
+  if (p == np) { /* empty suffix not allowed */
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: No UPN suffix defined for domain %s\n",LogTime(), PROGRAM,p);
+    return(1);
+  }
+  if (dp) {  /* end of domain name */
+    ussp->domain=strdup(dp);
+  } else { /* end of suffix and no domain name */
+    ussp=init_us();
+    ussp->suffix=strdup(np);
+    if (usspn) /* Have already an existing structure */
+      ussp->next=usspn;
+  }
+  if (!ussp->domain || !strcmp(ussp->domain,"")) {
+    if (margs->debug)
+      fprintf(stderr, "%s| %s: No domain defined for UPN suffix %s\n",LogTime(), PROGRAM,ussp->suffix);
+    return(1);
+  }
+  if (margs->debug) 
+    fprintf(stderr, "%s| %s: UPN suffix %s  Domain %s\n",LogTime(), PROGRAM,ussp->suffix,ussp->domain);
+
+  margs->usfxs=ussp; 
+  return(0);
+}
+
+char *get_upn_domain(struct main_args *margs,char *suffix) {
+  struct usstruct *us;
+
+  us = margs->usfxs;
+  while(us && suffix) {
+    if (us->suffix && !strcasecmp(us->suffix,suffix)) {
+      if (margs->debug)
+        fprintf(stderr,"%s| %s: Found upnsuffix@domain %s@%s\n",LogTime(), PROGRAM,us->suffix,us->domain);
+      return(us->domain);
+    }
+    us = us->next;
+  }
+
+  return NULL;
+}
+
+/*
+ * Map the different user formats squid can send
+ *
+ *   NETBIOS\user, NETBIOS%5Cuser  netbios name mapped with -N
+ *   user@UPN-SUFFIX               UPN suffix mapped with -M
+ *   user@REALM                    Kerberos principal
+ *   user                          default domain from -D (if any)
+ *
+ * to one (domain, sAMAccountName) pair. The cache key folds the case of
+ * both parts as AD compares them case insensitive.
+ */
+int canon_user(struct main_args *margs,char *input,struct custruct *cu) {
+  char *user,*domain=NULL;
+  char *nuser,*nuser8=NULL,*netbios;
+  char *c;
+
+  cu->user=NULL;
+  cu->domain=NULL;
+  cu->key=NULL;
+
+  if (!input || !*input)
+    return(1);
+
+  user = input;
+  nuser = strchr(user, '\\');
+  if (!nuser)
+    nuser8 = strstr(user, "%5C");
+  if (!nuser && !nuser8) 
+    nuser8 = strstr(user, "%5c");
+  if (nuser || nuser8) {
+    if (nuser) {
+      *nuser = '\0';
+      nuser++;
+    } else {
+      *nuser8 = '\0';
+      nuser=nuser8+3;
+    }
+    netbios=user;
+    if (margs->debug || margs->log)
+      fprintf(stderr, "%s| %s: Got User: %s Netbios Name: %s\n",LogTime(), PROGRAM,nuser,netbios);
+    domain=get_netbios_name(margs,netbios);
+    user=nuser;
+  } else if ((c=strrchr(user, '@'))) {
+    *c = '\0';
+    c++;
+    domain=get_upn_domain(margs,c);
+    if (domain) {
+      if (margs->debug || margs->log)
+        fprintf(stderr, "%s| %s: Got User: %s UPN suffix: %s\n",LogTime(), PROGRAM,user,c);
+    } else
+      domain=c;
+  }
+  if (!*user)
+    return(1);
+  if ((!domain || !*domain) && margs->ddomain) {
+    domain=margs->ddomain;
+    if (margs->debug || margs->log)
+      fprintf(stderr, "%s| %s: Got User: %s set default domain: %s\n",LogTime(), PROGRAM,user,domain);
+  }
+
+  cu->user=strdup(user);
+  if (domain && *domain) {
+    cu->domain=strdup(domain);
+    strup(cu->domain);
+  }
+
+  cu->key=cache_key(cu->user,cu->domain);
+
+  return(0);
+}
+
+/*
+ * Cache key of user in domain: lower case user @ upper case domain
+ */
+char *cache_key(char *user,char *domain) {
+  char *key,*c;
+  size_t len;
+
+  len=strlen(user)+(domain?strlen(domain):0)+2;
+  key=malloc(len);
+  snprintf(key,len,"%s@%s",user,domain?domain:"");
+  for (c=key; *c && *c != '@'; c++)
+    *c = tolower((unsigned char)*c);
+  if (*c)
+    strup(c);
+
+  return(key);
+}
+
+void clean_cu(struct custruct *cu) {
+  if (cu->user)
+    free(cu->user);
+  cu->user=NULL;
+  if (cu->domain)
+    free(cu->domain);
+  cu->domain=NULL;
+  if (cu->key)
+    free(cu->key);
+  cu->key=NULL;
+}